@@ -0,0 +1,93 @@
+#include "aov.hpp"
+#include <algorithm>
+
+namespace {
+
+const char* const kAovNames[kAovCount] = {"depth", "normal", "albedo", "objectid", "direct", "visibility"};
+
+// pixelCount zeros if wanted, released otherwise
+template <typename T>
+void sizeSums(std::vector<T>& sums, bool wanted, size_t pixelCount) {
+    if (wanted) sums.assign(pixelCount, T());
+    else std::vector<T>().swap(sums);
+}
+
+}  // namespace
+
+const char* aovName(Aov aov) {
+    int index = static_cast<int>(aov);
+    return index >= 0 && index < kAovCount ? kAovNames[index] : "unknown";
+}
+
+bool parseAov(const std::string& name, Aov& aov) {
+    for (int i = 0; i < kAovCount; ++i) {
+        if (name == kAovNames[i]) {
+            aov = static_cast<Aov>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+int aovChannels(Aov aov) { return aov == Aov::Normal || aov == Aov::Albedo || aov == Aov::DirectLight ? 3 : 1; }
+
+void AovBuffers::reserve(AovMask mask, size_t pixelCount) {
+    if (mask == recorded && pixelCount == pixels) return;
+    recorded = mask;
+    pixels = pixelCount;
+    sizeSums(counts, mask != 0, pixelCount);
+    sizeSums(depthSum, has(Aov::Depth), pixelCount);
+    sizeSums(normalSum, has(Aov::Normal), pixelCount);
+    sizeSums(albedoSum, has(Aov::Albedo), pixelCount);
+    sizeSums(objectIds, has(Aov::ObjectId), pixelCount);
+    sizeSums(directSum, has(Aov::DirectLight), pixelCount);
+    sizeSums(visibilitySum, has(Aov::ShadowVisibility), pixelCount);
+    sizeSums(squareSum, (mask & kGuideSquares) != 0, pixelCount);
+}
+
+void AovBuffers::add(size_t index, const AovSum& sum, bool first) {
+    // A pixel sampled before its AOVs were requested starts over too
+    if (first || counts[index] == 0) {
+        counts[index] = sum.count;
+        if (!depthSum.empty()) depthSum[index] = sum.depth;
+        if (!normalSum.empty()) normalSum[index] = sum.normal;
+        if (!albedoSum.empty()) albedoSum[index] = sum.albedo;
+        if (!objectIds.empty()) objectIds[index] = static_cast<float>(sum.objectId);
+        if (!directSum.empty()) directSum[index] = sum.direct;
+        if (!visibilitySum.empty()) visibilitySum[index] = sum.visibility;
+        if (!squareSum.empty()) squareSum[index] = sum.squares;
+        return;
+    }
+    counts[index] += sum.count;
+    if (!depthSum.empty()) depthSum[index] += sum.depth;
+    if (!normalSum.empty()) normalSum[index] = normalSum[index] + sum.normal;
+    if (!albedoSum.empty()) albedoSum[index] = albedoSum[index] + sum.albedo;
+    if (!directSum.empty()) directSum[index] = directSum[index] + sum.direct;
+    if (!visibilitySum.empty()) visibilitySum[index] += sum.visibility;
+    if (!squareSum.empty()) squareSum[index] = squareSum[index] + sum.squares;
+}
+
+bool AovBuffers::average(Aov aov, std::vector<Vec3>& out) const {
+    if (!has(aov)) return false;
+    out.resize(pixels);
+    for (size_t i = 0; i < pixels; ++i) {
+        float n = samples(i);
+        switch (aov) {
+            case Aov::Depth: out[i] = Vec3(1, 1, 1) * (depthSum[i] / n); break;
+            case Aov::Normal: out[i] = normalSum[i] / n; break;
+            case Aov::Albedo: out[i] = albedoSum[i] / n; break;
+            case Aov::ObjectId: out[i] = Vec3(objectIds[i], objectIds[i], objectIds[i]); break;
+            case Aov::DirectLight: out[i] = directSum[i] / n; break;
+            case Aov::ShadowVisibility: out[i] = Vec3(1, 1, 1) * (visibilitySum[i] / n); break;
+        }
+    }
+    return true;
+}
+
+Vec3 AovBuffers::guideVariance(size_t index) const {
+    if (squareSum.empty() || counts[index] < 2) return Vec3();
+    float n = samples(index);
+    Vec3 mean(normal(index).dot(normal(index)), albedo(index).dot(albedo(index)), depth(index) * depth(index));
+    Vec3 spread = squareSum[index] / n - mean;
+    return Vec3(std::max(spread.x, 0.0f), std::max(spread.y, 0.0f), std::max(spread.z, 0.0f)) / (n - 1.0f);
+}
@@ -0,0 +1,104 @@
+#ifndef AOV_HPP
+#define AOV_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "utilities.hpp"
+
+// Arbitrary output variables: images of what the camera rays saw first,
+// recorded in the same pass as the color. Request them as a mask, e.g.
+// tracer.aovs = aovBit(Aov::Depth) | aovBit(Aov::Normal);
+enum class Aov {
+    Depth,            // Distance along the camera ray, 0 for the sky
+    Normal,           // Unit surface normal, 0 for the sky
+    Albedo,           // Material or plane color, the sky color for the sky
+    ObjectId,         // Sphere index of the pixel's first sample, -2 for the plane, -1 for the sky
+    DirectLight,      // Light from the lights after shadows, before albedo and without ambient
+    ShadowVisibility  // Share of that light that wasn't blocked, 1 where none arrives
+};
+const int kAovCount = 6;
+
+typedef uint32_t AovMask;
+inline AovMask aovBit(Aov aov) { return 1u << static_cast<int>(aov); }
+const AovMask kAllAovs = (1u << kAovCount) - 1;
+// Not an image: squared lengths of normal, albedo and depth, summed for the
+// denoiser's guide variance
+const AovMask kGuideSquares = 1u << kAovCount;
+
+// Lowercase names used on the command line and in file names: depth, normal,
+// albedo, objectid, direct, visibility
+const char* aovName(Aov aov);
+bool parseAov(const std::string& name, Aov& aov);
+// 1 for scalars, 3 for colors and normals
+int aovChannels(Aov aov);
+
+// One camera sample's AOVs, filled in by trace and shade on request
+struct PrimaryHit {
+    Vec3 albedo;
+    Vec3 normal;
+    float depth = 0.0f;
+    int objectId = -1;
+    Vec3 direct;
+    float visibility = 1.0f;
+};
+
+// PrimaryHits of some samples of one pixel added up, only the parts in mask
+struct AovSum {
+    Vec3 albedo, normal, direct;
+    float depth = 0.0f, visibility = 0.0f;
+    int objectId = -1;  // Of the first sample
+    int count = 0;
+    Vec3 squares;       // See kGuideSquares
+
+    void add(const PrimaryHit& hit, AovMask mask) {
+        if (count++ == 0) objectId = hit.objectId;
+        if (mask & aovBit(Aov::Depth)) depth += hit.depth;
+        if (mask & aovBit(Aov::Normal)) normal = normal + hit.normal;
+        if (mask & aovBit(Aov::Albedo)) albedo = albedo + hit.albedo;
+        if (mask & aovBit(Aov::DirectLight)) direct = direct + hit.direct;
+        if (mask & aovBit(Aov::ShadowVisibility)) visibility += hit.visibility;
+        if (mask & kGuideSquares) {
+            squares = squares + Vec3(hit.normal.dot(hit.normal), hit.albedo.dot(hit.albedo), hit.depth * hit.depth);
+        }
+    }
+};
+
+// Per pixel sums of the requested AOVs. Only those get memory and are added
+// to, the rest cost nothing.
+class AovBuffers {
+public:
+    // Sizes the sums of mask for pixelCount pixels, keeps them if that's what
+    // they already hold and clears them otherwise
+    void reserve(AovMask mask, size_t pixelCount);
+    AovMask mask() const { return recorded; }
+    bool has(Aov aov) const { return (recorded & aovBit(aov)) != 0; }
+
+    // Adds sum to a pixel, or replaces what it held if first
+    void add(size_t index, const AovSum& sum, bool first);
+
+    // Averages over each pixel's samples, scalars repeated in all three channels.
+    // False if aov isn't recorded.
+    bool average(Aov aov, std::vector<Vec3>& pixels) const;
+    float depth(size_t index) const { return depthSum[index] / samples(index); }
+    Vec3 normal(size_t index) const { return normalSum[index] / samples(index); }
+    Vec3 albedo(size_t index) const { return albedoSum[index] / samples(index); }
+    // Variances of the normal, albedo and depth means with kGuideSquares, 0 with a single sample
+    Vec3 guideVariance(size_t index) const;
+
+private:
+    float samples(size_t index) const { return static_cast<float>(counts[index] > 0 ? counts[index] : 1); }
+
+    AovMask recorded = 0;
+    size_t pixels = 0;
+    std::vector<int> counts;
+    std::vector<float> depthSum;
+    std::vector<Vec3> normalSum;
+    std::vector<Vec3> albedoSum;
+    std::vector<float> objectIds;
+    std::vector<Vec3> directSum;
+    std::vector<float> visibilitySum;
+    std::vector<Vec3> squareSum;
+};
+
+#endif
@@ -0,0 +1,514 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "raytracer.hpp"
+#include "scene.hpp"
+#include "pixelformat.hpp"
+
+// Micro and macro benchmarks for the tracing kernels.
+// Every result is one JSON object per line, so runs can be diffed or loaded
+// into a script to compare builds.
+
+using Clock = std::chrono::steady_clock;
+
+static volatile float sink;  // Keeps results alive so the optimizer can't drop the work
+
+struct BenchConfig {
+    double minSeconds = 0.25;  // Minimum measuring time per microbenchmark
+    int frameRepeats = 3;      // renderFrame runs per configuration, best one is reported
+    int threads = 0;
+    bool quick = false;
+};
+
+class Reporter {
+public:
+    explicit Reporter(std::ostream* file) : file(file) {}
+
+    void emit(const std::string& json) {
+        std::cout << json << std::endl;
+        if (file) *file << json << "\n";
+    }
+
+private:
+    std::ostream* file;
+};
+
+// Fills the tracer with `count` random spheres in front of the default camera,
+// keeping the light and ground of setupScene. Colors come from a small palette
+// of shared materials.
+static void buildRandomScene(RayTracer& tracer, int count, uint32_t seed) {
+    tracer.setupScene();
+    Sphere ground = tracer.spheres.back();
+    Vec3 groundColor = tracer.sphereMaterial(static_cast<int>(tracer.spheres.size()) - 1).color;
+    tracer.clearSpheres();
+
+    SampleRNG rng(seed, 0, 0, 0);
+    for (int i = 0; i < 64; ++i) tracer.addMaterial(Vec3(rng.next(), rng.next(), rng.next()));
+    float radius = 0.5f / std::cbrt(std::max(count, 1) / 4.0f);
+    for (int i = 0; i < count; ++i) {
+        Vec3 center(rng.next() * 6.0f - 3.0f, rng.next() * 2.5f - 0.5f, rng.next() * 6.0f - 4.0f);
+        uint32_t material = static_cast<uint32_t>(rng.next() * 64.0f) & 63;
+        tracer.addSphere(Sphere(center, radius * (0.5f + rng.next())), material);
+    }
+    tracer.addSphere(ground, tracer.addMaterial(groundColor));
+    tracer.commitScene();
+}
+
+// Random camera-ish rays aimed at the scene volume
+static std::vector<Ray> makeRays(const RayTracer& tracer, int count) {
+    std::vector<Ray> rays;
+    rays.reserve(count);
+    SampleRNG rng(1, 0, 0, 0);
+    for (int i = 0; i < count; ++i) {
+        Vec3 target(rng.next() * 6.0f - 3.0f, rng.next() * 3.0f - 1.0f, rng.next() * 6.0f - 4.0f);
+        rays.emplace_back(tracer.cameraPosition, (target - tracer.cameraPosition).normalize());
+    }
+    return rays;
+}
+
+// Runs body(i) over [0, n) repeatedly until minSeconds have passed, returns ns per call
+template <typename Body>
+static double measure(const BenchConfig& config, int n, Body body) {
+    body(0);  // Warm up
+    long long calls = 0;
+    auto start = Clock::now();
+    double elapsed = 0.0;
+    do {
+        for (int i = 0; i < n; ++i) body(i);
+        calls += n;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    } while (elapsed < config.minSeconds);
+    return elapsed * 1e9 / calls;
+}
+
+static std::string rayResult(const std::string& name, int spheres, double nsPerRay) {
+    std::ostringstream out;
+    out << "{\"benchmark\":\"" << name << "\",\"spheres\":" << spheres
+        << ",\"ns_per_ray\":" << nsPerRay << ",\"mrays_per_s\":" << 1e3 / nsPerRay << "}";
+    return out.str();
+}
+
+static void benchSphereIntersect(const BenchConfig& config, Reporter& reporter) {
+    RayTracer tracer(64, 64);
+    tracer.setupScene();
+    std::vector<Ray> rays = makeRays(tracer, 4096);
+    const Sphere& sphere = tracer.spheres.front();
+
+    float acc = 0.0f;
+    double ns = measure(config, static_cast<int>(rays.size()), [&](int i) { acc += sphere.intersect(rays[i]); });
+    sink = acc;
+    reporter.emit(rayResult("Sphere::intersect", 1, ns));
+}
+
+// Linear scalar loop, the SoA kernel and the BVH over the same scene
+static void benchSphereKernels(const BenchConfig& config, Reporter& reporter, int sphereCount) {
+    RayTracer tracer(64, 64);
+    buildRandomScene(tracer, sphereCount, 7);
+    std::vector<Ray> rays = makeRays(tracer, 4096);
+    SphereSoA soa;
+    soa.build(tracer.spheres);
+
+    float acc = 0.0f;
+    double ns;
+    // The linear loops take seconds per sweep on the largest scenes
+    if (sphereCount <= 65536) {
+        ns = measure(config, static_cast<int>(rays.size()), [&](int i) {
+            float closest = std::numeric_limits<float>::max();
+            for (const Sphere& sphere : tracer.spheres) {
+                float t = sphere.intersect(rays[i]);
+                if (t > 0 && t < closest) closest = t;
+            }
+            acc += closest;
+        });
+        reporter.emit(rayResult("Sphere::intersect loop", sphereCount, ns));
+
+        ns = measure(config, static_cast<int>(rays.size()), [&](int i) {
+            float closest = std::numeric_limits<float>::max();
+            acc += soa.intersectClosest(rays[i], closest);
+        });
+        reporter.emit(rayResult("SphereSoA::intersectClosest", sphereCount, ns));
+    }
+
+    ns = measure(config, static_cast<int>(rays.size()), [&](int i) {
+        float closest = std::numeric_limits<float>::max();
+        acc += tracer.bvh.closestHit(rays[i], closest);
+    });
+    reporter.emit(rayResult("BVH::closestHit", sphereCount, ns));
+
+    ns = measure(config, static_cast<int>(rays.size()), [&](int i) {
+        acc += tracer.bvh.anyHit(rays[i], std::numeric_limits<float>::max());
+    });
+    sink = acc;
+    reporter.emit(rayResult("BVH::anyHit", sphereCount, ns));
+}
+
+// Same query with every sphere moving about one radius over the shutter, rays at
+// spread out times. Shows what the swept bounds cost the BVH.
+static void benchMotion(const BenchConfig& config, Reporter& reporter, int sphereCount) {
+    RayTracer tracer(64, 64);
+    buildRandomScene(tracer, sphereCount, 7);
+    SampleRNG rng(3, 0, 0, 0);
+    tracer.sphereVelocities.assign(tracer.spheres.size(), Vec3());
+    for (size_t i = 0; i + 1 < tracer.spheres.size(); ++i) {  // The ground stays put
+        Vec3 direction = Vec3(rng.next() - 0.5f, rng.next() - 0.5f, rng.next() - 0.5f).normalize();
+        tracer.sphereVelocities[i] = direction * (tracer.spheres[i].radius / tracer.shutter);
+    }
+    tracer.commitScene();
+    std::vector<Ray> rays = makeRays(tracer, 4096);
+    for (size_t i = 0; i < rays.size(); ++i) rays[i].time = tracer.shutter * (i + 0.5f) / rays.size();
+
+    float acc = 0.0f;
+    double ns = measure(config, static_cast<int>(rays.size()), [&](int i) {
+        float closest = std::numeric_limits<float>::max();
+        acc += tracer.bvh.closestHit(rays[i], closest);
+    });
+    sink = acc;
+    reporter.emit(rayResult("BVH::closestHit moving", sphereCount, ns));
+}
+
+// Build time matters for the large scenes, report it next to the ray numbers
+static void benchBVHBuild(Reporter& reporter, int sphereCount) {
+    RayTracer tracer(64, 64);
+    auto start = Clock::now();
+    buildRandomScene(tracer, sphereCount, 7);
+    double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    SceneMemory memory = tracer.memoryUsage();
+
+    std::ostringstream out;
+    out << "{\"benchmark\":\"BVH::build\",\"spheres\":" << tracer.spheres.size()
+        << ",\"nodes\":" << tracer.bvh.nodeCount() << ",\"build_ms\":" << ms
+        << ",\"scene_bytes\":" << memory.total() << ",\"bvh_bytes\":" << memory.bvh
+        << ",\"bytes_per_sphere\":" << static_cast<double>(memory.total()) / tracer.spheres.size() << "}";
+    reporter.emit(out.str());
+}
+
+// Startup cost of a scene file: parsing the text (BVH build included) against
+// mapping the binary form with its saved BVH
+static void benchSceneLoad(Reporter& reporter, int sphereCount) {
+    RayTracer tracer(64, 64);
+    buildRandomScene(tracer, sphereCount, 7);
+    std::string textPath = "bench_scene_" + std::to_string(sphereCount) + ".scene";
+    std::string binaryPath = textPath + ".bin";
+    if (!saveSceneText(textPath, tracer) || !saveSceneBinary(binaryPath, tracer)) return;
+
+    RayTracer loaded(64, 64);
+    auto start = Clock::now();
+    bool ok = loadSceneText(textPath, loaded);
+    double textMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    start = Clock::now();
+    ok = ok && loadSceneBinary(binaryPath, loaded);
+    double binaryMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    std::remove(textPath.c_str());
+    std::remove(binaryPath.c_str());
+    if (!ok) return;
+
+    std::ostringstream out;
+    out << "{\"benchmark\":\"Scene::load\",\"spheres\":" << tracer.spheres.size()
+        << ",\"text_ms\":" << textMs << ",\"binary_ms\":" << binaryMs << "}";
+    reporter.emit(out.str());
+}
+
+static void benchTrace(const BenchConfig& config, Reporter& reporter, int sphereCount) {
+    RayTracer tracer(64, 64);
+    buildRandomScene(tracer, sphereCount, 7);
+    std::vector<Ray> rays = makeRays(tracer, 4096);
+
+    float acc = 0.0f;
+    double ns = measure(config, static_cast<int>(rays.size()), [&](int i) {
+        Sampler sampler(tracer.samplerType, 0, 0, 0, 0, i, 0, 1);
+        acc += tracer.trace(rays[i], sampler).x;
+    });
+    sink = acc;
+    reporter.emit(rayResult("RayTracer::trace", sphereCount, ns));
+}
+
+static void benchComputeLighting(const BenchConfig& config, Reporter& reporter, int sphereCount) {
+    RayTracer tracer(64, 64);
+    buildRandomScene(tracer, sphereCount, 7);
+
+    // Shading points on the surface of random spheres
+    struct ShadePoint { Vec3 point, normal; const Sphere* sphere; };
+    std::vector<ShadePoint> points;
+    SampleRNG rng(2, 0, 0, 0);
+    for (int i = 0; i < 4096; ++i) {
+        const Sphere& sphere = tracer.spheres[static_cast<size_t>(rng.next() * (tracer.spheres.size() - 1))];
+        Vec3 normal = Vec3(rng.next() - 0.5f, rng.next() - 0.5f, rng.next() - 0.5f).normalize();
+        points.push_back({sphere.center + normal * sphere.radius, normal, &sphere});
+    }
+
+    float acc = 0.0f;
+    double ns = measure(config, static_cast<int>(points.size()), [&](int i) {
+        Sampler sampler(tracer.samplerType, 0, 0, 0, 0, i, 0, 1);
+        const ShadePoint& p = points[i];
+        acc += tracer.computeLighting(p.point, p.normal, -p.normal, 0.0f, p.sphere, sampler).x;
+    });
+    sink = acc;
+    reporter.emit(rayResult("RayTracer::computeLighting", sphereCount, ns));
+}
+
+// ns per computeLighting call at 4096 random points on the tracer's spheres,
+// the ground among them
+static double measureShading(const BenchConfig& config, const RayTracer& tracer, SampleRNG& rng) {
+    struct ShadePoint { Vec3 point, normal; const Sphere* sphere; };
+    std::vector<ShadePoint> points;
+    for (int i = 0; i < 4096; ++i) {
+        const Sphere& sphere = tracer.spheres[i % tracer.spheres.size()];
+        Vec3 normal = Vec3(rng.next() - 0.5f, rng.next(), rng.next() - 0.5f).normalize();
+        points.push_back({sphere.center + normal * sphere.radius, normal, &sphere});
+    }
+
+    float acc = 0.0f;
+    double ns = measure(config, static_cast<int>(points.size()), [&](int i) {
+        Sampler sampler(tracer.samplerType, 0, 0, 0, 0, i, 0, 1);
+        const ShadePoint& p = points[i];
+        acc += tracer.computeLighting(p.point, p.normal, -p.normal, 0.0f, p.sphere, sampler).x;
+    });
+    sink = acc;
+    return ns;
+}
+
+// computeLighting on the default spheres lit by lightCount lights scattered
+// around them, with lightSamples 0 (every light) or picking by selection
+static void benchManyLights(const BenchConfig& config, Reporter& reporter, int lightCount, int lightSamples,
+                            LightSelection selection) {
+    RayTracer tracer(64, 64);
+    tracer.setupScene();
+    tracer.lights.clear();
+    SampleRNG rng(3, 0, 0, 0);
+    for (int i = 0; i < lightCount; ++i) {
+        float angle = rng.next() * 6.2831853f, radius = 1.5f + rng.next() * 3.5f;
+        Vec3 position(radius * std::cos(angle), rng.next() * 4.3f - 0.3f, -2.0f + radius * std::sin(angle));
+        tracer.lights.emplace_back(position, (0.2f + rng.next() * 1.6f) / lightCount);
+    }
+    tracer.lightSamples = lightSamples;
+    tracer.lightSelection = selection;
+    tracer.commitScene();
+
+    double ns = measureShading(config, tracer, rng);
+    std::ostringstream out;
+    out << "{\"benchmark\":\"RayTracer::computeLighting lights\",\"lights\":" << lightCount
+        << ",\"light_samples\":" << lightSamples << ",\"selection\":\""
+        << (lightSamples > 0 && lightCount > lightSamples ? lightSelectionName(selection) : "all")
+        << "\",\"ns_per_point\":" << ns << "}";
+    reporter.emit(out.str());
+}
+
+// computeLighting on the default spheres under a single light of the given
+// shape, with shadowSamples rays to it
+static void benchAreaLight(const BenchConfig& config, Reporter& reporter, const Light& light, int shadowSamples) {
+    static const char* const kShapeNames[] = {"point", "sphere", "disk", "quad"};
+    RayTracer tracer(64, 64);
+    tracer.setupScene();
+    tracer.lights.assign(1, light);
+    tracer.shadowSamples = shadowSamples;
+    tracer.commitScene();
+
+    SampleRNG rng(5, 0, 0, 0);
+    double ns = measureShading(config, tracer, rng);
+    std::ostringstream out;
+    out << "{\"benchmark\":\"RayTracer::computeLighting area\",\"shape\":\""
+        << kShapeNames[static_cast<int>(light.shape)] << "\",\"shadow_samples\":" << shadowSamples
+        << ",\"ns_per_point\":" << ns << "}";
+    reporter.emit(out.str());
+}
+
+static void benchJitterApertureRay(const BenchConfig& config, Reporter& reporter) {
+    RayTracer tracer(64, 64, 0.13f, 2.0f);
+    tracer.setupScene();
+    Vec3 focal = tracer.cameraPosition + tracer.forward * tracer.focusDistance;
+
+    float acc = 0.0f;
+    double ns = measure(config, 4096, [&](int i) {
+        Sampler sampler(tracer.samplerType, 0, 0, 0, 0, i, 0, 1);
+        acc += tracer.jitterApertureRay(tracer.cameraPosition, focal, sampler).direction.x;
+    });
+    sink = acc;
+    reporter.emit(rayResult("RayTracer::jitterApertureRay", 0, ns));
+}
+
+static void benchSampler(const BenchConfig& config, Reporter& reporter, SamplerType type) {
+    // One camera sample's worth of dimensions: pixel, lens and one light
+    float acc = 0.0f;
+    double ns = measure(config, 4096, [&](int i) {
+        Sampler sampler(type, 0, 0, i & 63, i >> 6, i, 3, 16);
+        float u, v;
+        sampler.get2D(u, v);
+        acc += u + v;
+        sampler.get2D(u, v);
+        acc += u + v;
+        sampler.startDimension(kDimLights);
+        sampler.get2D(u, v);
+        acc += u + v + sampler.get1D();
+    });
+    sink = acc;
+    std::ostringstream out;
+    out << "{\"benchmark\":\"Sampler\",\"sampler\":\"" << Sampler::name(type)
+        << "\",\"ns_per_sample\":" << ns << "}";
+    reporter.emit(out.str());
+}
+
+// The per-tile resolve pass over a 1080p accumulation, one row per call
+static void benchResolve(const BenchConfig& config, Reporter& reporter, PixelFormat format) {
+    const int width = 1920, height = 1080;
+    std::vector<Vec3> sums(static_cast<size_t>(width) * height);
+    std::vector<int> counts(sums.size());
+    uint32_t state = 1;
+    auto next = [&state]() {
+        state = state * 1664525u + 1013904223u;
+        return static_cast<float>(state >> 8) / 16777216.0f;
+    };
+    for (size_t i = 0; i < sums.size(); ++i) {
+        counts[i] = 16;
+        sums[i] = Vec3(next(), next(), next()) * 24.0f;  // Averages up to 1.5, some past white
+    }
+    std::vector<uint8_t> pixels(sums.size() * bytesPerPixel(format));
+
+    double ns = measure(config, height, [&](int y) {
+        size_t first = static_cast<size_t>(y) * width;
+        resolvePixels(format, &sums[first], &counts[first], width, &pixels[first * bytesPerPixel(format)]);
+    });
+    sink = pixels[pixels.size() / 2];
+    std::ostringstream out;
+    out << "{\"benchmark\":\"resolvePixels\",\"format\":\"" << pixelFormatName(format)
+        << "\",\"bytes_per_pixel\":" << bytesPerPixel(format) << ",\"ns_per_pixel\":" << ns / width << "}";
+    reporter.emit(out.str());
+}
+
+static void benchRenderFrame(const BenchConfig& config, Reporter& reporter, int width, int height,
+                             int samplesPerPixel, int sphereCount, int packetSize, AovMask aovs) {
+    RayTracer tracer(width, height, 0.13f, 2.0f);
+    if (sphereCount > 0) buildRandomScene(tracer, sphereCount, 7);
+    else tracer.setupScene();
+    tracer.setThreadCount(config.threads);
+    tracer.packetSize = packetSize;
+    tracer.aovs = aovs;
+
+    tracer.renderFrame(0.0f, 4.0f, true, 1);  // Warm up the pool and caches
+    double best = 1e30, total = 0.0;
+    for (int r = 0; r < config.frameRepeats; ++r) {
+        auto start = Clock::now();
+        tracer.renderFrame(0.0f, 4.0f, true, samplesPerPixel);
+        double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        best = std::min(best, ms);
+        total += ms;
+    }
+
+    double rays = static_cast<double>(width) * height * samplesPerPixel;
+    std::ostringstream out;
+    out << "{\"benchmark\":\"RayTracer::renderFrame\",\"width\":" << width << ",\"height\":" << height
+        << ",\"spp\":" << samplesPerPixel << ",\"spheres\":" << tracer.spheres.size()
+        << ",\"threads\":" << tracer.getThreadCount() << ",\"packet_size\":" << packetSize;
+    if (packetSize > 0) out << ",\"packet_utilization\":" << tracer.getPacketStats().utilization();
+    if (aovs != 0) out << ",\"aovs\":" << aovs;
+    const RenderCounters& counters = tracer.getStats().counters;
+    out << ",\"sphere_tests_per_ray\":"
+        << static_cast<double>(counters.sphereTests) / std::max<uint64_t>(counters.primaryRays + counters.shadowRays, 1);
+    out << ",\"frame_ms\":" << best
+        << ",\"mean_frame_ms\":" << total / config.frameRepeats
+        << ",\"ns_per_ray\":" << best * 1e6 / rays << ",\"mrays_per_s\":" << rays / (best * 1e3) << "}";
+    reporter.emit(out.str());
+}
+
+static void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [--quick] [--threads N] [--filter NAME] [--out FILE]\n"
+              << "  --quick        smaller sweep with shorter timings\n"
+              << "  --threads N    threads for renderFrame, 0 = all cores (0)\n"
+              << "  --filter NAME  only run benchmarks whose name contains NAME\n"
+              << "  --out FILE     also append results to FILE (JSON lines)\n";
+}
+
+int main(int argc, char** argv) {
+    BenchConfig config;
+    std::string filter, outPath;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--quick") config.quick = true;
+        else if (arg == "--threads" && i + 1 < argc) config.threads = std::atoi(argv[++i]);
+        else if (arg == "--filter" && i + 1 < argc) filter = argv[++i];
+        else if (arg == "--out" && i + 1 < argc) outPath = argv[++i];
+        else { printUsage(argv[0]); return 1; }
+    }
+    if (config.quick) {
+        config.minSeconds = 0.05;
+        config.frameRepeats = 1;
+    }
+
+    std::ofstream file;
+    if (!outPath.empty()) {
+        file.open(outPath, std::ios::app);
+        if (!file.is_open()) {
+            std::cerr << "Failed to open " << outPath << std::endl;
+            return 1;
+        }
+    }
+    Reporter reporter(file.is_open() ? &file : nullptr);
+    auto enabled = [&](const std::string& name) { return filter.empty() || name.find(filter) != std::string::npos; };
+
+    std::vector<int> sceneSizes = config.quick ? std::vector<int>{16, 256, 65536} : std::vector<int>{16, 256, 4096, 65536, 1000000};
+
+    if (enabled("Sphere::intersect")) benchSphereIntersect(config, reporter);
+    if (enabled("RayTracer::jitterApertureRay")) benchJitterApertureRay(config, reporter);
+    if (enabled("Sampler")) {
+        for (SamplerType type : {SamplerType::Independent, SamplerType::Stratified, SamplerType::Halton,
+                                 SamplerType::Sobol, SamplerType::BlueNoise}) {
+            benchSampler(config, reporter, type);
+        }
+    }
+    if (enabled("resolvePixels")) {
+        for (PixelFormat format : {PixelFormat::RGB32F, PixelFormat::RGBA16F, PixelFormat::RGB9E5, PixelFormat::SRGB8}) {
+            benchResolve(config, reporter, format);
+        }
+    }
+    for (int n : sceneSizes) {
+        if (enabled("BVH::build")) benchBVHBuild(reporter, n);
+        if (enabled("Scene::load")) benchSceneLoad(reporter, n);
+        if (enabled("SphereSoA::intersectClosest") || enabled("BVH::closestHit")) benchSphereKernels(config, reporter, n);
+        if (enabled("BVH::closestHit moving")) benchMotion(config, reporter, n);
+        if (enabled("RayTracer::trace")) benchTrace(config, reporter, n);
+        if (enabled("RayTracer::computeLighting")) benchComputeLighting(config, reporter, n);
+    }
+
+    if (enabled("RayTracer::computeLighting lights")) {
+        for (int lights : config.quick ? std::vector<int>{1, 16, 256, 4096} : std::vector<int>{1, 4, 16, 64, 256, 1024, 4096, 65536}) {
+            if (lights <= 256) benchManyLights(config, reporter, lights, 0, LightSelection::Tree);
+            if (lights <= 4) continue;  // 4 samples of at most 4 lights is the exact loop again
+            benchManyLights(config, reporter, lights, 4, LightSelection::Power);
+            benchManyLights(config, reporter, lights, 4, LightSelection::Tree);
+        }
+    }
+
+    if (enabled("RayTracer::computeLighting area")) {
+        Vec3 center(0.0f, 3.0f, -1.0f);
+        benchAreaLight(config, reporter, Light(center, 1.0f), 1);
+        for (int samples : {1, 4, 16}) {
+            benchAreaLight(config, reporter, sphereLight(center, 0.5f, 1.0f), samples);
+            benchAreaLight(config, reporter, diskLight(center, Vec3(0, -1, 0), 0.5f, 1.0f), samples);
+            benchAreaLight(config, reporter, quadLight(center, Vec3(1, 0, 0), Vec3(0, 0, 1), 1.0f), samples);
+        }
+    }
+
+    if (enabled("RayTracer::renderFrame")) {
+        struct FrameCase { int width, height, spp, spheres, packet; AovMask aovs; };
+        AovMask depth = aovBit(Aov::Depth);
+        std::vector<FrameCase> cases = config.quick
+            ? std::vector<FrameCase>{{320, 240, 1, 0, 0, 0}, {320, 240, 4, 0, 0, 0}, {320, 240, 4, 256, 0, 0},
+                                     {320, 240, 4, 256, 8, 0}, {320, 240, 4, 65536, 0, 0}, {320, 240, 4, 65536, 16, 0},
+                                     {320, 240, 4, 0, 0, depth}, {320, 240, 4, 0, 0, kAllAovs}}
+            : std::vector<FrameCase>{{320, 240, 1, 0, 0, 0}, {800, 600, 1, 0, 0, 0}, {800, 600, 4, 0, 0, 0},
+                                     {800, 600, 16, 0, 0, 0}, {1920, 1080, 4, 0, 0, 0}, {800, 600, 4, 256, 0, 0},
+                                     {800, 600, 4, 4096, 0, 0},
+                                     {800, 600, 4, 4096, 4, 0}, {800, 600, 4, 4096, 8, 0}, {800, 600, 4, 4096, 16, 0},
+                                     {800, 600, 4, 65536, 0, 0}, {800, 600, 4, 65536, 16, 0},
+                                     {800, 600, 4, 0, 0, depth}, {800, 600, 4, 0, 0, kAllAovs}, {800, 600, 4, 4096, 8, kAllAovs}};
+        for (const FrameCase& c : cases) {
+            benchRenderFrame(config, reporter, c.width, c.height, c.spp, c.spheres, c.packet, c.aovs);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,436 @@
+#include "bvh.hpp"
+#include <algorithm>
+#include <limits>
+#include "renderstats.hpp"
+
+namespace {
+
+constexpr int kBins = 16;
+constexpr int kMaxLeafSize = 32;
+constexpr float kTraversalCost = 3.0f;  // Two box tests and the stack work, relative to one kernel call
+constexpr float kIntersectCost = 1.0f;  // One kernel iteration, simdWidth spheres
+
+struct Bounds {
+    Vec3 min = Vec3(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+    Vec3 max = Vec3(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+
+    void grow(const Vec3& p) {
+        min = Vec3(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+        max = Vec3(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+    }
+    void grow(const Bounds& b) {
+        grow(b.min);
+        grow(b.max);
+    }
+    float area() const {
+        Vec3 e = max - min;
+        if (e.x < 0) return 0.0f;
+        return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+};
+
+inline float axis(const Vec3& v, int a) {
+    return a == 0 ? v.x : (a == 1 ? v.y : v.z);
+}
+
+struct BuildTask {
+    int node, first, count, depth;
+};
+
+// Slab test against the node box, returns the entry distance through tEntry
+inline bool hitBox(const BVHNode& node, const Vec3& origin, const Vec3& invDir, float tMax, float& tEntry) {
+    float tx1 = (node.boundsMin.x - origin.x) * invDir.x, tx2 = (node.boundsMax.x - origin.x) * invDir.x;
+    float ty1 = (node.boundsMin.y - origin.y) * invDir.y, ty2 = (node.boundsMax.y - origin.y) * invDir.y;
+    float tz1 = (node.boundsMin.z - origin.z) * invDir.z, tz2 = (node.boundsMax.z - origin.z) * invDir.z;
+    float tNear = std::max(std::max(std::min(tx1, tx2), std::min(ty1, ty2)), std::min(tz1, tz2));
+    float tFar = std::min(std::min(std::max(tx1, tx2), std::max(ty1, ty2)), std::max(tz1, tz2));
+    tEntry = tNear;
+    return tNear <= tFar && tFar > 0.0f && tNear < tMax;
+}
+
+inline Vec3 inverse(const Vec3& d) {
+    return Vec3(1.0f / d.x, 1.0f / d.y, 1.0f / d.z);
+}
+
+// Queries count their leaf tests locally and add them once at the end
+inline void countSphereTests(uint64_t tests) {
+    if (RenderCounters* counters = threadCounters()) counters->sphereTests += tests;
+}
+
+}
+
+void BVH::build(const std::vector<Sphere>& spheres, const std::vector<Vec3>& velocities, float shutterTime) {
+    int count = static_cast<int>(spheres.size());
+    shutter = shutterTime;
+    nodes.clear();
+    primIndex.resize(count);
+    primOrder.resize(count);
+    if (count == 0) {
+        leafSpheres.build(spheres);
+        return;
+    }
+
+    std::vector<Bounds> primBounds(count);
+    std::vector<Vec3> centroids(count);
+    for (int i = 0; i < count; ++i) {
+        // Linear motion, so the boxes at both ends of the shutter cover the whole sweep
+        Vec3 r(spheres[i].radius, spheres[i].radius, spheres[i].radius);
+        Vec3 start = spheres[i].center;
+        Vec3 end = velocities.empty() ? start : start + velocities[i] * shutter;
+        primBounds[i].grow(start - r);
+        primBounds[i].grow(start + r);
+        primBounds[i].grow(end - r);
+        primBounds[i].grow(end + r);
+        centroids[i] = (start + end) * 0.5f;
+        primIndex[i] = i;
+    }
+
+    nodes.reserve(2 * count);  // A binary tree over count leaves never needs more
+    nodes.push_back(BVHNode());
+    std::vector<BuildTask> tasks;
+    tasks.push_back({0, 0, count, 0});
+
+    while (!tasks.empty()) {
+        BuildTask task = tasks.back();
+        tasks.pop_back();
+
+        Bounds bounds, centroidBounds;
+        for (int i = task.first; i < task.first + task.count; ++i) {
+            bounds.grow(primBounds[primIndex[i]]);
+            centroidBounds.grow(centroids[primIndex[i]]);
+        }
+        BVHNode& node = nodes[task.node];
+        node.boundsMin = bounds.min;
+        node.boundsMax = bounds.max;
+        node.leftFirst = task.first;
+        node.count = task.count;
+
+        if (task.count <= 2 || task.depth >= kMaxDepth) continue;
+
+        // Binned SAH over all three axes
+        int width = SphereSoA::simdWidth();
+        float bestCost = std::numeric_limits<float>::max();
+        int bestAxis = -1, bestSplit = 0;
+        for (int a = 0; a < 3; ++a) {
+            float lo = axis(centroidBounds.min, a), hi = axis(centroidBounds.max, a);
+            if (hi <= lo) continue;
+            float scale = kBins / (hi - lo);
+
+            Bounds binBounds[kBins];
+            int binCount[kBins] = {};
+            for (int i = task.first; i < task.first + task.count; ++i) {
+                int p = primIndex[i];
+                int b = std::min(kBins - 1, static_cast<int>((axis(centroids[p], a) - lo) * scale));
+                binBounds[b].grow(primBounds[p]);
+                ++binCount[b];
+            }
+
+            // Sweep from the right, then from the left to evaluate every split plane
+            float rightArea[kBins - 1];
+            int rightCount[kBins - 1];
+            Bounds right;
+            int n = 0;
+            for (int b = kBins - 1; b > 0; --b) {
+                right.grow(binBounds[b]);
+                n += binCount[b];
+                rightArea[b - 1] = right.area();
+                rightCount[b - 1] = n;
+            }
+            Bounds left;
+            n = 0;
+            for (int b = 0; b < kBins - 1; ++b) {
+                left.grow(binBounds[b]);
+                n += binCount[b];
+                if (n == 0 || rightCount[b] == 0) continue;
+                float cost = left.area() * ((n + width - 1) / width) + rightArea[b] * ((rightCount[b] + width - 1) / width);
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = a;
+                    bestSplit = b;
+                }
+            }
+        }
+
+        // A leaf is one kernel call per simdWidth spheres, not one test per sphere
+        float leafCost = kIntersectCost * ((task.count + width - 1) / width);
+        float splitCost = bestAxis >= 0 ? kTraversalCost + kIntersectCost * bestCost / bounds.area()
+                                        : std::numeric_limits<float>::max();
+        if (splitCost >= leafCost && task.count <= kMaxLeafSize) continue;
+
+        int* begin = primIndex.data() + task.first;
+        int* end = begin + task.count;
+        int* middle;
+        if (bestAxis >= 0) {
+            float lo = axis(centroidBounds.min, bestAxis);
+            float scale = kBins / (axis(centroidBounds.max, bestAxis) - lo);
+            middle = std::partition(begin, end, [&](int p) {
+                return std::min(kBins - 1, static_cast<int>((axis(centroids[p], bestAxis) - lo) * scale)) <= bestSplit;
+            });
+        } else {
+            // All centroids coincide, split by count so the leaf stays small
+            middle = begin + task.count / 2;
+        }
+
+        int leftCount = static_cast<int>(middle - begin);
+        int leftChild = static_cast<int>(nodes.size());
+        nodes.push_back(BVHNode());
+        nodes.push_back(BVHNode());
+        nodes[task.node].leftFirst = leftChild;
+        nodes[task.node].count = 0;
+        tasks.push_back({leftChild, task.first, leftCount, task.depth + 1});
+        tasks.push_back({leftChild + 1, task.first + leftCount, task.count - leftCount, task.depth + 1});
+    }
+
+    nodes.shrink_to_fit();  // The reserve above is a worst case, leaves usually hold several spheres
+    finishBuild(spheres, velocities);
+}
+
+bool BVH::restore(const std::vector<Sphere>& spheres, const std::vector<Vec3>& velocities, float shutterTime,
+                  const BVHNode* savedNodes, int savedCount, const int* savedIndex) {
+    int count = static_cast<int>(spheres.size());
+    shutter = shutterTime;
+    nodes.clear();
+    primIndex.clear();
+    primOrder.clear();
+    leafSpheres.build(std::vector<Sphere>());
+
+    // primIndex has to be a permutation, or primOrder and the leaves go wrong
+    std::vector<char> seen(count, 0);
+    for (int i = 0; i < count; ++i) {
+        int p = savedIndex[i];
+        if (p < 0 || p >= count || seen[p]) return false;
+        seen[p] = 1;
+    }
+    if ((count == 0) != (savedCount == 0)) return false;
+
+    // Children always come after their parent in build order, which also rules
+    // out cycles. Depth is checked because the traversal stacks are fixed size.
+    std::vector<int> depth(savedCount, -1);
+    if (savedCount > 0) depth[0] = 0;
+    for (int i = 0; i < savedCount; ++i) {
+        const BVHNode& n = savedNodes[i];
+        if (depth[i] < 0 || depth[i] > kMaxDepth) return false;
+        if (n.count > 0) {
+            if (n.leftFirst < 0 || n.leftFirst > count - n.count) return false;
+        } else {
+            if (n.leftFirst <= i || n.leftFirst + 1 >= savedCount) return false;
+            depth[n.leftFirst] = depth[n.leftFirst + 1] = depth[i] + 1;
+        }
+    }
+
+    nodes.assign(savedNodes, savedNodes + savedCount);
+    primIndex.assign(savedIndex, savedIndex + count);
+    primOrder.resize(count);
+    finishBuild(spheres, velocities);
+    return true;
+}
+
+void BVH::finishBuild(const std::vector<Sphere>& spheres, const std::vector<Vec3>& velocities) {
+    int count = static_cast<int>(primIndex.size());
+    std::vector<Sphere> ordered(count);
+    std::vector<Vec3> orderedVelocities(velocities.empty() ? 0 : count);
+    for (int i = 0; i < count; ++i) {
+        ordered[i] = spheres[primIndex[i]];
+        if (!velocities.empty()) orderedVelocities[i] = velocities[primIndex[i]];
+        primOrder[primIndex[i]] = i;
+    }
+    leafSpheres.build(ordered, orderedVelocities);
+}
+
+size_t BVH::memoryBytes() const {
+    return nodes.capacity() * sizeof(BVHNode) + (primIndex.capacity() + primOrder.capacity()) * sizeof(int) +
+           leafSpheres.memoryBytes();
+}
+
+int BVH::closestHit(const Ray& ray, float& tClosest) const {
+    if (nodes.empty()) return -1;
+
+    Vec3 invDir = inverse(ray.direction);
+    float tEntry;
+    if (!hitBox(nodes[0], ray.origin, invDir, tClosest, tEntry)) return -1;
+
+    int hit = traverseClosest(ray, 0, tClosest);
+    return hit >= 0 ? primIndex[hit] : -1;
+}
+
+int BVH::traverseClosest(const Ray& ray, int start, float& tClosest) const {
+    Vec3 invDir = inverse(ray.direction);
+    struct Entry { int node; float t; };
+    Entry stack[kMaxDepth + 1];
+    int stackSize = 0;
+    int node = start;
+    int hit = -1;
+    uint64_t tests = 0;
+
+    while (true) {
+        const BVHNode& n = nodes[node];
+        if (n.count > 0) {
+            tests += n.count;
+            int h = leafSpheres.intersectClosest(ray, n.leftFirst, n.leftFirst + n.count, tClosest);
+            if (h >= 0) hit = h;
+        } else {
+            // Visit the nearer child first, the farther one may be culled by then
+            float tLeft, tRight;
+            bool hitLeft = hitBox(nodes[n.leftFirst], ray.origin, invDir, tClosest, tLeft);
+            bool hitRight = hitBox(nodes[n.leftFirst + 1], ray.origin, invDir, tClosest, tRight);
+            if (hitLeft && hitRight) {
+                bool leftFirst = tLeft <= tRight;
+                stack[stackSize++] = leftFirst ? Entry{n.leftFirst + 1, tRight} : Entry{n.leftFirst, tLeft};
+                node = leftFirst ? n.leftFirst : n.leftFirst + 1;
+                continue;
+            }
+            if (hitLeft || hitRight) {
+                node = hitLeft ? n.leftFirst : n.leftFirst + 1;
+                continue;
+            }
+        }
+
+        // Pop the next subtree that can still hold something closer
+        do {
+            if (stackSize == 0) {
+                countSphereTests(tests);
+                return hit;
+            }
+            --stackSize;
+        } while (stack[stackSize].t >= tClosest);
+        node = stack[stackSize].node;
+    }
+}
+
+uint32_t BVH::hitBoxPacket(const BVHNode& node, const RayPacket& packet, uint32_t mask, float* tEntry) const {
+#if RAYTRACER_SIMD
+    using namespace simd;
+    const vfloat minX = vset1(node.boundsMin.x), minY = vset1(node.boundsMin.y), minZ = vset1(node.boundsMin.z);
+    const vfloat maxX = vset1(node.boundsMax.x), maxY = vset1(node.boundsMax.y), maxZ = vset1(node.boundsMax.z);
+    const vfloat zero = vset1(0.0f);
+
+    uint32_t result = 0;
+    for (int first = 0; first < packet.size; first += kWidth) {
+        if (!((mask >> first) & ((1u << kWidth) - 1))) continue;
+
+        vfloat ox = vload(&packet.ox[first]), oy = vload(&packet.oy[first]), oz = vload(&packet.oz[first]);
+        vfloat ix = vload(&packet.invDx[first]), iy = vload(&packet.invDy[first]), iz = vload(&packet.invDz[first]);
+        vfloat tx1 = vmul(vsub(minX, ox), ix), tx2 = vmul(vsub(maxX, ox), ix);
+        vfloat ty1 = vmul(vsub(minY, oy), iy), ty2 = vmul(vsub(maxY, oy), iy);
+        vfloat tz1 = vmul(vsub(minZ, oz), iz), tz2 = vmul(vsub(maxZ, oz), iz);
+        vfloat tNear = vmax(vmax(vmin(tx1, tx2), vmin(ty1, ty2)), vmin(tz1, tz2));
+        vfloat tFar = vmin(vmin(vmax(tx1, tx2), vmax(ty1, ty2)), vmax(tz1, tz2));
+        vfloat hit = vand(vand(vle(tNear, tFar), vlt(zero, tFar)), vlt(tNear, vload(&packet.tClosest[first])));
+        vstore(&tEntry[first], tNear);
+        result |= static_cast<uint32_t>(vmovemask(hit)) << first;
+    }
+    return result & mask;
+#else
+    uint32_t result = 0;
+    for (int r = 0; r < packet.size; ++r) {
+        if (!(mask & (1u << r))) continue;
+        Vec3 origin(packet.ox[r], packet.oy[r], packet.oz[r]);
+        Vec3 invDir(packet.invDx[r], packet.invDy[r], packet.invDz[r]);
+        if (hitBox(node, origin, invDir, packet.tClosest[r], tEntry[r])) result |= 1u << r;
+    }
+    return result;
+#endif
+}
+
+void BVH::closestHitPacket(RayPacket& packet, PacketStats& stats) const {
+    ++stats.packets;
+    if (nodes.empty()) return;
+
+    struct Entry { int node; uint32_t mask; };
+    Entry stack[kMaxDepth + 1];
+    int stackSize = 0;
+    alignas(32) float tLeft[RayPacket::kMaxSize], tRight[RayPacket::kMaxSize];
+
+    int node = 0;
+    uint32_t active = hitBoxPacket(nodes[0], packet, packet.fullMask(), tLeft);
+    uint64_t tests = 0;
+
+    while (true) {
+        if (active) {
+            const BVHNode& n = nodes[node];
+            int activeCount = __builtin_popcount(active);
+            ++stats.nodeVisits;
+            stats.activeRays += activeCount;
+            stats.raySlots += packet.size;
+
+            if (n.count > 0) {
+                tests += static_cast<uint64_t>(activeCount) * n.count;
+                leafSpheres.intersectPacket(packet, n.leftFirst, n.leftFirst + n.count, active);
+            } else if (activeCount <= kSingleRayThreshold) {
+                // Too few rays left to fill the lanes, finish them one by one
+                for (int r = 0; r < packet.size; ++r) {
+                    if (!(active & (1u << r))) continue;
+                    int h = traverseClosest(packet.ray(r), node, packet.tClosest[r]);
+                    if (h >= 0) packet.hit[r] = h;
+                    ++stats.singleRays;
+                }
+            } else {
+                uint32_t leftMask = hitBoxPacket(nodes[n.leftFirst], packet, active, tLeft);
+                uint32_t rightMask = hitBoxPacket(nodes[n.leftFirst + 1], packet, active, tRight);
+                if (leftMask && rightMask) {
+                    // The first ray that sees both children decides the order for the packet
+                    uint32_t both = leftMask & rightMask;
+                    int leader = __builtin_ctz(both ? both : leftMask);
+                    bool leftFirst = !both || tLeft[leader] <= tRight[leader];
+                    stack[stackSize++] = leftFirst ? Entry{n.leftFirst + 1, rightMask} : Entry{n.leftFirst, leftMask};
+                    node = leftFirst ? n.leftFirst : n.leftFirst + 1;
+                    active = leftFirst ? leftMask : rightMask;
+                    continue;
+                }
+                if (leftMask || rightMask) {
+                    node = leftMask ? n.leftFirst : n.leftFirst + 1;
+                    active = leftMask ? leftMask : rightMask;
+                    continue;
+                }
+            }
+        }
+
+        // Pop, dropping rays that have since found something closer than the box
+        if (stackSize == 0) break;
+        --stackSize;
+        node = stack[stackSize].node;
+        active = hitBoxPacket(nodes[node], packet, stack[stackSize].mask, tLeft);
+    }
+
+    for (int r = 0; r < packet.size; ++r) {
+        if (packet.hit[r] >= 0) packet.hit[r] = primIndex[packet.hit[r]];
+    }
+    countSphereTests(tests);
+}
+
+int BVH::findOccluder(const Ray& ray, float tMax, int skip) const {
+    if (nodes.empty()) return -1;
+
+    Vec3 invDir = inverse(ray.direction);
+    int skipOrdered = skip >= 0 ? primOrder[skip] : -1;
+    int stack[kMaxDepth + 2];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    // Any hit ends the query, so the visiting order doesn't matter
+    uint64_t tests = 0;
+    while (stackSize > 0) {
+        const BVHNode& n = nodes[stack[--stackSize]];
+        float tEntry;
+        if (!hitBox(n, ray.origin, invDir, tMax, tEntry)) continue;
+        if (n.count > 0) {
+            tests += n.count;
+            int hit = leafSpheres.intersectAny(ray, n.leftFirst, n.leftFirst + n.count, tMax, skipOrdered);
+            if (hit >= 0) {
+                countSphereTests(tests);
+                return primIndex[hit];
+            }
+        } else {
+            stack[stackSize++] = n.leftFirst + 1;
+            stack[stackSize++] = n.leftFirst;
+        }
+    }
+    countSphereTests(tests);
+    return -1;
+}
+
+bool BVH::hitsSphere(const Ray& ray, int sphere, float tMax) const {
+    countSphereTests(1);
+    int ordered = primOrder[sphere];
+    return leafSpheres.intersectAny(ray, ordered, ordered + 1, tMax) >= 0;
+}
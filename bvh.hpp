@@ -0,0 +1,75 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include <vector>
+#include "utilities.hpp"
+#include "spheresoa.hpp"
+
+// 32-byte node. Interior nodes keep their children next to each other at
+// leftFirst and leftFirst + 1, leaves cover primitives [leftFirst, leftFirst + count).
+struct BVHNode {
+    Vec3 boundsMin;
+    int leftFirst;
+    Vec3 boundsMax;
+    int count;  // 0 for interior nodes
+};
+
+// Bounding volume hierarchy over the scene spheres, built with a binned
+// surface area heuristic. Leaf spheres are stored in BVH order in a SphereSoA
+// so each leaf is one SIMD kernel call. Sphere indices going in and out of
+// the queries are always indices into the original spheres vector.
+// Moving spheres are bounded over the whole shutter interval [0, shutter], so
+// one tree serves rays of every time; the leaf kernels then place the spheres
+// exactly at the ray's time.
+class BVH {
+public:
+    // velocities is per sphere, or empty for a static scene
+    void build(const std::vector<Sphere>& spheres, const std::vector<Vec3>& velocities, float shutter);
+    // Takes a tree saved from an earlier build() over the same spheres and shutter
+    // (see scene.hpp) instead of building one. Returns false if the node or index
+    // data is inconsistent, the BVH is left empty then.
+    bool restore(const std::vector<Sphere>& spheres, const std::vector<Vec3>& velocities, float shutter,
+                 const BVHNode* nodes, int nodeCount, const int* primIndex);
+    int size() const { return static_cast<int>(primIndex.size()); }
+    float shutterTime() const { return shutter; }
+    // Nodes, index tables and the leaf sphere copy
+    size_t memoryBytes() const;
+    int nodeCount() const { return static_cast<int>(nodes.size()); }
+    // Raw tree for saving, BVH order -> sphere index next to the nodes
+    const std::vector<BVHNode>& getNodes() const { return nodes; }
+    const std::vector<int>& getPrimIndex() const { return primIndex; }
+
+    // Nearest sphere with 0 < t < tClosest, returns its index and lowers tClosest, or -1
+    int closestHit(const Ray& ray, float& tClosest) const;
+
+    // Some sphere other than `skip` hit with 0 < t < tMax, or -1. Stops at the first
+    // one found, which is not necessarily the nearest.
+    int findOccluder(const Ray& ray, float tMax, int skip = -1) const;
+    bool anyHit(const Ray& ray, float tMax, int skip = -1) const { return findOccluder(ray, tMax, skip) >= 0; }
+    // Same test against one sphere only, for callers that remember a likely occluder
+    bool hitsSphere(const Ray& ray, int sphere, float tMax) const;
+
+    // closestHit for a whole packet: fills packet.hit with sphere indices and lowers
+    // packet.tClosest. Nodes are tested against all rays at once; once only a couple
+    // of rays are left in a subtree they finish on the single-ray path.
+    void closestHitPacket(RayPacket& packet, PacketStats& stats) const;
+
+private:
+    static constexpr int kMaxDepth = 64;
+    static constexpr int kSingleRayThreshold = 2;  // Active rays at which a packet splits up
+
+    // Fills primOrder and leafSpheres once nodes and primIndex are final
+    void finishBuild(const std::vector<Sphere>& spheres, const std::vector<Vec3>& velocities);
+    // Single-ray traversal below `start`, returns the hit in BVH order
+    int traverseClosest(const Ray& ray, int start, float& tClosest) const;
+    // Rays of `mask` whose box test against node passes, entry distances go to tEntry
+    uint32_t hitBoxPacket(const BVHNode& node, const RayPacket& packet, uint32_t mask, float* tEntry) const;
+
+    std::vector<BVHNode> nodes;
+    float shutter = 0.0f;         // Time span the bounds cover
+    std::vector<int> primIndex;   // BVH order -> sphere index
+    std::vector<int> primOrder;   // Sphere index -> BVH order
+    SphereSoA leafSpheres;        // Sphere geometry in BVH order
+};
+
+#endif
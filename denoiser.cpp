@@ -0,0 +1,261 @@
+#include "denoiser.hpp"
+#include <algorithm>
+#include <vector>
+#include "simd.hpp"
+
+using namespace simd;
+
+namespace {
+
+const float kSpline[5] = {1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+const int kRowsPerTask = 8;
+
+// One float plane per channel, every row padded on both sides by copies of its
+// edge pixels so the widest taps and a whole SIMD block never leave the row
+struct Planes {
+    int width = 0, height = 0, pad = 0, stride = 0;
+    std::vector<float> data;
+    int channels = 0;
+
+    void init(int w, int h, int c, int padding) {
+        width = w;
+        height = h;
+        channels = c;
+        pad = padding;
+        stride = pad + (w + kWidth - 1) / kWidth * kWidth + pad;
+        data.assign(static_cast<size_t>(stride) * h * c, 0.0f);
+    }
+    float* row(int channel, int y) { return &data[(static_cast<size_t>(channel) * height + y) * stride + pad]; }
+    const float* row(int channel, int y) const { return &data[(static_cast<size_t>(channel) * height + y) * stride + pad]; }
+
+    void padRow(int y) {
+        for (int c = 0; c < channels; ++c) {
+            float* r = row(c, y);
+            std::fill(r - pad, r, r[0]);
+            std::fill(r + width, r - pad + stride, r[width - 1]);
+        }
+    }
+};
+
+void fill(Planes& planes, int channel, const Vec3* pixels, int width, int height) {
+    for (int y = 0; y < height; ++y) {
+        float* x = planes.row(channel, y);
+        float* yy = planes.row(channel + 1, y);
+        float* z = planes.row(channel + 2, y);
+        for (int i = 0; i < width; ++i) {
+            const Vec3& p = pixels[static_cast<size_t>(y) * width + i];
+            x[i] = p.x;
+            yy[i] = p.y;
+            z[i] = p.z;
+        }
+    }
+}
+
+// Guide channels: normal xyz, depth, albedo rgb and the variances of the means
+// of normal, albedo and depth, which only the center pixel reads
+enum { kNormalX, kNormalY, kNormalZ, kDepth, kAlbedoR, kAlbedoG, kAlbedoB, kNormalVar, kAlbedoVar, kDepthVar, kGuides };
+
+// Color planes: r, g, b and the variance of the pixel's mean luminance
+enum { kRed, kGreen, kBlue, kVariance, kColors };
+
+struct PassWeights {
+    float colorSigma2, normalSigma2, albedoSigma2, depthSigma2;
+};
+
+const float kLumR = 0.2126f, kLumG = 0.7152f, kLumB = 0.0722f;  // Same weights as luminance()
+
+#if RAYTRACER_SIMD
+
+// exp(-x) for x >= 0, close enough for weights: 1 / (1 + x + x^2/2 + x^3/6)
+inline vfloat expNeg(vfloat x) {
+    vfloat poly = vadd(vset1(1.0f), vmul(x, vadd(vset1(1.0f), vmul(x, vadd(vset1(0.5f), vmul(x, vset1(1.0f / 6.0f)))))));
+    return vdiv(vset1(1.0f), poly);
+}
+
+inline vfloat square(vfloat a) { return vmul(a, a); }
+
+void filterRow(const Planes& in, const Planes& guides, Planes& out, int y, int step, const PassWeights& w) {
+    const vfloat colorSigma2 = vset1(w.colorSigma2), normalSigma2 = vset1(w.normalSigma2);
+    const vfloat albedoSigma2 = vset1(w.albedoSigma2), depthSigma2 = vset1(w.depthSigma2);
+    const vfloat one = vset1(1.0f), two = vset1(2.0f), minDepth = vset1(1e-6f), minVariance = vset1(1e-8f);
+    const vfloat lumR = vset1(kLumR), lumG = vset1(kLumG), lumB = vset1(kLumB);
+    int rows[5];
+    for (int k = 0; k < 5; ++k) rows[k] = std::min(std::max(y + (k - 2) * step, 0), in.height - 1);
+
+    for (int x = 0; x < in.width; x += kWidth) {
+        vfloat cl = vadd(vadd(vmul(vload(in.row(kRed, y) + x), lumR), vmul(vload(in.row(kGreen, y) + x), lumG)),
+                         vmul(vload(in.row(kBlue, y) + x), lumB));
+        vfloat nx = vload(guides.row(kNormalX, y) + x), ny = vload(guides.row(kNormalY, y) + x);
+        vfloat nz = vload(guides.row(kNormalZ, y) + x), d = vload(guides.row(kDepth, y) + x);
+        vfloat ar = vload(guides.row(kAlbedoR, y) + x), ag = vload(guides.row(kAlbedoG, y) + x);
+        vfloat ab = vload(guides.row(kAlbedoB, y) + x);
+        // Differences of two noisy means spread by about twice the center's variance
+        vfloat invColor = vdiv(one, vmax(vmul(vload(in.row(kVariance, y) + x), colorSigma2), minVariance));
+        vfloat invNormal = vdiv(one, vadd(normalSigma2, vmul(two, vload(guides.row(kNormalVar, y) + x))));
+        vfloat invAlbedo = vdiv(one, vadd(albedoSigma2, vmul(two, vload(guides.row(kAlbedoVar, y) + x))));
+        vfloat invDepth = vdiv(one, vmax(vadd(vmul(vmul(d, d), depthSigma2), vmul(two, vload(guides.row(kDepthVar, y) + x))),
+                                         minDepth));
+
+        vfloat sumR = vset1(0.0f), sumG = sumR, sumB = sumR, sumV = sumR, sumW = sumR;
+        for (int ky = 0; ky < 5; ++ky) {
+            int ty = rows[ky];
+            for (int kx = 0; kx < 5; ++kx) {
+                int tx = x + (kx - 2) * step;
+                vfloat tr = vload(in.row(kRed, ty) + tx), tg = vload(in.row(kGreen, ty) + tx);
+                vfloat tb = vload(in.row(kBlue, ty) + tx);
+                vfloat tl = vadd(vadd(vmul(tr, lumR), vmul(tg, lumG)), vmul(tb, lumB));
+                vfloat e = vmul(square(vsub(tl, cl)), invColor);
+                vfloat dn = vadd(vadd(square(vsub(vload(guides.row(kNormalX, ty) + tx), nx)),
+                                      square(vsub(vload(guides.row(kNormalY, ty) + tx), ny))),
+                                 square(vsub(vload(guides.row(kNormalZ, ty) + tx), nz)));
+                vfloat da = vadd(vadd(square(vsub(vload(guides.row(kAlbedoR, ty) + tx), ar)),
+                                      square(vsub(vload(guides.row(kAlbedoG, ty) + tx), ag))),
+                                 square(vsub(vload(guides.row(kAlbedoB, ty) + tx), ab)));
+                vfloat dd = vmul(square(vsub(vload(guides.row(kDepth, ty) + tx), d)), invDepth);
+                e = vadd(vadd(e, vmul(dn, invNormal)), vadd(vmul(da, invAlbedo), dd));
+                vfloat weight = vmul(vset1(kSpline[kx] * kSpline[ky]), expNeg(e));
+                sumR = vadd(sumR, vmul(tr, weight));
+                sumG = vadd(sumG, vmul(tg, weight));
+                sumB = vadd(sumB, vmul(tb, weight));
+                sumV = vadd(sumV, vmul(vload(in.row(kVariance, ty) + tx), vmul(weight, weight)));
+                sumW = vadd(sumW, weight);
+            }
+        }
+        // The center tap always has weight 9/64
+        vfloat inv = vdiv(vset1(1.0f), sumW);
+        vstore(out.row(kRed, y) + x, vmul(sumR, inv));
+        vstore(out.row(kGreen, y) + x, vmul(sumG, inv));
+        vstore(out.row(kBlue, y) + x, vmul(sumB, inv));
+        vstore(out.row(kVariance, y) + x, vmul(sumV, vmul(inv, inv)));
+    }
+}
+
+#else
+
+inline float expNeg(float x) { return 1.0f / (1.0f + x * (1.0f + x * (0.5f + x * (1.0f / 6.0f)))); }
+
+inline float square(float a) { return a * a; }
+
+void filterRow(const Planes& in, const Planes& guides, Planes& out, int y, int step, const PassWeights& w) {
+    int rows[5];
+    for (int k = 0; k < 5; ++k) rows[k] = std::min(std::max(y + (k - 2) * step, 0), in.height - 1);
+
+    for (int x = 0; x < in.width; ++x) {
+        float cl = in.row(kRed, y)[x] * kLumR + in.row(kGreen, y)[x] * kLumG + in.row(kBlue, y)[x] * kLumB;
+        float nx = guides.row(kNormalX, y)[x], ny = guides.row(kNormalY, y)[x], nz = guides.row(kNormalZ, y)[x];
+        float d = guides.row(kDepth, y)[x];
+        float ar = guides.row(kAlbedoR, y)[x], ag = guides.row(kAlbedoG, y)[x], ab = guides.row(kAlbedoB, y)[x];
+        float invColor = 1.0f / std::max(in.row(kVariance, y)[x] * w.colorSigma2, 1e-8f);
+        float invNormal = 1.0f / (w.normalSigma2 + 2.0f * guides.row(kNormalVar, y)[x]);
+        float invAlbedo = 1.0f / (w.albedoSigma2 + 2.0f * guides.row(kAlbedoVar, y)[x]);
+        float invDepth = 1.0f / std::max(d * d * w.depthSigma2 + 2.0f * guides.row(kDepthVar, y)[x], 1e-6f);
+
+        float sumR = 0.0f, sumG = 0.0f, sumB = 0.0f, sumV = 0.0f, sumW = 0.0f;
+        for (int ky = 0; ky < 5; ++ky) {
+            int ty = rows[ky];
+            for (int kx = 0; kx < 5; ++kx) {
+                int tx = x + (kx - 2) * step;
+                float tr = in.row(kRed, ty)[tx], tg = in.row(kGreen, ty)[tx], tb = in.row(kBlue, ty)[tx];
+                float e = square(tr * kLumR + tg * kLumG + tb * kLumB - cl) * invColor;
+                float dn = square(guides.row(kNormalX, ty)[tx] - nx) + square(guides.row(kNormalY, ty)[tx] - ny) +
+                           square(guides.row(kNormalZ, ty)[tx] - nz);
+                float da = square(guides.row(kAlbedoR, ty)[tx] - ar) + square(guides.row(kAlbedoG, ty)[tx] - ag) +
+                           square(guides.row(kAlbedoB, ty)[tx] - ab);
+                float dd = square(guides.row(kDepth, ty)[tx] - d) * invDepth;
+                float weight = kSpline[kx] * kSpline[ky] * expNeg(e + dn * invNormal + da * invAlbedo + dd);
+                sumR += tr * weight;
+                sumG += tg * weight;
+                sumB += tb * weight;
+                sumV += in.row(kVariance, ty)[tx] * weight * weight;
+                sumW += weight;
+            }
+        }
+        out.row(kRed, y)[x] = sumR / sumW;
+        out.row(kGreen, y)[x] = sumG / sumW;
+        out.row(kBlue, y)[x] = sumB / sumW;
+        out.row(kVariance, y)[x] = sumV / (sumW * sumW);
+    }
+}
+
+#endif
+
+}  // namespace
+
+void denoiseImage(const Vec3* color, const float* variance, const Vec3* albedo, const Vec3* normal, const float* depth,
+                  const Vec3* guideVariance, int width, int height, const DenoiseSettings& settings, ThreadPool& pool,
+                  Vec3* out) {
+    if (width <= 0 || height <= 0) return;
+    int iterations = std::max(settings.iterations, 0);
+    int pad = 2 * (1 << std::max(iterations - 1, 0)) + kWidth;
+
+    Planes guides, ping, pong;
+    guides.init(width, height, kGuides, pad);
+    ping.init(width, height, kColors, pad);
+    pong.init(width, height, kColors, pad);
+    fill(guides, kNormalX, normal, width, height);
+    fill(guides, kAlbedoR, albedo, width, height);
+    // A sharp edge shows up as a line of pixels with mixed features, the 3x3
+    // minimum keeps guides tight there yet loose where defocus mixes them all
+    std::vector<Vec3> spread(static_cast<size_t>(width) * height);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            Vec3 m = guideVariance[static_cast<size_t>(y) * width + x];
+            for (int dy = -1; dy <= 1; ++dy) {
+                int sy = std::min(std::max(y + dy, 0), height - 1);
+                for (int dx = -1; dx <= 1; ++dx) {
+                    const Vec3& v = guideVariance[static_cast<size_t>(sy) * width + std::min(std::max(x + dx, 0), width - 1)];
+                    m = Vec3(std::min(m.x, v.x), std::min(m.y, v.y), std::min(m.z, v.z));
+                }
+            }
+            spread[static_cast<size_t>(y) * width + x] = m;
+        }
+    }
+    fill(guides, kNormalVar, spread.data(), width, height);
+    fill(ping, kRed, color, width, height);
+    for (int y = 0; y < height; ++y) {
+        std::copy(depth + static_cast<size_t>(y) * width, depth + static_cast<size_t>(y + 1) * width, guides.row(kDepth, y));
+        guides.padRow(y);
+    }
+
+    // A few samples give a poor variance estimate, a 3x3 blur of it steadies the weights
+    int tasks = (height + kRowsPerTask - 1) / kRowsPerTask;
+    pool.parallelFor(tasks, [&](int task, int) {
+        int y1 = std::min((task + 1) * kRowsPerTask, height);
+        for (int y = task * kRowsPerTask; y < y1; ++y) {
+            float* row = ping.row(kVariance, y);
+            for (int x = 0; x < width; ++x) {
+                float sum = 0.0f;
+                for (int dy = -1; dy <= 1; ++dy) {
+                    const float* src = variance + static_cast<size_t>(std::min(std::max(y + dy, 0), height - 1)) * width;
+                    for (int dx = -1; dx <= 1; ++dx) {
+                        int sx = std::min(std::max(x + dx, 0), width - 1);
+                        sum += src[sx] * kSpline[dx + 2] * kSpline[dy + 2];
+                    }
+                }
+                row[x] = sum / (kSpline[1] + kSpline[2] + kSpline[3]) / (kSpline[1] + kSpline[2] + kSpline[3]);
+            }
+            ping.padRow(y);
+        }
+    });
+
+    PassWeights weights = {settings.colorSigma * settings.colorSigma, settings.normalSigma * settings.normalSigma,
+                           settings.albedoSigma * settings.albedoSigma, settings.depthSigma * settings.depthSigma};
+    for (int pass = 0; pass < iterations; ++pass) {
+        int step = 1 << pass;
+        pool.parallelFor(tasks, [&](int task, int) {
+            int y1 = std::min((task + 1) * kRowsPerTask, height);
+            for (int y = task * kRowsPerTask; y < y1; ++y) {
+                filterRow(ping, guides, pong, y, step, weights);
+                pong.padRow(y);
+            }
+        });
+        std::swap(ping, pong);
+    }
+
+    for (int y = 0; y < height; ++y) {
+        const float* r = ping.row(kRed, y);
+        const float* g = ping.row(kGreen, y);
+        const float* b = ping.row(kBlue, y);
+        for (int x = 0; x < width; ++x) out[static_cast<size_t>(y) * width + x] = Vec3(r[x], g[x], b[x]);
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef DENOISER_HPP
+#define DENOISER_HPP
+
+#include "utilities.hpp"
+#include "threadpool.hpp"
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010, with the
+// variance-scaled luminance weights of SVGF). Each pass blurs with a 5x5 B3
+// spline whose taps are spread 1, 2, 4, ... pixels apart, and a neighbour only
+// counts as much as it resembles the center pixel in luminance (relative to the
+// noise there), normal, depth and albedo, so edges of objects, shadows and
+// materials stay. Normals, depth and albedo come from the primary hits,
+// averaged over each pixel's samples, so they are antialiased and blurred like
+// the image.
+struct DenoiseSettings {
+    int iterations = 4;          // Passes, the filter reaches 2^(iterations + 1) - 2 pixels out
+    float colorSigma = 4.0f;     // Luminance difference where weights fall off, in standard errors
+    float normalSigma = 0.25f;   // Normal distance (length of the difference)
+    float depthSigma = 0.03f;    // Depth difference relative to the center's depth
+    float albedoSigma = 0.05f;   // Albedo distance
+};
+
+// Filters width x height pixels of color (per pixel averages) into out, which
+// may be color. variance is that of each pixel's mean luminance; misses have
+// depth 0. Rows are spread over pool, each pass works on SIMD width pixels at a time.
+void denoiseImage(const Vec3* color, const float* variance, const Vec3* albedo, const Vec3* normal, const float* depth,
+                  const Vec3* guideVariance, int width, int height, const DenoiseSettings& settings, ThreadPool& pool,
+                  Vec3* out);
+
+#endif
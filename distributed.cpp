@@ -0,0 +1,463 @@
+#include "distributed.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr uint32_t kProtocolVersion = 3;
+
+enum MessageType : uint32_t {
+    kHello = 1,   // Worker -> coordinator, once after connecting
+    kRender = 2,  // Coordinator -> worker, one tile range
+    kTiles = 3,   // Worker -> coordinator, the range's pixels
+    kQuit = 4,    // Coordinator -> worker
+};
+
+struct MessageHeader {
+    uint32_t type;
+    uint32_t size;  // Payload bytes after the header
+};
+
+struct HelloMessage {
+    uint32_t version;
+    int32_t width, height;
+    int32_t sphereCount, lightCount;
+};
+
+// Everything of renderFrame's state a worker needs besides its scene
+struct RenderMessage {
+    float timeDelta, effectValue;
+    float aperture, focus, shutter;
+    int32_t useDOF, samplesPerPixel;
+    int32_t tileSize, packetSize, samplerType, pixelFormat;
+    int32_t lightSamples, lightSelection, shadowSamples;
+    uint32_t seed, frameIndex;
+    int32_t firstTile, endTile;
+};
+
+// Followed by the tiles' pixels, tile after tile, each row by row
+struct TilesMessage {
+    int32_t firstTile, endTile;
+};
+
+bool sendAll(int fd, const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        bytes += sent;
+        size -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+// False on errors, timeouts (SO_RCVTIMEO) and when the other end closed
+bool receiveAll(int fd, void* data, size_t size) {
+    char* bytes = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t received = recv(fd, bytes, size, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return false;
+        bytes += received;
+        size -= static_cast<size_t>(received);
+    }
+    return true;
+}
+
+bool sendMessage(int fd, MessageType type, const void* payload, size_t size) {
+    MessageHeader header{type, static_cast<uint32_t>(size)};
+    return sendAll(fd, &header, sizeof(header)) && (size == 0 || sendAll(fd, payload, size));
+}
+
+// Receives a message of the given type and exact payload size
+template <typename T>
+bool receiveMessage(int fd, MessageType type, T& payload) {
+    MessageHeader header;
+    return receiveAll(fd, &header, sizeof(header)) && header.type == type && header.size == sizeof(T) &&
+           receiveAll(fd, &payload, sizeof(T));
+}
+
+struct SocketAddress {
+    sockaddr_storage storage;
+    socklen_t length = 0;
+    std::string unixPath;  // Empty for TCP
+};
+
+bool parseAddress(const std::string& address, SocketAddress& out) {
+    std::memset(&out.storage, 0, sizeof(out.storage));
+    if (address.compare(0, 5, "unix:") == 0) {
+        sockaddr_un* un = reinterpret_cast<sockaddr_un*>(&out.storage);
+        out.unixPath = address.substr(5);
+        if (out.unixPath.empty() || out.unixPath.size() >= sizeof(un->sun_path)) {
+            std::cerr << "Bad socket path in " << address << std::endl;
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        std::memcpy(un->sun_path, out.unixPath.c_str(), out.unixPath.size() + 1);
+        out.length = sizeof(sockaddr_un);
+        return true;
+    }
+    if (address.compare(0, 4, "tcp:") == 0) {
+        size_t colon = address.rfind(':');
+        std::string host = address.substr(4, colon - 4), port = address.substr(colon + 1);
+        sockaddr_in* in = reinterpret_cast<sockaddr_in*>(&out.storage);
+        char* end = nullptr;
+        long number = std::strtol(port.c_str(), &end, 10);
+        if (colon < 4 || port.empty() || *end != '\0' || number < 0 || number > 65535 ||
+            inet_pton(AF_INET, host.c_str(), &in->sin_addr) != 1) {
+            std::cerr << "Bad TCP address " << address << ", expected tcp:HOST:PORT with a numeric host" << std::endl;
+            return false;
+        }
+        in->sin_family = AF_INET;
+        in->sin_port = htons(static_cast<uint16_t>(number));
+        out.length = sizeof(sockaddr_in);
+        return true;
+    }
+    std::cerr << "Unknown address " << address << ", expected unix:PATH or tcp:HOST:PORT" << std::endl;
+    return false;
+}
+
+// Small messages go out right away instead of waiting for more data
+void setNoDelay(int fd, const SocketAddress& address) {
+    if (!address.unixPath.empty()) return;
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+void setReceiveTimeout(int fd, int timeoutMs) {
+    timeval timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_usec = (timeoutMs % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+// Bytes of tiles [firstTile, endTile) in the tracer's pixelFormat
+size_t rangeBytes(const RayTracer& tracer, int firstTile, int endTile) {
+    size_t pixels = 0;
+    for (int tile = firstTile; tile < endTile; ++tile) {
+        int x0, y0, x1, y1;
+        tracer.tileBounds(tile, x0, y0, x1, y1);
+        pixels += static_cast<size_t>(x1 - x0) * (y1 - y0);
+    }
+    return pixels * bytesPerPixel(tracer.pixelFormat);
+}
+
+// Copies tiles between their packed form and the framebuffer, toFramebuffer picks the direction
+void copyTiles(RayTracer& tracer, int firstTile, int endTile, uint8_t* packed, bool toFramebuffer) {
+    size_t pixelBytes = bytesPerPixel(tracer.pixelFormat);
+    for (int tile = firstTile; tile < endTile; ++tile) {
+        int x0, y0, x1, y1;
+        tracer.tileBounds(tile, x0, y0, x1, y1);
+        size_t rowBytes = (x1 - x0) * pixelBytes;
+        for (int y = y0; y < y1; ++y) {
+            uint8_t* row = tracer.framebuffer.data() + (static_cast<size_t>(y) * tracer.width + x0) * pixelBytes;
+            if (toFramebuffer) std::memcpy(row, packed, rowBytes);
+            else std::memcpy(packed, row, rowBytes);
+            packed += rowBytes;
+        }
+    }
+}
+
+}  // namespace
+
+RenderCoordinator::~RenderCoordinator() {
+    shutdown();
+}
+
+bool RenderCoordinator::listen(const std::string& address) {
+    shutdown();
+    SocketAddress socketAddress;
+    if (!parseAddress(address, socketAddress)) return false;
+
+    listenFd = socket(socketAddress.storage.ss_family, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        std::cerr << "Failed to create a socket: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    if (socketAddress.unixPath.empty()) {
+        int on = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    } else {
+        unlink(socketAddress.unixPath.c_str());  // Left over from an earlier run
+    }
+    if (bind(listenFd, reinterpret_cast<sockaddr*>(&socketAddress.storage), socketAddress.length) != 0 ||
+        ::listen(listenFd, 64) != 0) {
+        std::cerr << "Failed to listen on " << address << ": " << std::strerror(errno) << std::endl;
+        close(listenFd);
+        listenFd = -1;
+        return false;
+    }
+
+    unixPath = socketAddress.unixPath;
+    boundAddress = address;
+    if (unixPath.empty()) {
+        sockaddr_in bound;
+        socklen_t length = sizeof(bound);
+        getsockname(listenFd, reinterpret_cast<sockaddr*>(&bound), &length);
+        boundAddress = address.substr(0, address.rfind(':') + 1) + std::to_string(ntohs(bound.sin_port));
+    }
+    return true;
+}
+
+int RenderCoordinator::acceptWorkers(int count, const RayTracer& tracer, int waitMs) {
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(waitMs);
+    SocketAddress socketAddress;
+    parseAddress(boundAddress, socketAddress);
+
+    while (listenFd >= 0 && workerCount() < count) {
+        int remaining = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count());
+        if (remaining <= 0) break;
+        pollfd listening{listenFd, POLLIN, 0};
+        if (poll(&listening, 1, remaining) <= 0) continue;
+        int fd = accept(listenFd, nullptr, nullptr);
+        if (fd < 0) continue;
+
+        setNoDelay(fd, socketAddress);
+        setReceiveTimeout(fd, waitMs);
+        HelloMessage hello;
+        if (!receiveMessage(fd, kHello, hello) || hello.version != kProtocolVersion) {
+            std::cerr << "Worker sent no valid hello, closing the connection" << std::endl;
+            close(fd);
+            continue;
+        }
+        if (hello.width != tracer.width || hello.height != tracer.height ||
+            hello.sphereCount != static_cast<int>(tracer.spheres.size()) ||
+            hello.lightCount != static_cast<int>(tracer.lights.size())) {
+            std::cerr << "Worker has a different scene (" << hello.width << "x" << hello.height << ", "
+                      << hello.sphereCount << " spheres, " << hello.lightCount << " lights), closing the connection"
+                      << std::endl;
+            sendMessage(fd, kQuit, nullptr, 0);
+            close(fd);
+            continue;
+        }
+        setReceiveTimeout(fd, timeoutMs);
+        Worker worker;
+        worker.fd = fd;
+        workers.push_back(worker);
+    }
+    return workerCount();
+}
+
+int RenderCoordinator::workerCount() const {
+    return static_cast<int>(std::count_if(workers.begin(), workers.end(), [](const Worker& w) { return w.fd >= 0; }));
+}
+
+void RenderCoordinator::renderFrame(RayTracer& tracer, float timeDelta, float effectValue, bool useDOF, int samplesPerPixel) {
+    tracer.framebuffer.resize(static_cast<size_t>(tracer.width) * tracer.height * bytesPerPixel(tracer.pixelFormat));
+    int tileCount = tracer.tileCount();
+    stats = DistributedStats();
+    stats.workers = workerCount();
+    stats.workerTiles.assign(workers.size(), 0);
+
+    // Stack of ranges still to hand out, the first range on top
+    int chunk = tilesPerRequest > 0 ? tilesPerRequest : std::max(1, tileCount / std::max(1, 4 * stats.workers));
+    std::vector<std::pair<int, int>> pending;
+    for (int first = (tileCount - 1) / chunk * chunk; first >= 0; first -= chunk) {
+        pending.emplace_back(first, std::min(first + chunk, tileCount));
+    }
+
+    RenderMessage job;
+    job.timeDelta = timeDelta;
+    job.effectValue = effectValue;
+    job.aperture = tracer.apertureSize;
+    job.focus = tracer.focusDistance;
+    job.shutter = tracer.shutter;
+    job.useDOF = useDOF ? 1 : 0;
+    job.samplesPerPixel = samplesPerPixel;
+    job.tileSize = tracer.tileSize;
+    job.packetSize = tracer.packetSize;
+    job.samplerType = static_cast<int32_t>(tracer.samplerType);
+    job.pixelFormat = static_cast<int32_t>(tracer.pixelFormat);
+    job.lightSamples = tracer.lightSamples;
+    job.lightSelection = static_cast<int32_t>(tracer.lightSelection);
+    job.shadowSamples = tracer.shadowSamples;
+    job.seed = tracer.seed;
+    job.frameIndex = tracer.frameIndex;
+
+    int remaining = tileCount;
+    std::vector<uint8_t> payload;
+    std::vector<pollfd> polled;
+    std::vector<int> polledWorkers;
+    while (remaining > 0) {
+        // Every idle worker gets the next range
+        for (int i = 0; i < static_cast<int>(workers.size()) && !pending.empty(); ++i) {
+            Worker& worker = workers[i];
+            if (worker.fd < 0 || worker.endTile >= 0) continue;
+            job.firstTile = pending.back().first;
+            job.endTile = pending.back().second;
+            pending.pop_back();
+            worker.firstTile = job.firstTile;
+            worker.endTile = job.endTile;
+            worker.sent = Clock::now();
+            if (!sendMessage(worker.fd, kRender, &job, sizeof(job))) drop(i, pending, "failed to send");
+        }
+
+        polled.clear();
+        polledWorkers.clear();
+        for (int i = 0; i < static_cast<int>(workers.size()); ++i) {
+            if (workers[i].fd < 0 || workers[i].endTile < 0) continue;
+            polled.push_back(pollfd{workers[i].fd, POLLIN, 0});
+            polledWorkers.push_back(i);
+        }
+
+        if (polled.empty()) {
+            // Nobody left to ask, render the rest here
+            for (const std::pair<int, int>& range : pending) {
+                tracer.renderTiles(range.first, range.second, timeDelta, effectValue, useDOF, samplesPerPixel);
+                stats.localTiles += range.second - range.first;
+                remaining -= range.second - range.first;
+            }
+            pending.clear();
+            break;
+        }
+
+        poll(polled.data(), polled.size(), 100);
+        for (size_t p = 0; p < polled.size(); ++p) {
+            int i = polledWorkers[p];
+            Worker& worker = workers[i];
+            if (polled[p].revents != 0) {
+                int tiles = worker.endTile - worker.firstTile;
+                if (receiveTiles(worker, tracer, payload)) {
+                    stats.workerTiles[i] += tiles;
+                    remaining -= tiles;
+                    worker.endTile = -1;
+                } else {
+                    drop(i, pending, "disconnected or sent a bad reply");
+                }
+            } else if (Clock::now() - worker.sent > std::chrono::milliseconds(timeoutMs)) {
+                drop(i, pending, "timed out");
+            }
+        }
+    }
+    ++tracer.frameIndex;
+}
+
+bool RenderCoordinator::receiveTiles(Worker& worker, RayTracer& tracer, std::vector<uint8_t>& payload) {
+    size_t expected = sizeof(TilesMessage) + rangeBytes(tracer, worker.firstTile, worker.endTile);
+    MessageHeader header;
+    if (!receiveAll(worker.fd, &header, sizeof(header)) || header.type != kTiles || header.size != expected) return false;
+    payload.resize(expected);
+    if (!receiveAll(worker.fd, payload.data(), expected)) return false;
+
+    TilesMessage tiles;
+    std::memcpy(&tiles, payload.data(), sizeof(tiles));
+    if (tiles.firstTile != worker.firstTile || tiles.endTile != worker.endTile) return false;
+    copyTiles(tracer, worker.firstTile, worker.endTile, payload.data() + sizeof(tiles), true);
+    return true;
+}
+
+void RenderCoordinator::drop(int index, std::vector<std::pair<int, int>>& pending, const char* reason) {
+    Worker& worker = workers[index];
+    std::cerr << "Worker " << index << " " << reason;
+    if (worker.endTile >= 0) {
+        std::cerr << ", reassigning tiles " << worker.firstTile << "-" << worker.endTile - 1;
+        pending.emplace_back(worker.firstTile, worker.endTile);
+        stats.reassignedTiles += worker.endTile - worker.firstTile;
+    }
+    std::cerr << std::endl;
+    close(worker.fd);
+    worker.fd = -1;
+    worker.endTile = -1;
+    ++stats.lostWorkers;
+}
+
+void RenderCoordinator::shutdown() {
+    for (Worker& worker : workers) {
+        if (worker.fd < 0) continue;
+        sendMessage(worker.fd, kQuit, nullptr, 0);
+        close(worker.fd);
+    }
+    workers.clear();
+    if (listenFd >= 0) close(listenFd);
+    listenFd = -1;
+    if (!unixPath.empty()) unlink(unixPath.c_str());
+    unixPath.clear();
+}
+
+bool runRenderWorker(const std::string& address, RayTracer& tracer, int failAfter) {
+    SocketAddress socketAddress;
+    if (!parseAddress(address, socketAddress)) return false;
+    int fd = socket(socketAddress.storage.ss_family, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&socketAddress.storage), socketAddress.length) != 0) {
+        std::cerr << "Failed to connect to " << address << ": " << std::strerror(errno) << std::endl;
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    setNoDelay(fd, socketAddress);
+
+    HelloMessage hello{kProtocolVersion, tracer.width, tracer.height, static_cast<int32_t>(tracer.spheres.size()),
+                       static_cast<int32_t>(tracer.lights.size())};
+    bool ok = sendMessage(fd, kHello, &hello, sizeof(hello));
+    std::vector<uint8_t> payload;
+    for (int served = 0; ok; ++served) {
+        MessageHeader header;
+        if (!receiveAll(fd, &header, sizeof(header))) {
+            std::cerr << "Lost the connection to the coordinator" << std::endl;
+            ok = false;
+            break;
+        }
+        if (header.type == kQuit) break;
+
+        RenderMessage job;
+        if (header.type != kRender || header.size != sizeof(job) || !receiveAll(fd, &job, sizeof(job))) {
+            std::cerr << "Bad message from the coordinator" << std::endl;
+            ok = false;
+            break;
+        }
+        if (served == failAfter) {
+            ok = false;
+            break;
+        }
+
+        tracer.apertureSize = job.aperture;
+        tracer.focusDistance = job.focus;
+        tracer.shutter = job.shutter;
+        tracer.tileSize = job.tileSize;
+        tracer.packetSize = job.packetSize;
+        tracer.lightSamples = job.lightSamples;
+        tracer.shadowSamples = job.shadowSamples;
+        tracer.seed = job.seed;
+        tracer.frameIndex = job.frameIndex;
+        if (job.tileSize <= 0 || job.samplesPerPixel <= 0 || job.samplerType < 0 ||
+            job.samplerType > static_cast<int32_t>(SamplerType::BlueNoise) || job.pixelFormat < 0 ||
+            job.pixelFormat > static_cast<int32_t>(PixelFormat::SRGB8) || job.lightSelection < 0 ||
+            job.lightSelection > static_cast<int32_t>(LightSelection::Tree) || job.shadowSamples <= 0 || job.firstTile < 0 ||
+            job.endTile > tracer.tileCount() || job.firstTile >= job.endTile) {
+            std::cerr << "Bad render request from the coordinator" << std::endl;
+            ok = false;
+            break;
+        }
+        tracer.samplerType = static_cast<SamplerType>(job.samplerType);
+        tracer.pixelFormat = static_cast<PixelFormat>(job.pixelFormat);
+        tracer.lightSelection = static_cast<LightSelection>(job.lightSelection);
+        tracer.renderTiles(job.firstTile, job.endTile, job.timeDelta, job.effectValue, job.useDOF != 0,
+                           job.samplesPerPixel);
+
+        TilesMessage tiles{job.firstTile, job.endTile};
+        payload.resize(sizeof(tiles) + rangeBytes(tracer, job.firstTile, job.endTile));
+        std::memcpy(payload.data(), &tiles, sizeof(tiles));
+        copyTiles(tracer, job.firstTile, job.endTile, payload.data() + sizeof(tiles), false);
+        ok = sendMessage(fd, kTiles, payload.data(), payload.size());
+    }
+    close(fd);
+    return ok;
+}
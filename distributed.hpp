@@ -0,0 +1,88 @@
+#ifndef DISTRIBUTED_HPP
+#define DISTRIBUTED_HPP
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include "raytracer.hpp"
+
+// Splits renderFrame over worker processes. A RenderCoordinator listens on a
+// socket, workers (runRenderWorker, e.g. ray_tracer_headless --worker ADDRESS)
+// connect with the same scene loaded, and each frame goes out as ranges of
+// consecutive tiles (RayTracer::tileBounds). Workers send the finished pixels
+// back in the frame's pixelFormat and the coordinator copies them into its
+// tracer's framebuffer. A worker that disconnects, sends garbage or misses the
+// timeout is dropped and its range handed to another one; once no worker is
+// left the coordinator renders the rest itself. Samples only depend on seed,
+// frameIndex and the pixel, so the image matches a local renderFrame however
+// the tiles were spread.
+//
+// Addresses are "unix:PATH" for a Unix-domain socket or "tcp:HOST:PORT" with a
+// numeric IPv4 host; port 0 makes the coordinator pick a free one (address()).
+// Messages are raw structs, both ends have to be the same build.
+
+// What happened during the last RenderCoordinator::renderFrame
+struct DistributedStats {
+    int workers = 0;          // Connected when the frame started
+    int lostWorkers = 0;      // Dropped during the frame
+    int reassignedTiles = 0;  // Handed out again after their worker was lost
+    int localTiles = 0;       // Rendered by the coordinator, no worker was left
+    std::vector<int> workerTiles;  // Tiles finished per worker, in connection order
+};
+
+class RenderCoordinator {
+public:
+    RenderCoordinator() = default;
+    ~RenderCoordinator();
+
+    RenderCoordinator(const RenderCoordinator&) = delete;
+    RenderCoordinator& operator=(const RenderCoordinator&) = delete;
+
+    // Prints what went wrong to std::cerr and returns false on errors
+    bool listen(const std::string& address);
+    // Where workers should connect, with the actual port for tcp:HOST:0
+    const std::string& address() const { return boundAddress; }
+    // Waits up to waitMs for workers until count are connected. Workers whose
+    // image size, sphere or light count differ from tracer are turned away.
+    // Returns the number of connected workers.
+    int acceptWorkers(int count, const RayTracer& tracer, int waitMs);
+    int workerCount() const;
+
+    // Same image as tracer.renderFrame, rendered by the workers into
+    // tracer.framebuffer. Advances frameIndex like renderFrame; camera, plane and
+    // lights come from the scene each worker loaded, and the present target and
+    // sample counts are not updated.
+    void renderFrame(RayTracer& tracer, float timeDelta, float effectValue, bool useDOF, int samplesPerPixel);
+    const DistributedStats& getStats() const { return stats; }
+
+    // Tells the workers to exit and closes all sockets, also done on destruction
+    void shutdown();
+
+    int tilesPerRequest = 0;   // Tiles per range, 0 = about four ranges per worker
+    int timeoutMs = 120000;    // A worker that takes longer for one range is dropped
+
+private:
+    struct Worker {
+        int fd = -1;  // -1 once dropped
+        int firstTile = 0, endTile = -1;  // Range being rendered, endTile -1 when idle
+        std::chrono::steady_clock::time_point sent;
+    };
+
+    // Closes the worker's socket, its unfinished range goes back to pending
+    void drop(int index, std::vector<std::pair<int, int>>& pending, const char* reason);
+    bool receiveTiles(Worker& worker, RayTracer& tracer, std::vector<uint8_t>& payload);
+
+    int listenFd = -1;
+    std::string boundAddress;
+    std::string unixPath;  // Socket file to remove again, unix: addresses only
+    std::vector<Worker> workers;
+    DistributedStats stats;
+};
+
+// Connects to the coordinator at address and renders the tile ranges it sends
+// with tracer until told to stop. Returns false on errors, or without a reply
+// after failAfter ranges if that is >= 0, which looks like a crashed worker to
+// the coordinator and is there to test its recovery.
+bool runRenderWorker(const std::string& address, RayTracer& tracer, int failAfter = -1);
+
+#endif
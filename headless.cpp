@@ -0,0 +1,374 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "raytracer.hpp"
+#include "imageio.hpp"
+#include "scene.hpp"
+#include "distributed.hpp"
+
+// Offline renderer: same tracer as the viewer, but no window or OpenGL.
+// Renders a sequence of frames and writes each one to disk.
+
+// Runs this program again as a worker with the same options plus extra
+static pid_t spawnWorker(char** argv, const std::vector<std::string>& args) {
+    std::vector<char*> childArgs{argv[0]};
+    for (const std::string& arg : args) childArgs.push_back(const_cast<char*>(arg.c_str()));
+    childArgs.push_back(nullptr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv("/proc/self/exe", childArgs.data());
+        execvp(argv[0], childArgs.data());
+        _exit(127);
+    }
+    if (pid < 0) std::cerr << "Failed to start a worker process" << std::endl;
+    return pid;
+}
+
+// Waits for the worker processes, killing the ones that don't exit in time
+static void reapWorkers(const std::vector<pid_t>& pids) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    for (pid_t pid : pids) {
+        int status = 0;
+        while (waitpid(pid, &status, WNOHANG) == 0) {
+            if (std::chrono::steady_clock::now() > deadline) {
+                kill(pid, SIGKILL);
+                waitpid(pid, &status, 0);
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        if (WIFSIGNALED(status)) std::cerr << "Worker process " << pid << " killed by signal " << WTERMSIG(status) << std::endl;
+        else if (WEXITSTATUS(status) != 0) std::cerr << "Worker process " << pid << " exited with " << WEXITSTATUS(status) << std::endl;
+    }
+}
+
+static void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "  --scene PATH     load a .scene text file or binary scene instead of the default scene\n"
+              << "  --no-scene-cache parse text scenes every time, don't read or write PATH.bin\n"
+              << "  --save-scene OUT write the loaded scene, binary if OUT ends in .bin, and exit\n"
+              << "  --width N        image width (800)\n"
+              << "  --height N       image height (600)\n"
+              << "  --spp N          samples per pixel (16), the average budget with --adaptive\n"
+              << "  --adaptive       spend extra samples on noisy pixels only\n"
+              << "  --min-spp N      adaptive: uniform samples every pixel gets first (4)\n"
+              << "  --max-spp N      adaptive: cap per pixel (4 x spp)\n"
+              << "  --threshold E    adaptive: relative error at which a pixel is converged (0.01)\n"
+              << "  --light-samples N  shadow rays per shading point once there are more lights, 0 = every light (4)\n"
+              << "  --light-selection power|tree  how those lights are picked (tree)\n"
+              << "  --shadow-samples N  stratified shadow rays per shading point to each area light (1)\n"
+              << "  --denoise        filter each frame, guided by albedo, normal and depth\n"
+              << "  --temporal       reuse earlier frames through reprojection, --spp new samples per frame\n"
+              << "  --history N      temporal: most samples the reprojected history counts as (8)\n"
+              << "  --orbit DEG      turn the camera around the focus point by DEG per frame (0)\n"
+              << "  --aov LIST       also write these AOVs of each frame as OUT_<name>_NNNN.pfm, comma separated:\n"
+              << "                   depth, normal, albedo, objectid, direct, visibility or all\n"
+              << "  --heatmap PREFIX also write a samples per pixel heatmap for each frame\n"
+              << "  --stats FILE     append each frame's ray counts and timings to FILE (JSON lines)\n"
+              << "  --timings        also time camera rays, tracing and lighting (slower)\n"
+              << "  --tile-heatmap PREFIX  also write the time spent per tile for each frame\n"
+              << "  --frames N       number of frames to render (1)\n"
+              << "  --time T         time of the first frame in seconds (0)\n"
+              << "  --dt T           time step between frames (1/30)\n"
+              << "  --shutter S      shutter open time in seconds for motion blur, 0 = off (1/60)\n"
+              << "  --aperture A     lens aperture (0.13)\n"
+              << "  --focus D        focus distance (2.0)\n"
+              << "                   with --scene these three default to the scene's values\n"
+              << "  --no-dof         disable depth of field\n"
+              << "  --threads N      render threads, 0 = all cores (0)\n"
+              << "  --packets N      trace camera rays in packets of 4, 8 or 16 (off),\n"
+              << "                   experimental and currently slower than single rays\n"
+              << "  --seed N         sampler seed (0)\n"
+              << "  --sampler S      independent, stratified, halton, sobol or bluenoise (sobol)\n"
+              << "  --pixel-format F framebuffer storage: rgb32f, rgba16f, rgb9e5 or srgb8 (rgb32f)\n"
+              << "  --format F       ppm or pfm (ppm)\n"
+              << "  --workers N      render frames in N worker processes started from this program\n"
+              << "  --listen ADDR    with --workers: unix:PATH or tcp:HOST:PORT to listen on (unix:/tmp/...)\n"
+              << "  --no-spawn       with --workers: wait for N workers started by hand instead\n"
+              << "  --worker ADDR    run as a worker for the coordinator at ADDR, same scene options\n"
+              << "  --fail-after N   testing: the (first) worker drops out after N tile ranges\n"
+              << "  --out PREFIX     output file prefix (frame)\n";
+}
+
+int main(int argc, char** argv) {
+    int width = 800, height = 600, samplesPerPixel = 16, frames = 1, threads = 0, packetSize = 0;
+    unsigned seed = 0;
+    SamplerType samplerType = SamplerType::Sobol;
+    PixelFormat pixelFormat = PixelFormat::RGB32F;
+    float startTime = 0.0f, timeStep = 1.0f / 30.0f, aperture = 0.13f, focus = 2.0f;
+    float shutter = 1.0f / 60.0f;
+    bool useDOF = true, adaptive = false, temporal = false, denoise = false, sceneCache = true;
+    TemporalSettings temporalSettings;
+    float orbit = 0.0f;
+    bool apertureSet = false, focusSet = false, shutterSet = false;
+    AdaptiveSettings adaptiveSettings;
+    adaptiveSettings.maxSamples = -1;
+    std::string format = "ppm", prefix = "frame", heatmapPrefix, scenePath, saveScenePath;
+    std::string statsPath, tileHeatmapPrefix;
+    bool timings = false;
+    AovMask aovs = 0;
+    int lightSamples = 4;
+    LightSelection lightSelection = LightSelection::Tree;
+    int shadowSamples = 1;
+    int workers = 0, failAfter = -1;
+    bool spawn = true;
+    std::string listenAddress = "unix:/tmp/ray_tracer_" + std::to_string(getpid()) + ".sock", workerAddress;
+    std::vector<std::string> workerArgs;  // Options passed on to spawned workers
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        int first = i;
+        try {
+            if (arg == "--no-dof") useDOF = false;
+            else if (arg == "--adaptive") adaptive = true;
+            else if (arg == "--temporal") temporal = true;
+            else if (arg == "--denoise") denoise = true;
+            else if (arg == "--no-scene-cache") sceneCache = false;
+            else if (arg == "--no-spawn") { spawn = false; continue; }
+            else if (arg == "--timings") timings = true;
+            else if (arg == "--help") { printUsage(argv[0]); return 0; }
+            else if (!hasValue) { printUsage(argv[0]); return 1; }
+            else if (arg == "--width") width = std::stoi(argv[++i]);
+            else if (arg == "--height") height = std::stoi(argv[++i]);
+            else if (arg == "--spp") samplesPerPixel = std::stoi(argv[++i]);
+            else if (arg == "--frames") frames = std::stoi(argv[++i]);
+            else if (arg == "--time") startTime = std::stof(argv[++i]);
+            else if (arg == "--dt") timeStep = std::stof(argv[++i]);
+            else if (arg == "--shutter") { shutter = std::stof(argv[++i]); shutterSet = true; }
+            else if (arg == "--aperture") { aperture = std::stof(argv[++i]); apertureSet = true; }
+            else if (arg == "--focus") { focus = std::stof(argv[++i]); focusSet = true; }
+            else if (arg == "--scene") scenePath = argv[++i];
+            else if (arg == "--save-scene") saveScenePath = argv[++i];
+            else if (arg == "--threads") threads = std::stoi(argv[++i]);
+            else if (arg == "--packets") packetSize = std::stoi(argv[++i]);
+            else if (arg == "--seed") seed = static_cast<unsigned>(std::stoul(argv[++i]));
+            else if (arg == "--sampler") {
+                if (!Sampler::parse(argv[++i], samplerType)) throw std::invalid_argument(arg);
+            }
+            else if (arg == "--pixel-format") {
+                if (!parsePixelFormat(argv[++i], pixelFormat)) throw std::invalid_argument(arg);
+            }
+            else if (arg == "--format") format = argv[++i];
+            else if (arg == "--workers") { workers = std::stoi(argv[++i]); continue; }
+            else if (arg == "--listen") { listenAddress = argv[++i]; continue; }
+            else if (arg == "--worker") workerAddress = argv[++i];
+            else if (arg == "--fail-after") { failAfter = std::stoi(argv[++i]); continue; }
+            else if (arg == "--out") prefix = argv[++i];
+            else if (arg == "--min-spp") adaptiveSettings.minSamples = std::stoi(argv[++i]);
+            else if (arg == "--max-spp") adaptiveSettings.maxSamples = std::stoi(argv[++i]);
+            else if (arg == "--threshold") adaptiveSettings.threshold = std::stof(argv[++i]);
+            else if (arg == "--history") temporalSettings.maxHistory = std::stoi(argv[++i]);
+            else if (arg == "--orbit") orbit = std::stof(argv[++i]);
+            else if (arg == "--light-samples") lightSamples = std::stoi(argv[++i]);
+            else if (arg == "--shadow-samples") shadowSamples = std::stoi(argv[++i]);
+            else if (arg == "--light-selection") {
+                if (!parseLightSelection(argv[++i], lightSelection)) throw std::invalid_argument(arg);
+            }
+            else if (arg == "--aov") {
+                std::stringstream list(argv[++i]);
+                std::string name;
+                while (std::getline(list, name, ',')) {
+                    Aov aov;
+                    if (name == "all") aovs = kAllAovs;
+                    else if (parseAov(name, aov)) aovs |= aovBit(aov);
+                    else throw std::invalid_argument(arg);
+                }
+            }
+            else if (arg == "--heatmap") heatmapPrefix = argv[++i];
+            else if (arg == "--stats") statsPath = argv[++i];
+            else if (arg == "--tile-heatmap") tileHeatmapPrefix = argv[++i];
+            else { printUsage(argv[0]); return 1; }
+            workerArgs.insert(workerArgs.end(), argv + first, argv + i + 1);
+        } catch (const std::exception&) {
+            std::cerr << "Bad value for " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    if (width <= 0 || height <= 0 || samplesPerPixel <= 0 || frames <= 0 || shutter < 0.0f || shadowSamples <= 0 ||
+        (format != "ppm" && format != "pfm")) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    if (workers > 0 && (adaptive || temporal || denoise || aovs != 0 || orbit != 0.0f || !heatmapPrefix.empty() || !statsPath.empty() ||
+                        !tileHeatmapPrefix.empty())) {
+        std::cerr << "--workers renders uniform frames only, without --adaptive, --temporal, --denoise, --aov, --orbit, --heatmap, --stats or --tile-heatmap" << std::endl;
+        return 1;
+    }
+    if (adaptive && temporal) {
+        std::cerr << "--adaptive and --temporal don't combine" << std::endl;
+        return 1;
+    }
+    if (denoise && temporal) {
+        std::cerr << "--denoise and --temporal don't combine" << std::endl;
+        return 1;
+    }
+
+    RayTracer tracer(width, height, aperture, focus);
+    if (scenePath.empty()) {
+        tracer.setupScene();
+        tracer.shutter = shutter;
+    } else {
+        auto start = std::chrono::steady_clock::now();
+        if (!loadScene(scenePath, tracer, sceneCache)) return 1;
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << scenePath << ": " << tracer.spheres.size() << " spheres loaded in " << ms << " ms" << std::endl;
+        if (apertureSet) tracer.apertureSize = aperture;
+        if (focusSet) tracer.focusDistance = focus;
+        if (shutterSet) tracer.shutter = shutter;
+    }
+    if (!workerAddress.empty()) {
+        tracer.setThreadCount(threads);
+        return runRenderWorker(workerAddress, tracer, failAfter) ? 0 : 1;
+    }
+
+    SceneMemory memory = tracer.memoryUsage();
+    auto kb = [](size_t bytes) { return static_cast<double>(bytes) / 1024.0; };
+    std::cout << tracer.spheres.size() << " spheres, " << tracer.materials.size() << " materials, "
+              << std::fixed << std::setprecision(1) << kb(memory.total()) << " KB (geometry " << kb(memory.geometry)
+              << ", materials " << kb(memory.materials) << ", motion " << kb(memory.motion)
+              << ", bvh " << kb(memory.bvh) << ")" << std::defaultfloat << std::setprecision(6) << std::endl;
+
+    if (!saveScenePath.empty()) {
+        bool binary = saveScenePath.size() > 4 && saveScenePath.compare(saveScenePath.size() - 4, 4, ".bin") == 0;
+        if (binary && tracer.bvh.shutterTime() != tracer.shutter) tracer.commitScene();
+        return (binary ? saveSceneBinary(saveScenePath, tracer) : saveSceneText(saveScenePath, tracer)) ? 0 : 1;
+    }
+    tracer.setThreadCount(threads);
+    tracer.packetSize = packetSize;
+    tracer.seed = seed;
+    tracer.samplerType = samplerType;
+    tracer.pixelFormat = pixelFormat;
+    tracer.collectTimings = timings;
+    tracer.denoise = denoise;
+    tracer.aovs = aovs;
+    tracer.lightSamples = lightSamples;
+    tracer.lightSelection = lightSelection;
+    tracer.shadowSamples = shadowSamples;
+    adaptiveSettings.averageSamples = static_cast<float>(samplesPerPixel);
+    if (adaptiveSettings.maxSamples < 0) adaptiveSettings.maxSamples = 4 * samplesPerPixel;
+
+    std::ofstream statsFile;
+    if (!statsPath.empty()) {
+        statsFile.open(statsPath, std::ios::app);
+        if (!statsFile.is_open()) {
+            std::cerr << "Failed to open " << statsPath << std::endl;
+            return 1;
+        }
+    }
+
+    RenderCoordinator coordinator;
+    std::vector<pid_t> workerPids;
+    if (workers > 0) {
+        if (!coordinator.listen(listenAddress)) return 1;
+        // Local workers split the cores between them unless told otherwise
+        int workerThreads = threads > 0 ? threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()) / workers);
+        for (int w = 0; spawn && w < workers; ++w) {
+            std::vector<std::string> args = workerArgs;
+            args.insert(args.end(), {"--worker", coordinator.address(), "--threads", std::to_string(workerThreads)});
+            if (w == 0 && failAfter >= 0) args.insert(args.end(), {"--fail-after", std::to_string(failAfter)});
+            pid_t pid = spawnWorker(argv, args);
+            if (pid > 0) workerPids.push_back(pid);
+        }
+        if (!spawn) std::cout << "Waiting for " << workers << " workers on " << coordinator.address() << std::endl;
+        int connected = coordinator.acceptWorkers(workers, tracer, spawn ? 30000 : 600000);
+        std::cout << connected << " of " << workers << " workers connected" << std::endl;
+    }
+
+    double totalMs = 0.0;
+    Vec3 orbitOffset = tracer.cameraPosition - tracer.focusPoint;
+    for (int frame = 0; frame < frames; ++frame) {
+        float time = startTime + frame * timeStep;
+        float effectValue = std::sin(time) * 3.5f + 4.0f;  // Same as the viewer, no longer affects the image
+        if (orbit != 0.0f) {
+            // Around the y axis through the focus point
+            float angle = orbit * frame * static_cast<float>(M_PI) / 180.0f;
+            float c = std::cos(angle), s = std::sin(angle);
+            tracer.cameraPosition = tracer.focusPoint + Vec3(orbitOffset.x * c + orbitOffset.z * s, orbitOffset.y,
+                                                             orbitOffset.z * c - orbitOffset.x * s);
+            tracer.updateCameraBasis();
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        int64_t traced = static_cast<int64_t>(samplesPerPixel) * width * height;
+        if (adaptive) {
+            traced = tracer.renderAdaptive(time, effectValue, useDOF, adaptiveSettings);
+        } else if (temporal) {
+            // Each frame adds its samples on top of what was reprojected, a still camera stops once spp are in
+            if (!tracer.renderTemporal(time, effectValue, useDOF, samplesPerPixel, samplesPerPixel, temporalSettings)) traced = 0;
+        } else if (workers > 0) {
+            coordinator.renderFrame(tracer, time, effectValue, useDOF, samplesPerPixel);
+        } else {
+            tracer.renderFrame(time, effectValue, useDOF, samplesPerPixel);
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        totalMs += ms;
+
+        char name[32];
+        std::snprintf(name, sizeof(name), "_%04d.", frame);
+        std::string path = prefix + name + format;
+        std::vector<Vec3> image = tracer.getFramebuffer();
+        bool written = format == "pfm" ? writePFM(path, image, width, height) : writePPM(path, image, width, height);
+        if (!written) {
+            std::cerr << "Failed to write " << path << std::endl;
+            return 1;
+        }
+        for (int a = 0; a < kAovCount; ++a) {
+            Aov aov = static_cast<Aov>(a);
+            std::vector<Vec3> values;
+            if (!(aovs & aovBit(aov)) || !tracer.getAov(aov, values)) continue;
+            std::string aovPath = prefix + "_" + aovName(aov) + name + "pfm";
+            if (!writePFM(aovPath, values, width, height)) {
+                std::cerr << "Failed to write " << aovPath << std::endl;
+                return 1;
+            }
+        }
+        if (!heatmapPrefix.empty()) {
+            const std::vector<int>& counts = tracer.getSampleCounts();
+            std::vector<float> values(counts.begin(), counts.end());
+            std::string heatmapPath = heatmapPrefix + name + "ppm";
+            if (!writeHeatmapPPM(heatmapPath, values, width, height, static_cast<float>(adaptiveSettings.maxSamples))) {
+                std::cerr << "Failed to write " << heatmapPath << std::endl;
+                return 1;
+            }
+        }
+        const RenderStats& stats = tracer.getStats();
+        if (statsFile.is_open()) statsFile << "{\"frame\":" << frame << ",\"path\":\"" << path << "\",\"stats\":" << stats.toJson() << "}\n";
+        if (!tileHeatmapPrefix.empty()) {
+            std::string tilePath = tileHeatmapPrefix + name + "ppm";
+            if (!writeHeatmapPPM(tilePath, stats.tileCostImage(), width, height, stats.maxTileMs())) {
+                std::cerr << "Failed to write " << tilePath << std::endl;
+                return 1;
+            }
+        }
+        std::cout << path << ": " << ms << " ms, " << static_cast<double>(traced) / (width * height) << " spp" << std::endl;
+        if (workers > 0) {
+            const DistributedStats& stats = coordinator.getStats();
+            std::cout << "  tiles per worker:";
+            for (int tiles : stats.workerTiles) std::cout << " " << tiles;
+            std::cout << ", " << stats.lostWorkers << " lost, " << stats.reassignedTiles << " reassigned, "
+                      << stats.localTiles << " rendered locally" << std::endl;
+        }
+    }
+    coordinator.shutdown();
+    reapWorkers(workerPids);
+
+    std::cout << frames << " frames, ";
+    if (workers > 0) std::cout << workers << " workers, ";
+    else std::cout << tracer.getThreadCount() << " threads, ";
+    std::cout << totalMs / frames << " ms/frame" << std::endl;
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include "imageio.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+
+static_assert(sizeof(Vec3) == 3 * sizeof(float), "PFM rows are copied straight from Vec3 pixels");
+
+static uint8_t toByte(float value) {
+    // Gamma correction, same curve as the viewer's fragment shader
+    float c = std::pow(std::min(std::max(value, 0.0f), 1.0f), 1.0f / 2.2f);
+    return static_cast<uint8_t>(c * 255.0f + 0.5f);
+}
+
+bool writePPM(const std::string& path, const std::vector<Vec3>& pixels, int width, int height) {
+    std::ofstream file(path, std::ios::binary);
+    if (!file.is_open()) return false;
+
+    file << "P6\n" << width << " " << height << "\n255\n";
+    std::vector<uint8_t> row(width * 3);
+    // PPM is stored top to bottom
+    for (int y = height - 1; y >= 0; --y) {
+        for (int x = 0; x < width; ++x) {
+            const Vec3& p = pixels[y * width + x];
+            row[x * 3 + 0] = toByte(p.x);
+            row[x * 3 + 1] = toByte(p.y);
+            row[x * 3 + 2] = toByte(p.z);
+        }
+        file.write(reinterpret_cast<const char*>(row.data()), row.size());
+    }
+    return file.good();
+}
+
+bool writePFM(const std::string& path, const std::vector<Vec3>& pixels, int width, int height) {
+    std::ofstream file(path, std::ios::binary);
+    if (!file.is_open()) return false;
+
+    // Negative scale marks little-endian data
+    uint16_t probe = 1;
+    bool littleEndian = *reinterpret_cast<uint8_t*>(&probe) == 1;
+    file << "PF\n" << width << " " << height << "\n" << (littleEndian ? "-1.0" : "1.0") << "\n";
+
+    // PFM is stored bottom to top, same as the framebuffer
+    std::vector<float> row(width * 3);
+    for (int y = 0; y < height; ++y) {
+        std::memcpy(row.data(), &pixels[y * width], width * sizeof(Vec3));
+        file.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+    }
+    return file.good();
+}
+
+bool readPFM(const std::string& path, std::vector<Vec3>& pixels, int& width, int& height) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) return false;
+
+    std::string magic;
+    float scale = 0.0f;
+    file >> magic >> width >> height >> scale;
+    file.get();  // Single whitespace before the data
+    if (!file || magic != "PF" || width <= 0 || height <= 0 || scale == 0.0f) return false;
+
+    pixels.resize(static_cast<size_t>(width) * height);
+    file.read(reinterpret_cast<char*>(pixels.data()), pixels.size() * sizeof(Vec3));
+    if (!file) return false;
+
+    uint16_t probe = 1;
+    bool littleEndian = *reinterpret_cast<uint8_t*>(&probe) == 1;
+    if ((scale < 0.0f) != littleEndian) {
+        uint8_t* bytes = reinterpret_cast<uint8_t*>(pixels.data());
+        for (size_t i = 0; i < pixels.size() * sizeof(Vec3); i += 4) {
+            std::swap(bytes[i], bytes[i + 3]);
+            std::swap(bytes[i + 1], bytes[i + 2]);
+        }
+    }
+    return true;
+}
+
+bool writeHeatmapPPM(const std::string& path, const std::vector<float>& values, int width, int height, float maxValue) {
+    // Blue, cyan, green, yellow, red
+    static const float ramp[5][3] = {{0, 0, 0.5f}, {0, 1, 1}, {0, 1, 0}, {1, 1, 0}, {1, 0, 0}};
+
+    std::vector<Vec3> pixels(values.size());
+    for (size_t i = 0; i < values.size(); ++i) {
+        float v = maxValue > 0.0f ? std::min(std::max(values[i] / maxValue, 0.0f), 1.0f) * 4.0f : 0.0f;
+        int k = std::min(static_cast<int>(v), 3);
+        float f = v - k;
+        pixels[i] = Vec3(ramp[k][0] + (ramp[k + 1][0] - ramp[k][0]) * f,
+                         ramp[k][1] + (ramp[k + 1][1] - ramp[k][1]) * f,
+                         ramp[k][2] + (ramp[k + 1][2] - ramp[k][2]) * f);
+        // writePPM applies display gamma, undo it so the ramp lands as written
+        pixels[i] = Vec3(std::pow(pixels[i].x, 2.2f), std::pow(pixels[i].y, 2.2f), std::pow(pixels[i].z, 2.2f));
+    }
+    return writePPM(path, pixels, width, height);
+}
@@ -0,0 +1,22 @@
+#ifndef IMAGEIO_HPP
+#define IMAGEIO_HPP
+
+#include <string>
+#include <vector>
+#include "utilities.hpp"
+
+// Image writers for the offline tools. Pixels are row 0 = bottom, like the
+// texture the viewer uploads. They return false if the file can't be written.
+
+// 8-bit binary PPM, clamped and gamma corrected like fragment_shader.glsl
+bool writePPM(const std::string& path, const std::vector<Vec3>& pixels, int width, int height);
+
+// Linear float PFM, keeps the full range of the framebuffer
+bool writePFM(const std::string& path, const std::vector<Vec3>& pixels, int width, int height);
+// Reads a color PFM of either byte order, false if it's missing or not one
+bool readPFM(const std::string& path, std::vector<Vec3>& pixels, int& width, int& height);
+
+// False-color PPM of one value per pixel, 0 = dark blue up to maxValue = red
+bool writeHeatmapPPM(const std::string& path, const std::vector<float>& values, int width, int height, float maxValue);
+
+#endif
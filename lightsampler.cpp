@@ -0,0 +1,330 @@
+#include "lightsampler.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+const float kPi = 3.14159265f;
+
+// Two unit vectors completing n to an orthonormal frame (Duff et al. 2017)
+void orthonormalFrame(const Vec3& n, Vec3& t, Vec3& b) {
+    float sign = std::copysign(1.0f, n.z);
+    float a = -1.0f / (sign + n.z);
+    float c = n.x * n.y * a;
+    t = Vec3(1.0f + sign * n.x * n.x * a, sign * c, -sign * n.x);
+    b = Vec3(c, sign + n.y * n.y * a, -n.y);
+}
+
+}  // namespace
+
+const char* lightSelectionName(LightSelection selection) {
+    return selection == LightSelection::Power ? "power" : "tree";
+}
+
+bool parseLightSelection(const char* text, LightSelection& selection) {
+    if (std::strcmp(text, "power") == 0) selection = LightSelection::Power;
+    else if (std::strcmp(text, "tree") == 0) selection = LightSelection::Tree;
+    else return false;
+    return true;
+}
+
+void AliasTable::build(const std::vector<float>& weights) {
+    int n = static_cast<int>(weights.size());
+    bins.assign(n, Bin{1.0f, 0, 0.0f});
+    double sum = 0.0;
+    for (float w : weights) sum += std::max(w, 0.0f);
+    if (sum <= 0.0) {
+        bins.clear();
+        return;
+    }
+
+    // Vose: pair each underfull bin with an overfull one that tops it up
+    std::vector<double> scaled(n);
+    std::vector<int> small, large;
+    for (int i = 0; i < n; ++i) {
+        double p = std::max(weights[i], 0.0f) / sum;
+        bins[i].pdf = static_cast<float>(p);
+        bins[i].alias = i;
+        scaled[i] = p * n;
+        (scaled[i] < 1.0 ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        int s = small.back(), l = large.back();
+        small.pop_back();
+        large.pop_back();
+        bins[s].threshold = static_cast<float>(scaled[s]);
+        bins[s].alias = l;
+        scaled[l] += scaled[s] - 1.0;
+        (scaled[l] < 1.0 ? small : large).push_back(l);
+    }
+    // Whatever is left is full up to rounding
+    for (int i : small) bins[i].threshold = 1.0f;
+    for (int i : large) bins[i].threshold = 1.0f;
+}
+
+int AliasTable::sample(float u, float& pdf) const {
+    if (bins.empty()) return -1;
+    int n = static_cast<int>(bins.size());
+    float scaled = u * n;
+    int bin = std::min(static_cast<int>(scaled), n - 1);
+    int pick = scaled - bin < bins[bin].threshold ? bin : bins[bin].alias;
+    pdf = bins[pick].pdf;
+    return pick;
+}
+
+float lightExtent(const Light& light) {
+    switch (light.shape) {
+        case LightShape::Sphere:
+        case LightShape::Disk: return light.radius;
+        case LightShape::Quad: return 0.5f * std::sqrt(light.edgeU.dot(light.edgeU) + light.edgeV.dot(light.edgeV));
+        default: return 0.0f;
+    }
+}
+
+bool AreaLightSampler::setup(const Light& target, const Vec3& from) {
+    light = &target;
+    point = from;
+    sphericalRect = false;
+    Vec3 toCenter = target.position - from;
+    float distance2 = toCenter.dot(toCenter);
+    switch (target.shape) {
+        case LightShape::Sphere: {
+            float radius2 = target.radius * target.radius;
+            centerDistance = std::sqrt(distance2);
+            if (distance2 <= radius2) {
+                oneMinusCosMax = 0.0f;
+                return true;
+            }
+            axis = toCenter / centerDistance;
+            orthonormalFrame(axis, tangent, bitangent);
+            float sin2Max = radius2 / distance2;
+            oneMinusCosMax = sin2Max / (1.0f + std::sqrt(1.0f - sin2Max));
+            return true;
+        }
+        case LightShape::Disk: {
+            if (toCenter.dot(target.normal) >= 0.0f) return false;
+            orthonormalFrame(target.normal, tangent, bitangent);
+            // 2 pi (1 - cos) of the disk's rim seen from its axis at this distance
+            float radius2 = target.radius * target.radius;
+            float slant = std::sqrt(distance2 + radius2);
+            headOn = 2.0f * kPi * radius2 / (slant * (slant + std::sqrt(distance2)));
+            return headOn > 0.0f;
+        }
+        case LightShape::Quad: {
+            if (toCenter.dot(target.edgeU.cross(target.edgeV)) >= 0.0f) return false;
+            float a = target.edgeU.length(), b = target.edgeV.length(), d2 = 4.0f * distance2;
+            headOn = 4.0f * std::asin(std::min(1.0f, a * b / std::sqrt((a * a + d2) * (b * b + d2))));
+
+            // Urena et al., "An Area-Preserving Parametrization for Spherical
+            // Rectangles", in the quad's frame with the point at the origin
+            frameX = target.edgeU / a;
+            frameY = target.edgeV / b;
+            frameZ = frameX.cross(frameY);
+            Vec3 corner = target.position - (target.edgeU + target.edgeV) * 0.5f - from;
+            x0 = corner.dot(frameX);
+            y0 = corner.dot(frameY);
+            z0 = corner.dot(frameZ);
+            if (z0 > 0.0f) {
+                frameZ = -frameZ;
+                z0 = -z0;
+            }
+            x1 = x0 + a;
+            y1 = y0 + b;
+            Vec3 v00(x0, y0, z0), v01(x0, y1, z0), v10(x1, y0, z0), v11(x1, y1, z0);
+
+            // Solid angle as two triangles (Van Oosterom and Strackee), stable
+            // where the sum of the four corner angles minus 2 pi would cancel
+            auto triangle = [](const Vec3& p, const Vec3& q, const Vec3& r) {
+                float lp = p.length(), lq = q.length(), lr = r.length();
+                float det = std::fabs(p.dot(q.cross(r)));
+                return 2.0f * std::atan2(det, lp * lq * lr + p.dot(q) * lr + p.dot(r) * lq + q.dot(r) * lp);
+            };
+            solidAngle = triangle(v00, v10, v11) + triangle(v00, v11, v01);
+
+            // The edge planes' normals n0..n3 are axis aligned here, so the corner
+            // angles g2 (at v01) and g3 (at v00) need no trigonometry. k = 2 pi - g2 - g3.
+            float l0 = std::sqrt(z0 * z0 + y0 * y0), l2 = std::sqrt(z0 * z0 + y1 * y1), l3 = std::sqrt(z0 * z0 + x0 * x0);
+            float cos2 = x0 * y1 / (l2 * l3), sin2 = -z0 * v01.length() / (l2 * l3);
+            float cos3 = -x0 * y0 / (l3 * l0), sin3 = -z0 * v00.length() / (l3 * l0);
+            cosK = cos2 * cos3 - sin2 * sin3;
+            sinK = -(sin2 * cos3 + cos2 * sin3);
+            b0 = -y0 / l0;
+            b1 = y1 / l2;
+            // Below this float no longer resolves the angles, while area sampling is as good
+            sphericalRect = solidAngle > 1e-6f;
+            return headOn > 0.0f;
+        }
+        default: return true;
+    }
+}
+
+LightSample AreaLightSampler::toward(const Vec3& target) const {
+    Vec3 offset = target - point;
+    LightSample sample;
+    sample.distance = offset.length();
+    sample.direction = offset / sample.distance;
+    sample.weight = 1.0f;
+    return sample;
+}
+
+LightSample AreaLightSampler::sampleArea(float u, float v) const {
+    Vec3 target, normal;
+    float area;
+    if (light->shape == LightShape::Disk) {
+        // Concentric map of the square onto the disk, keeps the strata compact
+        float a = 2.0f * u - 1.0f, b = 2.0f * v - 1.0f, r, phi;
+        if (a * a > b * b) {
+            r = a;
+            phi = 0.25f * kPi * (b / a);
+        } else {
+            r = b;
+            phi = b != 0.0f ? 0.5f * kPi - 0.25f * kPi * (a / b) : 0.0f;
+        }
+        r *= light->radius;
+        target = light->position + tangent * (r * std::cos(phi)) + bitangent * (r * std::sin(phi));
+        normal = light->normal;
+        area = kPi * light->radius * light->radius;
+    } else {
+        target = light->position + light->edgeU * (u - 0.5f) + light->edgeV * (v - 0.5f);
+        Vec3 n = light->edgeU.cross(light->edgeV);
+        area = n.length();
+        normal = n / area;
+    }
+    // Turns the area density into one over directions
+    LightSample sample = toward(target);
+    float cosLight = -sample.direction.dot(normal);
+    sample.weight = cosLight > 0.0f ? area * cosLight / (sample.distance * sample.distance * headOn) : 0.0f;
+    return sample;
+}
+
+LightSample AreaLightSampler::sample(float u, float v) const {
+    switch (light->shape) {
+        case LightShape::Sphere: {
+            // The pdf is 1 / (cone's solid angle), exactly the normalization
+            // in Light, so every direction in the cone weighs 1
+            float phi = 2.0f * kPi * v;
+            LightSample sample;
+            sample.weight = 1.0f;
+            if (oneMinusCosMax == 0.0f) {
+                // Inside the light, it surrounds the point
+                float z = 1.0f - 2.0f * u, s = std::sqrt(std::max(0.0f, 1.0f - z * z));
+                sample.direction = Vec3(s * std::cos(phi), s * std::sin(phi), z);
+                Vec3 offset = point - light->position;
+                float along = offset.dot(sample.direction);
+                float c = offset.dot(offset) - light->radius * light->radius;
+                sample.distance = -along + std::sqrt(std::max(0.0f, along * along - c));
+                return sample;
+            }
+            float oneMinusCos = u * oneMinusCosMax;
+            float cosTheta = 1.0f - oneMinusCos, sin2Theta = oneMinusCos * (2.0f - oneMinusCos);
+            float sinTheta = std::sqrt(sin2Theta);
+            sample.direction = tangent * (sinTheta * std::cos(phi)) + bitangent * (sinTheta * std::sin(phi)) + axis * cosTheta;
+            // Nearer of the two hits along it, the rim where they meet
+            float radius2 = light->radius * light->radius;
+            float inside = radius2 - centerDistance * centerDistance * sin2Theta;
+            sample.distance = centerDistance * cosTheta - std::sqrt(std::max(0.0f, inside));
+            return sample;
+        }
+        case LightShape::Disk: return sampleArea(u, v);
+        case LightShape::Quad: {
+            if (!sphericalRect) return sampleArea(u, v);
+            // cos and sin of k + u * solidAngle by the angle sum, so float keeps
+            // the small angles the difference of large ones would lose
+            float angle = u * solidAngle, c = std::cos(angle), s = std::sin(angle);
+            float cosAu = cosK * c - sinK * s, sinAu = sinK * c + cosK * s;
+            float fu = (cosAu * b0 - b1) / sinAu;
+            float cu = std::copysign(1.0f, fu) / std::sqrt(fu * fu + b0 * b0);
+            cu = std::min(1.0f, std::max(-1.0f, cu));
+            float xu = -(cu * z0) / std::sqrt(std::max(1e-30f, 1.0f - cu * cu));
+            xu = std::min(x1, std::max(x0, xu));
+            float d2 = xu * xu + z0 * z0;
+            float h0 = y0 / std::sqrt(d2 + y0 * y0), h1 = y1 / std::sqrt(d2 + y1 * y1);
+            float hv = h0 + v * (h1 - h0), hv2 = hv * hv;
+            float yv = hv2 < 1.0f - 1e-6f ? hv * std::sqrt(d2 / (1.0f - hv2)) : y1;
+            Vec3 target = point + frameX * xu + frameY * yv + frameZ * z0;
+            LightSample sample = toward(target);
+            sample.weight = solidAngle / headOn;
+            return sample;
+        }
+        default: return toward(light->position);
+    }
+}
+
+void LightTree::build(const std::vector<Light>& lights) {
+    nodes.clear();
+    lightCount = static_cast<int>(lights.size());
+    if (lights.empty()) return;
+    nodes.reserve(2 * lights.size() - 1);
+    std::vector<int> order(lights.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = static_cast<int>(i);
+    buildNode(lights, order, 0, lightCount);
+}
+
+int LightTree::buildNode(const std::vector<Light>& lights, std::vector<int>& order, int first, int last) {
+    Vec3 lo = lights[order[first]].position, hi = lo;
+    Vec3 bodyLo = lo, bodyHi = hi;  // Including each light's extent
+    float power = 0.0f;
+    for (int i = first; i < last; ++i) {
+        const Vec3& p = lights[order[i]].position;
+        float r = lightExtent(lights[order[i]]);
+        lo = Vec3(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+        hi = Vec3(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+        bodyLo = Vec3(std::min(bodyLo.x, p.x - r), std::min(bodyLo.y, p.y - r), std::min(bodyLo.z, p.z - r));
+        bodyHi = Vec3(std::max(bodyHi.x, p.x + r), std::max(bodyHi.y, p.y + r), std::max(bodyHi.z, p.z + r));
+        power += std::max(lights[order[i]].intensity, 0.0f);
+    }
+
+    int index = static_cast<int>(nodes.size());
+    Vec3 extent = hi - lo;
+    nodes.push_back(Node{(bodyLo + bodyHi) * 0.5f, ((bodyHi - bodyLo) * 0.5f).length(), power, -1, order[first]});
+    if (last - first == 1) return index;
+
+    // Median split along the widest axis of the light positions
+    int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+    auto coordinate = [&](int light) {
+        const Vec3& p = lights[light].position;
+        return axis == 0 ? p.x : (axis == 1 ? p.y : p.z);
+    };
+    int middle = (first + last) / 2;
+    std::nth_element(order.begin() + first, order.begin() + middle, order.begin() + last,
+                     [&](int a, int b) { return coordinate(a) < coordinate(b); });
+    buildNode(lights, order, first, middle);
+    int right = buildNode(lights, order, middle, last);
+    nodes[index].right = right;
+    return index;
+}
+
+float LightTree::importance(const Node& node, const Vec3& point, const Vec3& normal) const {
+    Vec3 toCenter = node.center - point;
+    float distance2 = toCenter.dot(toCenter);
+    if (distance2 <= node.radius * node.radius) return node.power;
+
+    // The largest cosine between normal and a direction into the sphere,
+    // cos(angle - halfAngle), is at most cos(angle) + sin(halfAngle)
+    float cosBound = (normal.dot(toCenter) + node.radius) / std::sqrt(distance2);
+    return cosBound > 0.0f ? node.power * std::min(cosBound, 1.0f) : 0.0f;
+}
+
+int LightTree::sample(const Vec3& point, const Vec3& normal, float u, float& pdf) const {
+    if (nodes.empty() || importance(nodes[0], point, normal) <= 0.0f) return -1;
+    pdf = 1.0f;
+    int node = 0;
+    while (nodes[node].right >= 0) {
+        int left = node + 1, right = nodes[node].right;
+        float wl = importance(nodes[left], point, normal), wr = importance(nodes[right], point, normal);
+        if (wl + wr <= 0.0f) return -1;  // Every light below faces away after all
+        // Reuse u for the next level, rescaled to the part of [0, 1) the pick covered
+        float pl = wl / (wl + wr);
+        if (u < pl) {
+            u = u / pl;
+            pdf *= pl;
+            node = left;
+        } else {
+            u = (u - pl) / (1.0f - pl);
+            pdf *= 1.0f - pl;
+            node = right;
+        }
+        u = std::min(u, 0.99999994f);
+    }
+    return nodes[node].light;
+}
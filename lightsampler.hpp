@@ -0,0 +1,113 @@
+#ifndef LIGHTSAMPLER_HPP
+#define LIGHTSAMPLER_HPP
+
+#include <cmath>
+#include <vector>
+#include "utilities.hpp"
+
+// How computeLighting picks lights once there are more than RayTracer::lightSamples
+enum class LightSelection {
+    Power,  // In proportion to intensity, from an alias table
+    Tree,   // By intensity and how well the lights can face the point, through a light BVH
+};
+
+const char* lightSelectionName(LightSelection selection);
+// Parses the names returned by lightSelectionName, false if unknown
+bool parseLightSelection(const char* text, LightSelection& selection);
+
+// Walker/Vose alias table: draws index i with probability weights[i] / sum in O(1)
+class AliasTable {
+public:
+    void build(const std::vector<float>& weights);
+    int size() const { return static_cast<int>(bins.size()); }
+    // u in [0, 1). Returns the index and its probability, -1 if every weight is 0.
+    int sample(float u, float& pdf) const;
+
+private:
+    struct Bin {
+        float threshold;  // Below it the bin's own index is drawn, above it alias
+        int alias;
+        float pdf;        // Probability of drawing this bin's own index overall
+    };
+    std::vector<Bin> bins;
+};
+
+// Radius of a sphere around position that holds the whole light
+float lightExtent(const Light& light);
+
+// Point index of count points spread over [0, 1)^2 and shifted by (su, sv):
+// u falls in its own of count strata, v follows a golden ratio lattice, so any
+// count covers the square evenly and count = 1 gives (su, sv) itself.
+inline void stratifiedPoint(int index, int count, float su, float sv, float& u, float& v) {
+    u = (static_cast<float>(index) + su) / static_cast<float>(count);
+    v = sv + 0.618034f * static_cast<float>(index);
+    v -= std::floor(v);
+}
+
+// One shadow ray towards a light
+struct LightSample {
+    Vec3 direction;  // Unit, from the shading point
+    float distance;  // Up to the light along direction
+    float weight;    // Times intensity * cos, an unbiased estimate of the light arriving (see Light)
+};
+
+// Draws points on one light as seen from one shading point. Spheres are sampled
+// uniformly in the cone they subtend and quads over the spherical rectangle
+// they subtend (Urena et al. 2013), both in solid angle. Disks have no closed
+// form for that and are sampled by area, as are quads too small or far to
+// resolve their solid angle in float.
+class AreaLightSampler {
+public:
+    // False if the point can't get any light from it, behind a disk or quad
+    bool setup(const Light& light, const Vec3& point);
+    // u, v in [0, 1)
+    LightSample sample(float u, float v) const;
+
+private:
+    const Light* light = nullptr;
+    Vec3 point;
+    float headOn = 0.0f;  // Solid angle of the light seen head-on from here
+
+    // Sphere: frame around the direction to the center and the cone's extent
+    Vec3 axis, tangent, bitangent;
+    float oneMinusCosMax = 0.0f;  // 0 = the point is inside, sample all directions
+    float centerDistance = 0.0f;
+
+    // Quad seen as a spherical rectangle, in its local frame
+    bool sphericalRect = false;
+    float solidAngle = 0.0f;
+    float x0, y0, z0, x1, y1, b0, b1, cosK, sinK;
+    Vec3 frameX, frameY, frameZ;
+
+    LightSample toward(const Vec3& target) const;
+    LightSample sampleArea(float u, float v) const;
+};
+
+// Binary tree over the lights, one light per leaf. Each node keeps a sphere
+// around its lights (their extent included) and their total intensity. Going down,
+// a shading point picks a child in proportion to its intensity times the
+// largest cosine any point in its sphere can make with the normal, so lights
+// behind the surface are never drawn and the pick costs O(log n).
+class LightTree {
+public:
+    void build(const std::vector<Light>& lights);
+    int size() const { return lightCount; }
+    // u in [0, 1). Returns the light and its probability, -1 if none can reach the point.
+    int sample(const Vec3& point, const Vec3& normal, float u, float& pdf) const;
+
+private:
+    struct Node {
+        Vec3 center;
+        float radius;
+        float power;  // Sum of the intensities below
+        int right;    // Second child, the first follows the node; -1 for a leaf
+        int light;    // Leaf's light
+    };
+    std::vector<Node> nodes;
+    int lightCount = 0;
+
+    int buildNode(const std::vector<Light>& lights, std::vector<int>& order, int first, int last);
+    float importance(const Node& node, const Vec3& point, const Vec3& normal) const;
+};
+
+#endif
@@ -1,11 +1,17 @@
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include "raytracer.hpp"
+#include "scene.hpp"
+#include "presenter.hpp"
+#include "triplebuffer.hpp"
 
 using namespace std;
 
@@ -42,7 +48,7 @@ GLuint compileShader(GLenum type, const std::string& source) {
     return shader;
 }
 
-int main() {
+int main(int argc, char** argv) {
     if (!glfwInit()) {
         std::cerr << "Failed to initialize GLFW" << std::endl;
         return -1;
@@ -69,7 +75,15 @@ int main() {
     //FOR DOF
     // Instantiate RayTracer with aperture size and focus distance for depth of field
     RayTracer tracer(width, height, 0.13f, 2.0f); // Aperture size 0.13, focus at changing values.
-    tracer.setupScene();
+    // Optional scene file as the only argument, see scene.hpp
+    if (argc > 1) {
+        if (!loadScene(argv[1], tracer)) {
+            glfwTerminate();
+            return -1;
+        }
+    } else {
+        tracer.setupScene();
+    }
 
     glViewport(0, 0, width, height);
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
@@ -111,51 +125,85 @@ int main() {
 
     glBindVertexArray(0);
 
-    GLuint texture;
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    // The tracer writes finished pixels straight into the presenter's upload slots.
+    // Half floats keep the range the shader needs at 8 bytes a pixel instead of 12.
+    tracer.pixelFormat = PixelFormat::RGBA16F;
+    FramePresenter presenter;
+    if (!presenter.init(width, height, tracer.pixelFormat)) {
+        std::cerr << "Failed to set up frame presentation" << std::endl;
+        return -1;
+    }
 
     // UNCOMMENT THIS FOR MULTI
     int samplesPerPixel = 16;  // Number of rays per pixel for supersampling 
 
-    while (!glfwWindowShouldClose(window)) {
-        effectValue = sin(glfwGetTime()) * 3.5f + 4.0f;
-        tracer.renderFrame(glfwGetTime(), effectValue, true, 16); // Apply depth of field (DOF)
-
-        //USE THIS FOR 1PX
-
-        // tracer.renderFrame(glfwGetTime(), effectValue);
-
-        //USE THIS FOR MULTI
-        // tracer.renderFrame(glfwGetTime(), effectValue, samplesPerPixel);  // Modified to handle supersampling
-        std::vector<float> flatFramebuffer;
-        // const std::vector<Vec3>& framebuffer = tracer.getFramebuffer();
-        const std::vector<Vec3>& framebuffer = tracer.getFramebuffer();
-        for (const auto& pixel : framebuffer) {
-            flatFramebuffer.push_back(pixel.x);
-            flatFramebuffer.push_back(pixel.y);
-            flatFramebuffer.push_back(pixel.z);
+    // Progressive rendering: add a few samples per frame until maxSamples, then idle.
+    // When the camera moves the last image is reprojected instead of thrown away.
+    int samplesPerFrame = 2;
+    int maxSamples = 256;
+    TemporalSettings temporalSettings;
+
+    // Tracing runs on its own thread and hands finished passes over through a
+    // triple buffer, so input and window events never wait for a render
+    TripleBuffer frames;
+    std::atomic<bool> rendering(true);
+    std::thread renderThread([&]() {
+        while (rendering.load()) {
+            float time = static_cast<float>(glfwGetTime());
+            effectValue = sin(time) * 3.5f + 4.0f;
+            // tracer.renderFrame(time, effectValue, true, 16); // Apply depth of field (DOF)
+
+            //USE THIS FOR 1PX
+            // tracer.renderFrame(time, effectValue);
+
+            //USE THIS FOR MULTI
+            // tracer.renderFrame(time, effectValue, samplesPerPixel);  // Modified to handle supersampling
+
+            // Every progressive pass rewrites the whole slot
+            tracer.setPresentTarget(presenter.slot(frames.writeIndex()));
+            if (tracer.renderTemporal(time, effectValue, true, samplesPerFrame, maxSamples, temporalSettings)) {
+                frames.publish();
+                glfwPostEmptyEvent();  // Wake the window thread
+            } else {
+                // Converged, idle until something changes
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            }
         }
+    });
 
-        glBindTexture(GL_TEXTURE_2D, texture);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_FLOAT, flatFramebuffer.data());
+    glfwSwapInterval(1);  // Present at display rate
+    while (!glfwWindowShouldClose(window)) {
+        bool newFrame = frames.hasNewFrame();
+        if (newFrame) {
+            // The slot on screen goes back to the render thread, the GL must be done with it
+            presenter.waitIdle(frames.readIndex());
+            frames.acquire();
+            presenter.upload(frames.readIndex());
+        }
 
         glClear(GL_COLOR_BUFFER_BIT);
         glUseProgram(shaderProgram);
         glBindVertexArray(VAO);
-        glBindTexture(GL_TEXTURE_2D, texture);
+        glBindTexture(GL_TEXTURE_2D, presenter.texture());
         glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 
         glfwSwapBuffers(window);
-        glfwPollEvents();
+        if (newFrame) {
+            glfwPollEvents();
+        } else {
+            // Nothing new to show, sleep until an event or the next frame arrives
+            glfwWaitEventsTimeout(0.1);
+        }
     }
 
+    rendering = false;
+    renderThread.join();
+
     glDeleteVertexArrays(1, &VAO);
     glDeleteBuffers(1, &VBO);
     glDeleteProgram(shaderProgram);
-    glDeleteTextures(1, &texture);
+    tracer.setPresentTarget(nullptr);
+    presenter.release();
 
     glfwDestroyWindow(window);
     glfwTerminate();
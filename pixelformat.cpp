@@ -0,0 +1,309 @@
+#include "pixelformat.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "simd.hpp"
+
+using namespace simd;
+
+namespace {
+
+constexpr int kBlock = kWidth;         // Pixels per resolve step, one per SIMD lane
+constexpr float kMax9E5 = 65408.0f;    // Largest RGB9E5 value, 511 / 512 * 2^16
+constexpr int kSrgbTableSize = 4096;   // Indexed by the square root of the linear value
+
+float fromBits(uint32_t bits) {
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+uint32_t toBits(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+float srgbEncode(float c) {
+    return c <= 0.0031308f ? 12.92f * c : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+}
+
+float srgbDecode(float c) {
+    return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+// Square root spacing puts most entries in the dark range where the curve is
+// steep; neighbouring entries are never more than a fraction of a code apart
+const uint8_t* srgbTable() {
+    static const std::vector<uint8_t> table = [] {
+        std::vector<uint8_t> t(kSrgbTableSize);
+        for (int i = 0; i < kSrgbTableSize; ++i) {
+            float s = static_cast<float>(i) / (kSrgbTableSize - 1);
+            t[i] = static_cast<uint8_t>(srgbEncode(s * s) * 255.0f + 0.5f);
+        }
+        return t;
+    }();
+    return table.data();
+}
+
+#if !(RAYTRACER_SIMD && defined(__F16C__))
+// IEEE half, round to nearest even, overflow goes to infinity. Only needed
+// where F16C doesn't convert.
+uint16_t floatToHalf(float value) {
+    uint32_t bits = toBits(value);
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t abs = bits & 0x7FFFFFFF;
+    if (abs >= 0x7F800000) return static_cast<uint16_t>(sign | 0x7C00 | (abs > 0x7F800000 ? 0x200 : 0));
+    if (abs >= 0x477FF000) return static_cast<uint16_t>(sign | 0x7C00);  // Rounds past 65504
+    if (abs < 0x38800000) {
+        // Below the smallest normal half, 2^-14: denormal or zero
+        if (abs < 0x33000000) return static_cast<uint16_t>(sign);
+        uint32_t shift = 126 - (abs >> 23);
+        uint32_t mantissa = (abs & 0x7FFFFF) | 0x800000;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) ++half;
+        return static_cast<uint16_t>(sign | half);
+    }
+    uint32_t half = (abs - 0x38000000) >> 13;  // Exponent bias 127 -> 15
+    uint32_t rest = abs & 0x1FFF;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) ++half;
+    return static_cast<uint16_t>(sign | half);
+}
+#endif
+
+float halfToFloat(uint16_t half) {
+    uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1F, mantissa = half & 0x3FF;
+    if (exponent == 0) {
+        float value = std::ldexp(static_cast<float>(mantissa), -24);
+        return sign ? -value : value;
+    }
+    if (exponent == 31) return fromBits(sign | 0x7F800000 | (mantissa << 13));
+    return fromBits(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
+
+// Shared exponent from the step size denom = 2^(exponent - 15 - 9)
+uint32_t pack9E5(float rq, float gq, float bq, float denom) {
+    uint32_t exponent = ((toBits(denom) >> 23) & 0xFF) - 103;
+    return static_cast<uint32_t>(rq) | static_cast<uint32_t>(gq) << 9 | static_cast<uint32_t>(bq) << 18 | exponent << 27;
+}
+
+#if RAYTRACER_SIMD
+
+// Averages n pixels into lanes r, g, b. Lanes past n are zero.
+void average(const Vec3* sums, const int* counts, int n, float* r, float* g, float* b) {
+    alignas(32) float c[kBlock] = {};
+    for (int l = 0; l < n; ++l) {
+        r[l] = sums[l].x;
+        g[l] = sums[l].y;
+        b[l] = sums[l].z;
+        c[l] = static_cast<float>(counts[l]);
+    }
+    for (int l = n; l < kBlock; ++l) r[l] = g[l] = b[l] = 0.0f;
+
+    // Divides like Vec3::operator/, so RGB32F matches the old per-pixel average exactly
+    const vfloat zero = vset1(0.0f);
+    vfloat count = vload(c);
+    vfloat valid = vlt(zero, count);
+    vfloat safe = vselect(valid, count, vset1(1.0f));
+    vstore(r, vand(vdiv(vload(r), safe), valid));
+    vstore(g, vand(vdiv(vload(g), safe), valid));
+    vstore(b, vand(vdiv(vload(b), safe), valid));
+}
+
+// Rounded mantissas (plus 0.5, truncate to round) and the step size per lane
+void quantize9E5(float* r, float* g, float* b, float* denom) {
+    const vfloat zero = vset1(0.0f), maxValue = vset1(kMax9E5), half = vset1(0.5f);
+    vfloat vr = vmin(vmax(vload(r), zero), maxValue);  // NaN ends up as 0
+    vfloat vg = vmin(vmax(vload(g), zero), maxValue);
+    vfloat vb = vmin(vmax(vload(b), zero), maxValue);
+    vfloat maxc = vmax(vr, vmax(vg, vb));
+
+    // 2^floor(log2(maxc)) by masking the exponent bits, at least 2^-16
+    vfloat pow2 = vmax(vand(maxc, vset1(fromBits(0x7F800000))), vset1(fromBits(0x37800000)));
+    vfloat step = vmul(pow2, vset1(1.0f / 256.0f));
+    // The largest channel would round up to 512, go one exponent up
+    step = vselect(vge(vdiv(maxc, step), vset1(511.5f)), vadd(step, step), step);
+
+    vstore(r, vadd(vdiv(vr, step), half));
+    vstore(g, vadd(vdiv(vg, step), half));
+    vstore(b, vadd(vdiv(vb, step), half));
+    vstore(denom, step);
+}
+
+// Lookup indices into srgbTable, plus 0.5 to round when truncated
+void srgbIndices(float* r, float* g, float* b) {
+    const vfloat zero = vset1(0.0f), one = vset1(1.0f);
+    const vfloat scale = vset1(kSrgbTableSize - 1), half = vset1(0.5f);
+    vstore(r, vadd(vmul(vsqrt(vmin(vmax(vload(r), zero), one)), scale), half));
+    vstore(g, vadd(vmul(vsqrt(vmin(vmax(vload(g), zero), one)), scale), half));
+    vstore(b, vadd(vmul(vsqrt(vmin(vmax(vload(b), zero), one)), scale), half));
+}
+
+#else
+
+void average(const Vec3* sums, const int* counts, int n, float* r, float* g, float* b) {
+    for (int l = 0; l < n; ++l) {
+        Vec3 c = counts[l] > 0 ? sums[l] / static_cast<float>(counts[l]) : Vec3();
+        r[l] = c.x;
+        g[l] = c.y;
+        b[l] = c.z;
+    }
+}
+
+void quantize9E5(float* r, float* g, float* b, float* denom) {
+    for (int l = 0; l < kBlock; ++l) {
+        float cr = std::min(r[l] > 0.0f ? r[l] : 0.0f, kMax9E5);
+        float cg = std::min(g[l] > 0.0f ? g[l] : 0.0f, kMax9E5);
+        float cb = std::min(b[l] > 0.0f ? b[l] : 0.0f, kMax9E5);
+        float maxc = std::max(cr, std::max(cg, cb));
+        float step = std::max(fromBits(toBits(maxc) & 0x7F800000), fromBits(0x37800000)) / 256.0f;
+        if (maxc / step >= 511.5f) step += step;
+        r[l] = cr / step + 0.5f;
+        g[l] = cg / step + 0.5f;
+        b[l] = cb / step + 0.5f;
+        denom[l] = step;
+    }
+}
+
+void srgbIndices(float* r, float* g, float* b) {
+    // Written so NaN ends up as 0 like with vmax
+    auto index = [](float c) { return std::sqrt(std::min(c > 0.0f ? c : 0.0f, 1.0f)) * (kSrgbTableSize - 1) + 0.5f; };
+    for (int l = 0; l < kBlock; ++l) {
+        r[l] = index(r[l]);
+        g[l] = index(g[l]);
+        b[l] = index(b[l]);
+    }
+}
+
+#endif
+
+void toHalves(const float* values, uint16_t* halves) {
+#if RAYTRACER_SIMD && defined(__F16C__) && defined(__AVX__)
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(halves), _mm256_cvtps_ph(vload(values), _MM_FROUND_TO_NEAREST_INT));
+#elif RAYTRACER_SIMD && defined(__F16C__)
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(halves), _mm_cvtps_ph(vload(values), _MM_FROUND_TO_NEAREST_INT));
+#else
+    for (int l = 0; l < kBlock; ++l) halves[l] = floatToHalf(values[l]);
+#endif
+}
+
+}  // namespace
+
+size_t bytesPerPixel(PixelFormat format) {
+    switch (format) {
+    case PixelFormat::RGB32F: return 3 * sizeof(float);
+    case PixelFormat::RGBA16F: return 4 * sizeof(uint16_t);
+    case PixelFormat::RGB9E5: return sizeof(uint32_t);
+    case PixelFormat::SRGB8: return 4;
+    }
+    return 0;
+}
+
+const char* pixelFormatName(PixelFormat format) {
+    switch (format) {
+    case PixelFormat::RGB32F: return "rgb32f";
+    case PixelFormat::RGBA16F: return "rgba16f";
+    case PixelFormat::RGB9E5: return "rgb9e5";
+    case PixelFormat::SRGB8: return "srgb8";
+    }
+    return "unknown";
+}
+
+bool parsePixelFormat(const char* text, PixelFormat& format) {
+    for (PixelFormat f : {PixelFormat::RGB32F, PixelFormat::RGBA16F, PixelFormat::RGB9E5, PixelFormat::SRGB8}) {
+        if (std::strcmp(text, pixelFormatName(f)) == 0) {
+            format = f;
+            return true;
+        }
+    }
+    return false;
+}
+
+void resolvePixels(PixelFormat format, const Vec3* sums, const int* counts, int count, void* out) {
+    unsigned char* bytes = static_cast<unsigned char*>(out);
+    const uint8_t* table = format == PixelFormat::SRGB8 ? srgbTable() : nullptr;
+    alignas(32) float r[kBlock], g[kBlock], b[kBlock], denom[kBlock];
+    alignas(16) uint16_t hr[kBlock], hg[kBlock], hb[kBlock];
+
+    for (int first = 0; first < count; first += kBlock) {
+        int n = std::min(kBlock, count - first);
+        average(sums + first, counts + first, n, r, g, b);
+
+        switch (format) {
+        case PixelFormat::RGB32F: {
+            float* p = reinterpret_cast<float*>(bytes) + 3 * first;
+            for (int l = 0; l < n; ++l) {
+                p[3 * l + 0] = r[l];
+                p[3 * l + 1] = g[l];
+                p[3 * l + 2] = b[l];
+            }
+            break;
+        }
+        case PixelFormat::RGBA16F: {
+            toHalves(r, hr);
+            toHalves(g, hg);
+            toHalves(b, hb);
+            uint16_t* p = reinterpret_cast<uint16_t*>(bytes) + 4 * first;
+            for (int l = 0; l < n; ++l) {
+                p[4 * l + 0] = hr[l];
+                p[4 * l + 1] = hg[l];
+                p[4 * l + 2] = hb[l];
+                p[4 * l + 3] = 0x3C00;  // 1.0
+            }
+            break;
+        }
+        case PixelFormat::RGB9E5: {
+            quantize9E5(r, g, b, denom);
+            uint32_t* p = reinterpret_cast<uint32_t*>(bytes) + first;
+            for (int l = 0; l < n; ++l) p[l] = pack9E5(r[l], g[l], b[l], denom[l]);
+            break;
+        }
+        case PixelFormat::SRGB8: {
+            srgbIndices(r, g, b);
+            uint8_t* p = bytes + 4 * first;
+            for (int l = 0; l < n; ++l) {
+                p[4 * l + 0] = table[static_cast<int>(r[l])];
+                p[4 * l + 1] = table[static_cast<int>(g[l])];
+                p[4 * l + 2] = table[static_cast<int>(b[l])];
+                p[4 * l + 3] = 255;
+            }
+            break;
+        }
+        }
+    }
+}
+
+void decodePixels(PixelFormat format, const void* in, int count, Vec3* out) {
+    switch (format) {
+    case PixelFormat::RGB32F:
+        std::memcpy(out, in, static_cast<size_t>(count) * sizeof(Vec3));
+        break;
+    case PixelFormat::RGBA16F: {
+        const uint16_t* p = static_cast<const uint16_t*>(in);
+        for (int i = 0; i < count; ++i) {
+            out[i] = Vec3(halfToFloat(p[4 * i]), halfToFloat(p[4 * i + 1]), halfToFloat(p[4 * i + 2]));
+        }
+        break;
+    }
+    case PixelFormat::RGB9E5: {
+        const uint32_t* p = static_cast<const uint32_t*>(in);
+        for (int i = 0; i < count; ++i) {
+            float scale = std::ldexp(1.0f, static_cast<int>(p[i] >> 27) - 24);
+            out[i] = Vec3((p[i] & 0x1FF) * scale, ((p[i] >> 9) & 0x1FF) * scale, ((p[i] >> 18) & 0x1FF) * scale);
+        }
+        break;
+    }
+    case PixelFormat::SRGB8: {
+        const uint8_t* p = static_cast<const uint8_t*>(in);
+        for (int i = 0; i < count; ++i) {
+            out[i] = Vec3(srgbDecode(p[4 * i] / 255.0f), srgbDecode(p[4 * i + 1] / 255.0f),
+                          srgbDecode(p[4 * i + 2] / 255.0f));
+        }
+        break;
+    }
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef PIXELFORMAT_HPP
+#define PIXELFORMAT_HPP
+
+#include <cstddef>
+#include "utilities.hpp"
+
+// Storage formats for the tracer's output image (RayTracer::pixelFormat). The
+// accumulation stays float; a resolve pass averages it into one of these, so
+// the smaller formats cut the memory written per pass and the viewer's upload.
+enum class PixelFormat {
+    RGB32F,   // 12 bytes, float RGB as traced
+    RGBA16F,  // 8 bytes, half float RGBA with alpha 1
+    RGB9E5,   // 4 bytes, 9-bit mantissas sharing a 5-bit exponent, like GL_RGB9_E5
+    SRGB8,    // 4 bytes, clamped to [0, 1] and sRGB encoded, RGBA8 with alpha 255
+};
+
+size_t bytesPerPixel(PixelFormat format);
+const char* pixelFormatName(PixelFormat format);
+// Parses the names returned by pixelFormatName, false if unknown
+bool parsePixelFormat(const char* text, PixelFormat& format);
+
+// Stores sums[i] / counts[i] for count pixels in format at out, pixels without
+// samples come out black. Works on SIMD width pixels at a time.
+void resolvePixels(PixelFormat format, const Vec3* sums, const int* counts, int count, void* out);
+
+// Back to linear float RGB, for writing files and comparing formats
+void decodePixels(PixelFormat format, const void* in, int count, Vec3* out);
+
+#endif
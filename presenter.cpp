@@ -0,0 +1,97 @@
+#include "presenter.hpp"
+#include <iostream>
+
+FramePresenter::~FramePresenter() {
+    release();
+}
+
+void FramePresenter::release() {
+    for (int i = 0; i < kSlots; ++i) {
+        if (fences[i]) glDeleteSync(fences[i]);
+        fences[i] = nullptr;
+        if (buffers[i]) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[i]);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            glDeleteBuffers(1, &buffers[i]);
+            buffers[i] = 0;
+        }
+        clientSlots[i] = std::vector<uint8_t>();
+        slots[i] = nullptr;
+    }
+    if (textureId) glDeleteTextures(1, &textureId);
+    textureId = 0;
+}
+
+bool FramePresenter::init(int w, int h, PixelFormat pixelFormat) {
+    release();
+    width = w;
+    height = h;
+    format = pixelFormat;
+    slotSize = static_cast<GLsizeiptr>(width) * height * bytesPerPixel(format);
+    persistent = GLAD_GL_VERSION_4_4 != 0;
+
+    // Same layout as the tracer's pixels, so the upload is a plain copy with no conversion.
+    // sRGB texels are decoded to linear when sampled, like the float formats.
+    GLint internalFormat = GL_RGB32F;
+    switch (format) {
+    case PixelFormat::RGB32F: internalFormat = GL_RGB32F; uploadFormat = GL_RGB; uploadType = GL_FLOAT; break;
+    case PixelFormat::RGBA16F: internalFormat = GL_RGBA16F; uploadFormat = GL_RGBA; uploadType = GL_HALF_FLOAT; break;
+    case PixelFormat::RGB9E5: internalFormat = GL_RGB9_E5; uploadFormat = GL_RGB; uploadType = GL_UNSIGNED_INT_5_9_9_9_REV; break;
+    case PixelFormat::SRGB8: internalFormat = GL_SRGB8_ALPHA8; uploadFormat = GL_RGBA; uploadType = GL_UNSIGNED_BYTE; break;
+    }
+    glGenTextures(1, &textureId);
+    glBindTexture(GL_TEXTURE_2D, textureId);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    std::vector<uint8_t> black(slotSize);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, uploadFormat, uploadType, black.data());
+
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    for (int i = 0; i < kSlots; ++i) {
+        if (!persistent) {
+            clientSlots[i].resize(slotSize);
+            slots[i] = clientSlots[i].data();
+            continue;
+        }
+        glGenBuffers(1, &buffers[i]);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[i]);
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, slotSize, nullptr, flags);
+        slots[i] = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, slotSize, flags);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        if (!slots[i]) {
+            std::cerr << "Failed to map pixel buffer " << i << std::endl;
+            return false;
+        }
+    }
+
+    GLenum error = glGetError();
+    if (error != GL_NO_ERROR) {
+        std::cerr << "Failed to create pixel buffers, GL error 0x" << std::hex << error << std::dec << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void FramePresenter::upload(int index) {
+    glBindTexture(GL_TEXTURE_2D, textureId);
+    if (persistent) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[index]);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, uploadFormat, uploadType, nullptr);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        if (fences[index]) glDeleteSync(fences[index]);
+        fences[index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    } else {
+        // Client memory is copied by the driver before the call returns
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, uploadFormat, uploadType, slots[index]);
+    }
+}
+
+void FramePresenter::waitIdle(int index) {
+    if (!fences[index]) return;
+    // Normally long signalled, the upload was issued at least a display frame ago
+    while (glClientWaitSync(fences[index], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
+    }
+    glDeleteSync(fences[index]);
+    fences[index] = nullptr;
+}
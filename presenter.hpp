@@ -0,0 +1,56 @@
+#ifndef PRESENTER_HPP
+#define PRESENTER_HPP
+
+#include <vector>
+#include <glad/glad.h>
+#include "utilities.hpp"
+#include "pixelformat.hpp"
+
+// Streams tracer frames into a texture through three upload slots, one per
+// TripleBuffer index. On GL 4.4+ the slots are persistently mapped pixel-unpack
+// buffers: the tracer writes straight into them (RayTracer::setPresentTarget),
+// from any thread, and glTexSubImage2D sources them on the GL side, so a frame
+// costs no allocation and no extra copy. Older GL gets plain memory slots that
+// are uploaded from client memory. Slots hold pixels in the tracer's
+// pixelFormat and the texture is created to match, so the smaller formats also
+// shrink the upload.
+class FramePresenter {
+public:
+    static const int kSlots = 3;
+
+    FramePresenter() = default;
+    ~FramePresenter();
+
+    FramePresenter(const FramePresenter&) = delete;
+    FramePresenter& operator=(const FramePresenter&) = delete;
+
+    // Needs a current GL context. Returns false on GL errors.
+    bool init(int width, int height, PixelFormat format = PixelFormat::RGB32F);
+    // Frees the GL objects, call while the context is still current
+    void release();
+
+    // width * height pixels laid out like the framebuffer, valid until release()
+    void* slot(int index) const { return slots[index]; }
+    // Uploads a slot into texture(). GL thread only.
+    void upload(int index);
+    // Blocks until the GL is done reading the slot's last upload, call before
+    // handing the slot back to the writer. GL thread only.
+    void waitIdle(int index);
+
+    GLuint texture() const { return textureId; }
+    bool isPersistent() const { return persistent; }
+
+private:
+    int width = 0, height = 0;
+    PixelFormat format = PixelFormat::RGB32F;
+    GLenum uploadFormat = GL_RGB, uploadType = GL_FLOAT;  // Client layout of format
+    bool persistent = false;
+    GLsizeiptr slotSize = 0;
+    GLuint textureId = 0;
+    GLuint buffers[kSlots] = {};
+    GLsync fences[kSlots] = {};
+    void* slots[kSlots] = {};
+    std::vector<uint8_t> clientSlots[kSlots];  // Without persistent mapping
+};
+
+#endif
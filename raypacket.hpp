@@ -0,0 +1,67 @@
+#ifndef RAYPACKET_HPP
+#define RAYPACKET_HPP
+
+#include <cstdint>
+#include <limits>
+#include "utilities.hpp"
+
+// Up to kMaxSize coherent rays traced together. Stored as arrays per
+// component so box and sphere tests run across the rays of the packet.
+struct RayPacket {
+    static constexpr int kMaxSize = 16;
+
+    int size = 0;
+    alignas(32) float ox[kMaxSize] = {}, oy[kMaxSize] = {}, oz[kMaxSize] = {};
+    alignas(32) float dx[kMaxSize] = {}, dy[kMaxSize] = {}, dz[kMaxSize] = {};
+    alignas(32) float invDx[kMaxSize] = {}, invDy[kMaxSize] = {}, invDz[kMaxSize] = {};
+    alignas(32) float dirDot[kMaxSize] = {};  // d.d, the quadratic's a term
+    alignas(32) float invDirDot[kMaxSize] = {};  // 1 / d.d, roots are scaled by it as in intersectClosest
+    alignas(32) float time[kMaxSize] = {};    // Shutter time per ray
+    alignas(32) float tClosest[kMaxSize] = {};
+    int hit[kMaxSize] = {};                    // Sphere index per ray, -1 for none
+
+    void clear() { size = 0; }
+
+    void add(const Ray& ray, float tMax = std::numeric_limits<float>::max()) {
+        int i = size++;
+        ox[i] = ray.origin.x;
+        oy[i] = ray.origin.y;
+        oz[i] = ray.origin.z;
+        dx[i] = ray.direction.x;
+        dy[i] = ray.direction.y;
+        dz[i] = ray.direction.z;
+        invDx[i] = 1.0f / ray.direction.x;
+        invDy[i] = 1.0f / ray.direction.y;
+        invDz[i] = 1.0f / ray.direction.z;
+        dirDot[i] = ray.direction.dot(ray.direction);
+        invDirDot[i] = 1.0f / dirDot[i];
+        time[i] = ray.time;
+        tClosest[i] = tMax;
+        hit[i] = -1;
+    }
+
+    Ray ray(int i) const { return Ray(Vec3(ox[i], oy[i], oz[i]), Vec3(dx[i], dy[i], dz[i]), time[i]); }
+    uint32_t fullMask() const { return (1u << size) - 1; }
+};
+
+// How well packets held together, summed over a frame
+struct alignas(64) PacketStats {
+    uint64_t packets = 0;
+    uint64_t nodeVisits = 0;   // BVH nodes visited by a packet
+    uint64_t activeRays = 0;   // Rays still active, summed over those visits
+    uint64_t raySlots = 0;     // Packet size, summed over those visits
+    uint64_t singleRays = 0;   // Rays finished on their own after the packet diverged
+
+    // Fraction of packet lanes doing useful work, 1.0 = perfectly coherent
+    double utilization() const { return raySlots ? static_cast<double>(activeRays) / raySlots : 0.0; }
+
+    void add(const PacketStats& other) {
+        packets += other.packets;
+        nodeVisits += other.nodeVisits;
+        activeRays += other.activeRays;
+        raySlots += other.raySlots;
+        singleRays += other.singleRays;
+    }
+};
+
+#endif
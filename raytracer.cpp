@@ -1,6 +1,8 @@
 #include "raytracer.hpp"
-#include <cstdlib>
+#include <algorithm>
+#include <cstring>
 #include <limits>
+#include <utility>
 
 
 // void RayTracer::setupScene() {
@@ -20,24 +22,25 @@
 // }
 
 void RayTracer::setupScene() {
-    spheres.clear();
+    clearSpheres();
     lights.clear();
 
     // Adding Spheres (Three spheres only)
     // Sphere in focus (centered at z=-2.0f)
-    spheres.emplace_back(Sphere(Vec3(0.0f, 0.0f, -2.0f), 0.5f, Vec3(1.0f, 0.0f, 0.0f))); // Red sphere
+    addSphere(Sphere(Vec3(0.0f, 0.0f, -2.0f), 0.5f), addMaterial(Vec3(1.0f, 0.0f, 0.0f))); // Red sphere
 
     // Sphere in front (blurry, z=-1.0f, closer to camera)
-    spheres.emplace_back(Sphere(Vec3(0.6f, 0.0f, -1.0f), 0.5f, Vec3(0.0f, 1.0f, 0.0f))); // Green sphere (slightly more blur)
+    addSphere(Sphere(Vec3(0.6f, 0.0f, -1.0f), 0.5f), addMaterial(Vec3(0.0f, 1.0f, 0.0f))); // Green sphere (slightly more blur)
 
     // Sphere behind (blurry, z=-3.0f, slightly smaller, positioned slightly left and slightly above)
-    spheres.emplace_back(Sphere(Vec3(-0.35f, -0.05f, -3.0f), 0.4f, Vec3(0.0f, 0.0f, 1.0f))); // Blue sphere (strong blur)
+    // Moving sideways, smeared over the shutter interval as well
+    addSphere(Sphere(Vec3(-0.35f, -0.05f, -3.0f), 0.4f), addMaterial(Vec3(0.0f, 0.0f, 1.0f)), Vec3(6.0f, 0.0f, 0.0f)); // Blue sphere (strong blur)
 
     // Adding Ground (distant ground plane for context)
-    spheres.emplace_back(Sphere(Vec3(0.0f, -100.5f, -2.0f), 100.0f, Vec3(0.5f, 0.5f, 0.5f))); // Ground plane
+    addSphere(Sphere(Vec3(0.0f, -100.5f, -2.0f), 100.0f), addMaterial(Vec3(0.5f, 0.5f, 0.5f))); // Ground plane
 
     // Adding Light (basic light source)
-    lights.emplace_back(Light(Vec3(0.0f, 3.0f, -1.0f), 1.0f)); // Light source
+    lights.push_back(sphereLight(Vec3(0.0f, 3.0f, -1.0f), 0.1f, 1.0f)); // Light source, small sphere for soft shadows
 
     // Configuring Camera
     camera.setCamera(
@@ -48,10 +51,74 @@ void RayTracer::setupScene() {
         0.0f,                    // Aperture (increase to enhance blur)
         0.0f                     // Focus distance 
     );
+
+    commitScene();
+}
+
+void RayTracer::clearSpheres() {
+    spheres.clear();
+    sphereMaterials.clear();
+    materials.clear();
+    sphereVelocities.clear();
+}
+
+uint32_t RayTracer::addMaterial(const Material& material) {
+    materials.push_back(material);
+    return static_cast<uint32_t>(materials.size() - 1);
+}
+
+int RayTracer::addSphere(const Sphere& sphere, uint32_t material, const Vec3& velocity) {
+    bool moves = velocity.x != 0.0f || velocity.y != 0.0f || velocity.z != 0.0f;
+    if (moves && sphereVelocities.empty()) sphereVelocities.assign(spheres.size(), Vec3());
+    spheres.push_back(sphere);
+    sphereMaterials.push_back(material);
+    if (!sphereVelocities.empty()) sphereVelocities.push_back(velocity);
+    return static_cast<int>(spheres.size() - 1);
+}
+
+Vec3 RayTracer::sphereCenter(int index, float time) const {
+    if (sphereVelocities.empty()) return spheres[index].center;
+    return spheres[index].center + sphereVelocities[index] * time;
+}
+
+SceneMemory RayTracer::memoryUsage() const {
+    SceneMemory memory;
+    memory.geometry = spheres.capacity() * sizeof(Sphere);
+    memory.materials = sphereMaterials.capacity() * sizeof(uint32_t) + materials.capacity() * sizeof(Material);
+    memory.motion = sphereVelocities.capacity() * sizeof(Vec3);
+    memory.bvh = bvh.memoryBytes();
+    return memory;
+}
+
+void RayTracer::commitScene() {
+    // Spheres pushed without addSphere get the first material and no motion
+    if (materials.empty()) materials.emplace_back(Vec3(0.5f, 0.5f, 0.5f));
+    sphereMaterials.resize(spheres.size(), 0);
+    if (!sphereVelocities.empty()) sphereVelocities.resize(spheres.size(), Vec3());
+    bvh.build(spheres, sphereVelocities, shutter);
+    ++sceneVersion;
+    prepareLights();
+}
+
+void RayTracer::commitScene(BVH&& prebuilt) {
+    bvh = std::move(prebuilt);
+    ++sceneVersion;
+    prepareLights();
+}
+
+void RayTracer::prepareLights() {
+    if (preparedLights == lights) return;
+    preparedLights = lights;
+
+    std::vector<float> power(lights.size());
+    for (size_t i = 0; i < lights.size(); ++i) power[i] = lights[i].intensity;
+    lightTable.build(power);
+    lightTree.build(lights);
 }
 
 
 bool RayTracer::intersectPlane(const Ray& ray, Vec3& hitPoint, Vec3& normal) const {
+    if (RenderCounters* counters = threadCounters()) ++counters->planeTests;
     float denom = planeNormal.dot(ray.direction);
     if (fabs(denom) > 1e-6) {  // Avoid division by zero
         float t = (planePoint - ray.origin).dot(planeNormal) / denom;
@@ -64,44 +131,574 @@ bool RayTracer::intersectPlane(const Ray& ray, Vec3& hitPoint, Vec3& normal) con
     return false;
 }
 
+void RayTracer::setThreadCount(int count) {
+    threadCount = count;
+    pool.reset();
+}
+
 void RayTracer::renderFrame(float timeDelta, float effectValue, bool useDOF, int samplesPerPixel) {
+    accumulatedSamples = 0;
+    accumulationKey = 0;  // A one-shot frame never continues a progressive image
+    beginStats();
+    denoising = denoise;
+    renderSamples(useDOF, samplesPerPixel);
+    if (denoising) denoiseFrame();
+    ++frameIndex;
+}
+
+bool RayTracer::renderProgressive(float timeDelta, float effectValue, bool useDOF, int samplesPerFrame, int maxSamples) {
+    if (sceneOutdated()) commitScene();
+
+    uint64_t key = viewStateKey(useDOF);
+    if (key != accumulationKey) {
+        accumulationKey = key;
+        accumulatedSamples = 0;
+    }
+    if (accumulatedSamples >= maxSamples) return false;
+
+    beginStats();
+    denoising = denoise;
+    renderSamples(useDOF, std::min(samplesPerFrame, maxSamples - accumulatedSamples));
+    if (denoising) denoiseFrame();
+    return true;
+}
+
+bool RayTracer::renderTemporal(float timeDelta, float effectValue, bool useDOF, int samplesPerFrame, int maxSamples,
+                               const TemporalSettings& settings) {
+    if (sceneOutdated()) commitScene();
+
+    if (temporalKey == 0 || viewStateKey(useDOF) != accumulationKey) {
+        // New view, the last one's image becomes the history if only the camera moved
+        uint64_t sceneKey = viewStateKey(useDOF, false);
+        size_t pixelCount = static_cast<size_t>(width) * height;
+        reprojecting = sceneKey == temporalKey && settings.maxHistory > 0 && hitObjects.size() == pixelCount &&
+                       pixelSamples.size() == pixelCount;
+        if (reprojecting) {
+            historySum.swap(accumulation);
+            historySamples.swap(pixelSamples);
+            historyPositions.swap(hitPositions);
+            historyObjects.swap(hitObjects);
+            historyView = hitView;
+        }
+        ++frameIndex;  // New noise, or the history would repeat the fresh samples
+        accumulationKey = viewStateKey(useDOF);
+        accumulatedSamples = 0;
+        temporalKey = sceneKey;
+        temporalSettings = settings;
+        hitPositions.resize(pixelCount);
+        hitObjects.resize(pixelCount);
+        hitView = {cameraPosition, forward, right, cameraUp};
+    }
+    if (accumulatedSamples >= maxSamples) return false;
+
+    beginStats();
+    denoising = false;  // The history has no guides of its own
+    capturingHits = true;
+    renderSamples(useDOF, std::min(samplesPerFrame, maxSamples - accumulatedSamples));
+    capturingHits = false;
+    reprojecting = false;
+    return true;
+}
+
+void RayTracer::renderTiles(int firstTile, int endTile, float timeDelta, float effectValue, bool useDOF, int samplesPerPixel) {
+    accumulatedSamples = 0;
+    accumulationKey = 0;
+    beginStats();
+    denoising = false;
+    renderSamples(useDOF, samplesPerPixel, std::max(firstTile, 0), std::min(endTile, tileCount()));
+}
+
+int RayTracer::tileCount() const {
+    return ((width + tileSize - 1) / tileSize) * ((height + tileSize - 1) / tileSize);
+}
+
+void RayTracer::tileBounds(int tile, int& x0, int& y0, int& x1, int& y1) const {
+    int tilesX = (width + tileSize - 1) / tileSize;
+    x0 = (tile % tilesX) * tileSize;
+    y0 = (tile / tilesX) * tileSize;
+    x1 = std::min(x0 + tileSize, width);
+    y1 = std::min(y0 + tileSize, height);
+}
+
+void RayTracer::beginStats() {
+    stats.counters = RenderCounters();
+    stats.frameMs = 0.0;
+    stats.threads = pool ? pool->size() : 0;
+    stats.width = width;
+    stats.height = height;
+    stats.tileSize = tileSize;
+    stats.tilesX = (width + tileSize - 1) / tileSize;
+    stats.tilesY = (height + tileSize - 1) / tileSize;
+    stats.tileMs.assign(collectStats ? tileCount() : 0, 0.0f);
+}
+
+template <typename Body>
+void RayTracer::forEachTile(int firstTile, int endTile, Body body) {
+    if (!collectStats) {
+        pool->parallelFor(std::max(endTile - firstTile, 0), [&](int index, int worker) {
+            int x0, y0, x1, y1;
+            tileBounds(firstTile + index, x0, y0, x1, y1);
+            body(x0, y0, x1, y1, worker);
+        });
+        return;
+    }
+
+    workerCounters.assign(pool->size(), RenderCounters());
+    uint64_t start = statsClockNs();
+    pool->parallelFor(std::max(endTile - firstTile, 0), [&](int index, int worker) {
+        int tile = firstTile + index;
+        int x0, y0, x1, y1;
+        tileBounds(tile, x0, y0, x1, y1);
+        threadCounters() = &workerCounters[worker];
+        uint64_t tileStart = statsClockNs();
+        body(x0, y0, x1, y1, worker);
+        stats.tileMs[tile] += static_cast<float>((statsClockNs() - tileStart) * 1e-6);
+        threadCounters() = nullptr;
+    });
+    for (const RenderCounters& counters : workerCounters) stats.counters.add(counters);
+    stats.frameMs += (statsClockNs() - start) * 1e-6;
+    stats.threads = pool->size();
+}
+
+void RayTracer::renderSamples(bool useDOF, int sampleCount, int firstTile, int endTile) {
+    if (!pool) pool.reset(new ThreadPool(threadCount));
+    if (sceneOutdated()) commitScene();
+    prepareLights();  // Lights are often edited without a commit
+    size_t pixelCount = static_cast<size_t>(width) * height;
+    if (accumulation.size() != pixelCount) {
+        accumulation.assign(pixelCount, Vec3());
+        accumulationLumSq.assign(pixelCount, 0.0f);
+        pixelSamples.assign(pixelCount, 0);
+        accumulatedSamples = 0;
+    }
+    framebuffer.resize(pixelCount * bytesPerPixel(pixelFormat));
+    if (accumulatedSamples == 0) std::fill(pixelSamples.begin(), pixelSamples.end(), 0);
+    if (!capturingHits) temporalKey = 0;  // Nothing to reproject from after this pass
+    // The denoiser's guides are recorded like AOVs
+    AovMask guides = aovBit(Aov::Depth) | aovBit(Aov::Normal) | aovBit(Aov::Albedo) | kGuideSquares;
+    aovBuffers.reserve((aovs & kAllAovs) | (denoising ? guides : 0), pixelCount);
+    recordingAovs = aovBuffers.mask() != 0;
+
+    bool usePackets = packetSize == 4 || packetSize == 8 || packetSize == 16;
+    workerPacketStats.assign(pool->size(), PacketStats());
+
+    if (endTile < 0) endTile = tileCount();
+    bool firstPass = accumulatedSamples == 0;
+    forEachTile(firstTile, endTile, [&](int x0, int y0, int x1, int y1, int worker) {
+        if (capturingHits && firstPass) recordHits(x0, y0, x1, y1);
+        if (usePackets) {
+            renderTilePackets(x0, y0, x1, y1, useDOF, sampleCount, workerPacketStats[worker]);
+        } else {
+            renderTile(x0, y0, x1, y1, useDOF, sampleCount);
+        }
+    });
+
+    if (usePackets) {
+        packetStats = PacketStats();
+        for (const PacketStats& stats : workerPacketStats) packetStats.add(stats);
+    }
+    accumulatedSamples += sampleCount;
+}
+
+int64_t RayTracer::renderAdaptive(float timeDelta, float effectValue, bool useDOF, const AdaptiveSettings& settings) {
+    accumulatedSamples = 0;
+    accumulationKey = 0;
+    beginStats();
+    int minSamples = std::max(settings.minSamples, 2);  // Variance needs two samples
+    int maxSamples = std::max(settings.maxSamples, minSamples);
+    denoising = denoise;
+    renderSamples(useDOF, minSamples);
+
+    int pixelCount = width * height;
+    int64_t traced = static_cast<int64_t>(minSamples) * pixelCount;
+    int64_t budget = static_cast<int64_t>(settings.averageSamples * pixelCount) - traced;
+    std::vector<float> error(pixelCount);
+    std::vector<int> plan(pixelCount);
+
+    while (budget > 0) {
+        double errorSum = 0.0;
+        for (int i = 0; i < pixelCount; ++i) {
+            float e = pixelSamples[i] < maxSamples ? relativeError(i) : 0.0f;
+            error[i] = e > settings.threshold ? e : 0.0f;
+            errorSum += error[i];
+        }
+        if (errorSum <= 0.0) break;
+
+        // Hand out about one sample per pixel per round, proportional to the error,
+        // so the estimates get refreshed before the next share is decided
+        double share = std::min<int64_t>(budget, pixelCount) / errorSum;
+        int64_t planned = 0;
+        for (int i = 0; i < pixelCount; ++i) {
+            int n = static_cast<int>(error[i] * share + 0.5);
+            plan[i] = std::min(n, maxSamples - pixelSamples[i]);
+            planned += plan[i];
+        }
+        if (planned == 0) break;
+
+        forEachTile(0, tileCount(), [&](int x0, int y0, int x1, int y1, int) {
+            for (int y = y0; y < y1; ++y) {
+                for (int x = x0; x < x1; ++x) {
+                    if (plan[y * width + x] > 0) samplePixel(x, y, plan[y * width + x], useDOF);
+                }
+            }
+            resolveTile(x0, y0, x1, y1);
+        });
+        budget -= planned;
+        traced += planned;
+    }
+
+    if (denoising) denoiseFrame();
+    ++frameIndex;
+    return traced;
+}
+
+float RayTracer::relativeError(int index) const {
+    // Standard error of the mean luminance, relative to the mean. The offset keeps
+    // dark pixels from looking noisy just because their mean is near zero.
+    int n = pixelSamples[index];
+    if (n < 2) return std::numeric_limits<float>::max();
+    float mean = luminance(accumulation[index]) / n;
+    float variance = std::max(accumulationLumSq[index] / n - mean * mean, 0.0f) * n / (n - 1);
+    return std::sqrt(variance / n) / (mean + 0.05f);
+}
+
+uint64_t RayTracer::viewStateKey(bool useDOF, bool withCamera) const {
+    // FNV-1a over everything that changes what a sample sees, except time
+    uint64_t hash = 1469598103934665603ull;
+    auto mix = [&hash](const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+    };
+    if (withCamera) {
+        mix(&cameraPosition, sizeof(Vec3));
+        mix(&focusPoint, sizeof(Vec3));
+        mix(&upVector, sizeof(Vec3));
+        mix(&frameIndex, sizeof(frameIndex));
+    }
+    mix(&apertureSize, sizeof(float));
+    mix(&focusDistance, sizeof(float));
+    mix(&useDOF, sizeof(bool));
+    mix(&planePoint, sizeof(Vec3));
+    mix(&planeNormal, sizeof(Vec3));
+    mix(&planeColor, sizeof(Vec3));
+    mix(&seed, sizeof(seed));
+    mix(&sceneVersion, sizeof(sceneVersion));
+    for (const Light& light : lights) {
+        mix(&light.position, sizeof(Vec3));
+        mix(&light.intensity, sizeof(float));
+        mix(&light.shape, sizeof(LightShape));
+        mix(&light.radius, sizeof(float));
+        mix(&light.normal, sizeof(Vec3));
+        mix(&light.edgeU, sizeof(Vec3));
+        mix(&light.edgeV, sizeof(Vec3));
+        mix(&light.samples, sizeof(int));
+    }
+    mix(&shadowSamples, sizeof(shadowSamples));
+    mix(&lightSamples, sizeof(lightSamples));
+    mix(&lightSelection, sizeof(lightSelection));
+    return hash == 0 ? 1 : hash;
+}
+
+void RayTracer::renderTile(int x0, int y0, int x1, int y1, bool useDOF, int samplesPerPixel) {
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+            samplePixel(x, y, samplesPerPixel, useDOF);
+        }
+    }
+    resolveTile(x0, y0, x1, y1);
+}
+
+void RayTracer::samplePixel(int x, int y, int count, bool useDOF) {
+    int index = y * width + x;
+    int firstSample = pixelSamples[index];
+    Vec3 colorSum(0, 0, 0);
+    float lumSqSum = 0.0f;
+    RenderCounters* timed = collectTimings ? threadCounters() : nullptr;
+    PrimaryHit primary;
+    AovSum aovSum;
+    PrimaryHit* hit = recordingAovs ? &primary : nullptr;
+
+    for (int sample = firstSample; sample < firstSample + count; ++sample) {
+        Sampler sampler(samplerType, seed, frameIndex, x, y, index, sample, count);
+        Vec3 color;
+        if (timed) {
+            uint64_t start = statsClockNs();
+            Ray ray = cameraRay(x, y, useDOF, sampler);
+            uint64_t traceStart = statsClockNs();
+            color = trace(ray, sampler, hit);
+            timed->cameraNs += traceStart - start;
+            timed->traceNs += statsClockNs() - traceStart;
+        } else {
+            color = trace(cameraRay(x, y, useDOF, sampler), sampler, hit);
+        }
+        colorSum = colorSum + color;
+        lumSqSum += luminance(color) * luminance(color);
+        if (hit) aovSum.add(primary, aovBuffers.mask());
+    }
+    if (hit) aovBuffers.add(index, aovSum, pixelSamples[index] == 0);
+    addSamples(index, colorSum, lumSqSum, count);
+}
+
+void RayTracer::addSamples(int index, const Vec3& colorSum, float lumSqSum, int count) {
+    // Add to the running sums and average colors
+    bool first = pixelSamples[index] == 0;
+    accumulation[index] = first ? colorSum : accumulation[index] + colorSum;
+    accumulationLumSq[index] = first ? lumSqSum : accumulationLumSq[index] + lumSqSum;
+    pixelSamples[index] += count;
+}
+
+void RayTracer::denoiseFrame() {
+    size_t pixelCount = static_cast<size_t>(width) * height;
+    std::vector<Vec3> color(pixelCount), albedo(pixelCount), normal(pixelCount), guideVariance(pixelCount);
+    std::vector<float> depth(pixelCount), variance(pixelCount);
+    for (size_t i = 0; i < pixelCount; ++i) {
+        int samples = std::max(pixelSamples[i], 1);
+        float n = static_cast<float>(samples);
+        color[i] = accumulation[i] / n;
+        albedo[i] = aovBuffers.albedo(i);
+        normal[i] = aovBuffers.normal(i);
+        depth[i] = aovBuffers.depth(i);
+        // Variances of the means, a single sample says nothing so it counts as very noisy
+        float mean = luminance(color[i]);
+        variance[i] = samples > 1 ? std::max(accumulationLumSq[i] / n - mean * mean, 0.0f) / (n - 1.0f) : 1.0f;
+        guideVariance[i] = aovBuffers.guideVariance(i);
+    }
+    denoiseImage(color.data(), variance.data(), albedo.data(), normal.data(), depth.data(), guideVariance.data(), width,
+                 height, denoiseSettings, *pool, color.data());
+
+    // Stored like resolveTile does, each filtered pixel as one sample
+    std::vector<int> ones(width, 1);
+    size_t pixelBytes = bytesPerPixel(pixelFormat);
+    pool->parallelFor(height, [&](int y, int) {
+        size_t first = static_cast<size_t>(y) * width;
+        uint8_t* row = framebuffer.data() + first * pixelBytes;
+        resolvePixels(pixelFormat, &color[first], ones.data(), width, row);
+        if (presentTarget) std::memcpy(presentTarget + first * pixelBytes, row, width * pixelBytes);
+    });
+}
+
+void RayTracer::recordHits(int x0, int y0, int x1, int y1) {
+    // Through the pixel center from the lens center at mid-shutter: the same
+    // surface every pass, whatever the samples' jitter, lens and time
+    float aspectRatio = static_cast<float>(width) / height;
+    // Bookkeeping for the next view, not part of the render: its tests stay out of the stats
+    RenderCounters* counters = threadCounters();
+    threadCounters() = nullptr;
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+            float u = static_cast<float>(x) / width, v = static_cast<float>(y) / height;
+            Vec3 direction = (forward + right * ((u - 0.5f) * 2 * aspectRatio) + cameraUp * ((v - 0.5f) * 2)).normalize();
+            Ray ray(cameraPosition, direction, shutter * 0.5f);
+
+            float closest = std::numeric_limits<float>::max();
+            int object = bvh.closestHit(ray, closest);
+            Vec3 planeHit, planeNormal;
+            if (intersectPlane(ray, planeHit, planeNormal)) {
+                float planeDist = (planeHit - ray.origin).length();
+                if (planeDist < closest) {
+                    closest = planeDist;
+                    object = kPlaneObject;
+                }
+            }
+            // Sky keeps a far point along the ray, so it reprojects by direction
+            int index = y * width + x;
+            hitObjects[index] = object;
+            hitPositions[index] = ray.origin + ray.direction * (object == kSkyObject ? 1e6f : closest);
+        }
+    }
+    threadCounters() = counters;
+}
+
+void RayTracer::reprojectTile(int x0, int y0, int x1, int y1) {
+    const ViewBasis& view = historyView;
     float aspectRatio = static_cast<float>(width) / height;
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            Vec3 colorSum(0, 0, 0);
+
+    // This pass's own averages, the history is clamped to the range of its 3x3
+    // neighbourhood inside the tile so ghosts of blurred edges die out
+    int tileWidth = x1 - x0;
+    std::vector<Vec3> fresh(static_cast<size_t>(tileWidth) * (y1 - y0));
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+            int index = y * width + x;
+            fresh[(y - y0) * tileWidth + x - x0] = accumulation[index] / static_cast<float>(pixelSamples[index]);
+        }
+    }
+
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+            int index = y * width + x;
+            int object = hitObjects[index];
+            Vec3 offset = hitPositions[index] - view.position;
+            float depth = offset.dot(view.forward);
+            if (depth <= 0.0f) continue;
+
+            // Inverse of cameraRay for the previous camera, pixel centers at whole numbers
+            float px = (0.5f + offset.dot(view.right) / (depth * 2 * aspectRatio)) * width;
+            float py = (0.5f + offset.dot(view.up) / (depth * 2)) * height;
+            int ix = static_cast<int>(std::floor(px)), iy = static_cast<int>(std::floor(py));
+            float fx = px - ix, fy = py - iy;
+            float distance = offset.length();
+
+            // Bilinear over the neighbours that saw the same surface at about the same distance
+            Vec3 color(0, 0, 0);
+            float weight = 0.0f, samples = 0.0f;
+            for (int j = 0; j < 2; ++j) {
+                for (int i = 0; i < 2; ++i) {
+                    int tx = ix + i, ty = iy + j;
+                    if (tx < 0 || ty < 0 || tx >= width || ty >= height) continue;
+                    int tap = ty * width + tx;
+                    if (historyObjects[tap] != object || historySamples[tap] <= 0) continue;
+                    if (object != kSkyObject) {
+                        float previous = (historyPositions[tap] - view.position).length();
+                        if (std::fabs(previous - distance) > temporalSettings.depthTolerance * distance) continue;
+                    }
+                    float w = (i ? fx : 1.0f - fx) * (j ? fy : 1.0f - fy);
+                    color = color + historySum[tap] * (w / historySamples[tap]);
+                    samples += w * historySamples[tap];
+                    weight += w;
+                }
+            }
+            if (weight < 0.01f) continue;  // Disoccluded or a different surface
+
+            int count = std::min(static_cast<int>(samples / weight + 0.5f), temporalSettings.maxHistory);
+            if (count <= 0) continue;
+            Vec3 history = color / weight;
+            Vec3 low = fresh[(y - y0) * tileWidth + x - x0], high = low;
+            for (int ny = std::max(y - 1, y0); ny <= std::min(y + 1, y1 - 1); ++ny) {
+                for (int nx = std::max(x - 1, x0); nx <= std::min(x + 1, x1 - 1); ++nx) {
+                    const Vec3& c = fresh[(ny - y0) * tileWidth + nx - x0];
+                    low = Vec3(std::min(low.x, c.x), std::min(low.y, c.y), std::min(low.z, c.z));
+                    high = Vec3(std::max(high.x, c.x), std::max(high.y, c.y), std::max(high.z, c.z));
+                }
+            }
+            history = Vec3(std::min(std::max(history.x, low.x), high.x), std::min(std::max(history.y, low.y), high.y),
+                           std::min(std::max(history.z, low.z), high.z));
+            addSamples(index, history * static_cast<float>(count), luminance(history) * luminance(history) * count, count);
+        }
+    }
+}
+
+void RayTracer::resolveTile(int x0, int y0, int x1, int y1) {
+    if (reprojecting) reprojectTile(x0, y0, x1, y1);
+    if (denoising) return;
+    size_t pixelBytes = bytesPerPixel(pixelFormat);
+    for (int y = y0; y < y1; ++y) {
+        size_t first = static_cast<size_t>(y) * width + x0;
+        uint8_t* row = framebuffer.data() + first * pixelBytes;
+        resolvePixels(pixelFormat, &accumulation[first], &pixelSamples[first], x1 - x0, row);
+        if (presentTarget) std::memcpy(presentTarget + first * pixelBytes, row, (x1 - x0) * pixelBytes);
+    }
+}
+
+std::vector<Vec3> RayTracer::getFramebuffer() const {
+    size_t pixelCount = framebuffer.size() / bytesPerPixel(pixelFormat);
+    std::vector<Vec3> pixels(pixelCount);
+    decodePixels(pixelFormat, framebuffer.data(), static_cast<int>(pixelCount), pixels.data());
+    return pixels;
+}
+
+void RayTracer::renderTilePackets(int x0, int y0, int x1, int y1, bool useDOF, int samplesPerPixel, PacketStats& stats) {
+    // Square-ish pixel blocks: 2x2, 4x2 or 4x4
+    int blockW = packetSize >= 8 ? 4 : 2;
+    int blockH = packetSize >= 16 ? 4 : 2;
+
+    RayPacket packet;
+    std::vector<Sampler> samplers;
+    samplers.reserve(RayPacket::kMaxSize);
+    RenderCounters* timed = collectTimings ? threadCounters() : nullptr;
+    for (int by = y0; by < y1; by += blockH) {
+        for (int bx = x0; bx < x1; bx += blockW) {
+            int bx1 = std::min(bx + blockW, x1), by1 = std::min(by + blockH, y1);
+            Vec3 colorSum[RayPacket::kMaxSize];
+            float lumSqSum[RayPacket::kMaxSize] = {};
+            AovSum aovSum[RayPacket::kMaxSize];
 
             for (int sample = 0; sample < samplesPerPixel; ++sample) {
-                // Jittered sampling for anti-aliasing
-                float u = (x + (rand() / (float)RAND_MAX - 0.5f)) / width;
-                float v = (y + (rand() / (float)RAND_MAX - 0.5f)) / height;
-
-                // Transform u, v to viewport space
-                Vec3 origin(cameraPosition);
-                Vec3 direction = (forward + right * ((u - 0.5f) * 2 * aspectRatio) 
-                                            + cameraUp * ((v - 0.5f) * 2)).normalize();
-                Ray primaryRay(origin, direction);
-
-                // Apply DOF if enabled
-                if (useDOF) {
-                    Vec3 focalPoint = primaryRay.origin + primaryRay.direction * focusDistance;
-                    primaryRay = jitterApertureRay(origin, focalPoint);
+                // Each ray keeps its own sampler, so the image matches the single-ray path
+                packet.clear();
+                samplers.clear();
+                uint64_t start = timed ? statsClockNs() : 0;
+                for (int y = by; y < by1; ++y) {
+                    for (int x = bx; x < bx1; ++x) {
+                        int index = y * width + x;
+                        samplers.emplace_back(samplerType, seed, frameIndex, x, y, index, pixelSamples[index] + sample,
+                                              samplesPerPixel);
+                        packet.add(cameraRay(x, y, useDOF, samplers.back()));
+                    }
                 }
 
-                colorSum = colorSum + trace(primaryRay, timeDelta);
+                uint64_t traceStart = timed ? statsClockNs() : 0;
+                bvh.closestHitPacket(packet, stats);
+                for (int i = 0; i < packet.size; ++i) {
+                    PrimaryHit primary;
+                    Vec3 color = shade(packet.ray(i), packet.hit[i], packet.tClosest[i], samplers[i],
+                                       recordingAovs ? &primary : nullptr);
+                    colorSum[i] = colorSum[i] + color;
+                    lumSqSum[i] += luminance(color) * luminance(color);
+                    if (recordingAovs) aovSum[i].add(primary, aovBuffers.mask());
+                }
+                if (timed) {
+                    timed->cameraNs += traceStart - start;
+                    timed->traceNs += statsClockNs() - traceStart;
+                }
             }
 
-            // Average colors
-            framebuffer[y * width + x] = colorSum / samplesPerPixel;
+            int i = 0;
+            for (int y = by; y < by1; ++y) {
+                for (int x = bx; x < bx1; ++x) {
+                    if (recordingAovs) aovBuffers.add(y * width + x, aovSum[i], pixelSamples[y * width + x] == 0);
+                    addSamples(y * width + x, colorSum[i], lumSqSum[i], samplesPerPixel);
+                    ++i;
+                }
+            }
         }
     }
+    resolveTile(x0, y0, x1, y1);
 }
 
+Ray RayTracer::cameraRay(int x, int y, bool useDOF, Sampler& sampler) const {
+    float aspectRatio = static_cast<float>(width) / height;
+
+    // Jittered sampling for anti-aliasing
+    float jitterX, jitterY;
+    sampler.startDimension(kDimPixel);
+    sampler.get2D(jitterX, jitterY);
+    float u = (x + (jitterX - 0.5f)) / width;
+    float v = (y + (jitterY - 0.5f)) / height;
+
+    // Transform u, v to viewport space
+    Vec3 origin(cameraPosition);
+    Vec3 direction = (forward + right * ((u - 0.5f) * 2 * aspectRatio) 
+                                + cameraUp * ((v - 0.5f) * 2)).normalize();
+    Ray primaryRay(origin, direction);
+
+    // Apply DOF if enabled
+    if (useDOF) {
+        Vec3 focalPoint = primaryRay.origin + primaryRay.direction * focusDistance;
+        primaryRay = jitterApertureRay(origin, focalPoint, sampler);
+    }
+
+    // Motion blur: the ray sees the scene at a random moment while the shutter is open
+    if (shutter > 0.0f) {
+        sampler.startDimension(kDimMotion);
+        primaryRay.time = sampler.get1D() * shutter;
+    }
+    if (RenderCounters* counters = threadCounters()) ++counters->primaryRays;
+    return primaryRay;
+}
 
 
-Ray RayTracer::jitterApertureRay(const Vec3& origin, const Vec3& focusPoint) const {
+
+Ray RayTracer::jitterApertureRay(const Vec3& origin, const Vec3& focusPoint, Sampler& sampler) const {
     // Random point on a disk for the aperture
-    float r = apertureSize * sqrt((float)rand() / RAND_MAX);  // Random radius on disk
-    float theta = 2 * M_PI * ((float)rand() / RAND_MAX);  // Random angle
+    float lensU, lensV;
+    sampler.startDimension(kDimLens);
+    sampler.get2D(lensU, lensV);
+    float r = apertureSize * sqrt(lensU);  // Random radius on disk
+    float theta = 2 * M_PI * lensV;  // Random angle
 
     // Random offset based on aperture
     Vec3 apertureOffset(
@@ -179,20 +776,22 @@ void RayTracer::updateCameraBasis() {
 // }
 
 
-Vec3 RayTracer::trace(const Ray& ray, float timeDelta) const {
-    const Sphere* hitSphere = nullptr;
+Vec3 RayTracer::trace(const Ray& ray, Sampler& sampler, PrimaryHit* primary) const {
+    // Check intersection with spheres
     float closest = std::numeric_limits<float>::max();
+    int hitIndex = bvh.closestHit(ray, closest);
+    return shade(ray, hitIndex, closest, sampler, primary);
+}
+
+Vec3 RayTracer::shade(const Ray& ray, int hitIndex, float closest, Sampler& sampler,
+                      PrimaryHit* primary) const {
+    const Sphere* hitSphere = nullptr;
     Vec3 hitPoint, normal, planeHitPoint, planeNormal;
 
-    // Check intersection with spheres
-    for (const auto& sphere : spheres) {
-        float t = sphere.intersect(ray);
-        if (t > 0 && t < closest) {
-            closest = t;
-            hitSphere = &sphere;
-            hitPoint = ray.origin + ray.direction * t;
-            normal = (hitPoint - sphere.center).normalize();
-        }
+    if (hitIndex >= 0) {
+        hitSphere = &spheres[hitIndex];
+        hitPoint = ray.origin + ray.direction * closest;
+        normal = (hitPoint - sphereCenter(hitIndex, ray.time)).normalize();
     }
 
     // Check intersection with plane
@@ -207,67 +806,135 @@ Vec3 RayTracer::trace(const Ray& ray, float timeDelta) const {
     }
 
     // Determine color based on hit
+    RenderCounters* counters = threadCounters();
     if (closest < std::numeric_limits<float>::max()) {
         Vec3 viewDir = -ray.direction;
-        if (hitSphere) {
-            return computeLighting(hitPoint, normal, viewDir, timeDelta, hitSphere) * hitSphere->color;
-        } else {
-            return computeLighting(hitPoint, normal, viewDir, timeDelta, nullptr) * planeColor;
+        uint64_t start = 0;
+        if (counters) {
+            ++counters->hits;
+            if (collectTimings) start = statsClockNs();
+        }
+        Vec3 albedo = hitSphere ? sphereMaterial(hitIndex).color : planeColor;
+        Vec3 color = computeLighting(hitPoint, normal, viewDir, ray.time, hitSphere, sampler, primary) * albedo;
+        if (start) counters->lightingNs += statsClockNs() - start;
+        if (primary) {
+            primary->albedo = albedo;
+            primary->normal = normal;
+            primary->depth = closest;
+            primary->objectId = hitSphere ? hitIndex : kPlaneObject;
         }
+        return color;
     }
 
-    return Vec3(0.53f, 0.81f, 0.92f);  // Light sky blue background color
+    if (counters) ++counters->misses;
+    Vec3 sky(0.53f, 0.81f, 0.92f);  // Light sky blue background color
+    if (primary) *primary = {sky, Vec3(0, 0, 0), 0.0f, kSkyObject, Vec3(0, 0, 0), 1.0f};
+    return sky;
 }
 
 
-Vec3 RayTracer::computeLighting(const Vec3& point, const Vec3& normal, const Vec3& viewDir, float timeDelta, const Sphere* hitSphere) const {
-    Vec3 lighting(0.1f, 0.1f, 0.1f);  // Ambient light for dim shadow areas
-    for (const auto& light : lights) {
-        // Jitter light position for soft shadows
-        Vec3 lightPos = light.position + jitterLight();
+namespace {
 
-        Vec3 lightDir = (lightPos - point).normalize();
-        float intensity = light.intensity * std::max(0.0f, normal.dot(lightDir));
+// Last sphere that blocked each light, per thread. Neighbouring samples and
+// pixels usually hit the same blocker, so it's tested before the BVH walk.
+struct OccluderCache {
+    const RayTracer* tracer = nullptr;
+    uint64_t sceneVersion = 0;
+    std::vector<int> lastOccluder;  // Per light, -1 = none
+};
 
-        // Check for shadows
-        Ray shadowRay(point + normal * 1e-4f, lightDir); // Offset the origin to prevent self-intersection
-        bool shadowed = false;
-        for (const auto& sphere : spheres) {
-            if (&sphere != hitSphere && sphere.intersect(shadowRay) > 0) {
-                shadowed = true;
-                break;
-            }
-        }
+thread_local OccluderCache occluderCache;
 
-        // If shadowed, reduce intensity for a dim shadow effect
-        if (shadowed) {
-            lighting = lighting + Vec3(0.3f, 0.3f, 0.3f) * intensity;  // Adjust shadow intensity
-        } else {
-            lighting = lighting + Vec3(1, 1, 1) * intensity;  // Full intensity
-        }
+}  // namespace
+
+bool RayTracer::occluded(const Ray& ray, float maxDistance, int lightIndex, int skip) const {
+    if (RenderCounters* counters = threadCounters()) {
+        ++counters->shadowRays;
+        ++counters->planeTests;
     }
-    return lighting;
-}
+    // Ground plane, ray.direction is unit length so t is a distance
+    float denom = planeNormal.dot(ray.direction);
+    if (fabs(denom) > 1e-6) {
+        float t = (planePoint - ray.origin).dot(planeNormal) / denom;
+        if (t > 0 && t < maxDistance) return true;
+    }
+
+    if (lightIndex < 0) return bvh.anyHit(ray, maxDistance, skip);
 
+    OccluderCache& cache = occluderCache;
+    if (cache.tracer != this || cache.sceneVersion != sceneVersion) {
+        cache.tracer = this;
+        cache.sceneVersion = sceneVersion;
+        cache.lastOccluder.clear();
+    }
+    if (lightIndex >= static_cast<int>(cache.lastOccluder.size())) cache.lastOccluder.resize(lightIndex + 1, -1);
 
+    int& last = cache.lastOccluder[lightIndex];
+    if (last >= 0 && last != skip && last < bvh.size() && bvh.hitsSphere(ray, last, maxDistance)) return true;
 
-// Jitter function for motion blur
-Ray RayTracer::jitteredRay(const Ray& ray, float effectValue) const {
-    // Increased jitter values to simulate more motion blur
-    Vec3 jitterOffset(
-        ((float)rand() / RAND_MAX - 0.5f) * effectValue * 0.01f,  // Increased factor (0.05f) for more motion
-        ((float)rand() / RAND_MAX - 0.5f) * effectValue * 0.01f,
-        ((float)rand() / RAND_MAX - 0.5f) * effectValue * 0.01f
-    );
-    return Ray(ray.origin + jitterOffset, ray.direction);
+    int occluder = bvh.findOccluder(ray, maxDistance, skip);
+    if (occluder >= 0) last = occluder;
+    return occluder >= 0;
 }
 
-// Jitter function for soft shadow
-Vec3 RayTracer::jitterLight() const {
-    float jitterAmount = 0.2f;  // Adjust for softness
-    return Vec3(
-        ((float)rand() / RAND_MAX - 0.5f) * jitterAmount,
-        ((float)rand() / RAND_MAX - 0.5f) * jitterAmount,
-        ((float)rand() / RAND_MAX - 0.5f) * jitterAmount
-    );
+Vec3 RayTracer::computeLighting(const Vec3& point, const Vec3& normal, const Vec3& viewDir, float time, const Sphere* hitSphere, Sampler& sampler,
+                                PrimaryHit* primary) const {
+    Vec3 ambient(0.1f, 0.1f, 0.1f);  // Ambient light for dim shadow areas
+    Vec3 lighting = ambient;
+    float arriving = 0.0f, visible = 0.0f;  // Light intensity reaching the point, and the unblocked part
+
+    // Every light while there are few, otherwise lightSamples picks weighted by 1 / (lightSamples * pdf)
+    int lightCount = static_cast<int>(lights.size());
+    bool picking = lightSamples > 0 && lightCount > lightSamples && lightTree.size() == lightCount;
+    int lightRays = picking ? lightSamples : lightCount;
+    int skip = hitSphere ? static_cast<int>(hitSphere - spheres.data()) : -1;
+    Vec3 origin = point + normal * 1e-4f;  // Offset the origin to prevent self-intersection
+    for (int k = 0; k < lightRays; ++k) {
+        int i = k;
+        float weight = 1.0f;
+        if (picking) {
+            // The pick reads the fourth dimension of the k-th light's block, the point on the light the first two
+            sampler.startDimension(kDimLights + kDimsPerLight * static_cast<uint32_t>(k) + 3);
+            float u = sampler.get1D(), pdf = 0.0f;
+            i = lightSelection == LightSelection::Tree ? lightTree.sample(point, normal, u, pdf) : lightTable.sample(u, pdf);
+            if (i < 0) continue;
+            weight = 1.0f / (pdf * static_cast<float>(lightSamples));
+        }
+        const Light& light = lights[i];
+        AreaLightSampler area;
+        if (!area.setup(light, point)) continue;  // Behind a disk or quad
+
+        // Area lights spread their shadow rays over a stratified pattern on the
+        // light, shifted by one sampler point per camera sample
+        int rays = light.shape == LightShape::Point ? 1 : std::max(light.samples > 0 ? light.samples : shadowSamples, 1);
+        sampler.startDimension(kDimLights + kDimsPerLight * static_cast<uint32_t>(k));
+        float su, sv;
+        sampler.get2D(su, sv);
+        float share = weight * light.intensity / static_cast<float>(rays);
+        for (int r = 0; r < rays; ++r) {
+            float u, v;
+            stratifiedPoint(r, rays, su, sv, u, v);
+            LightSample sample = area.sample(u, v);
+            float intensity = share * sample.weight * std::max(0.0f, normal.dot(sample.direction));
+            if (intensity <= 0.0f) continue;  // Facing away, shadowed or not it adds nothing
+
+            // Check for shadows
+            Ray shadowRay(origin, sample.direction, time);
+            bool shadowed = occluded(shadowRay, sample.distance, i, skip);
+
+            // If shadowed, reduce intensity for a dim shadow effect
+            if (shadowed) {
+                lighting = lighting + Vec3(0.3f, 0.3f, 0.3f) * intensity;  // Adjust shadow intensity
+            } else {
+                lighting = lighting + Vec3(1, 1, 1) * intensity;  // Full intensity
+                visible += intensity;
+            }
+            arriving += intensity;
+        }
+    }
+    if (primary) {
+        primary->direct = lighting - ambient;
+        primary->visibility = arriving > 0.0f ? visible / arriving : 1.0f;
+    }
+    return lighting;
 }
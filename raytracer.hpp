@@ -4,6 +4,38 @@
 #include <vector>
 #include <memory>
 #include "utilities.hpp"
+#include "threadpool.hpp"
+#include "sampler.hpp"
+#include "bvh.hpp"
+#include "pixelformat.hpp"
+#include "renderstats.hpp"
+#include "denoiser.hpp"
+#include "aov.hpp"
+#include "lightsampler.hpp"
+
+// Budget and stopping rule for renderAdaptive
+struct AdaptiveSettings {
+    int minSamples = 4;           // Uniform samples every pixel gets first, at least 2
+    int maxSamples = 64;          // No pixel gets more than this
+    float averageSamples = 8.0f;  // Total budget, in samples per pixel of the whole image
+    float threshold = 0.01f;      // Relative standard error below which a pixel is converged
+};
+
+// Reuse of earlier frames in renderTemporal
+struct TemporalSettings {
+    int maxHistory = 8;            // Samples' worth of weight reprojected history can carry, 0 = off
+    float depthTolerance = 0.03f;  // Relative distance difference up to which a previous pixel shows the same surface
+};
+
+// Bytes held by the scene geometry, see RayTracer::memoryUsage
+struct SceneMemory {
+    size_t geometry = 0;   // spheres
+    size_t materials = 0;  // sphereMaterials and materials
+    size_t motion = 0;     // sphereVelocities
+    size_t bvh = 0;        // Nodes, index tables and the SoA leaf copy
+
+    size_t total() const { return geometry + materials + motion + bvh; }
+};
 
 class RayTracer {
 public:
@@ -11,13 +43,12 @@ public:
     //     : width(width), height(height), framebuffer(width * height) {}
 
     // Constructor updated to include aperture size and focus distance
-    std::vector<std::shared_ptr<Sphere>> objects; // Store objects (like spheres, planes, etc.)
     std::vector<Light> lights;                   // Store light sources
     RayTracer(int width, int height, float aperture = 0.05f, float focusDist = 3.0f,
               const Vec3& cameraPos = Vec3(0.0f, 0.0f, -5.0f),
               const Vec3& focusPoint = Vec3(0.0f, 0.0f, 0.0f),
               const Vec3& upVector = Vec3(0.0f, 1.0f, 0.0f))
-        : width(width), height(height), framebuffer(width * height), 
+        : width(width), height(height), framebuffer(static_cast<size_t>(width) * height * sizeof(Vec3)), 
           apertureSize(aperture), focusDistance(focusDist), 
           cameraPosition(cameraPos), focusPoint(focusPoint), upVector(upVector) {
         updateCameraBasis();
@@ -26,8 +57,69 @@ public:
 
     void updateCameraBasis();
     void setupScene();
+    // Empties spheres, their materials and velocities, and the material list
+    void clearSpheres();
+    uint32_t addMaterial(const Material& material);
+    // Appends a sphere and returns its index. Velocities are only stored once
+    // some sphere has a non-zero one.
+    int addSphere(const Sphere& sphere, uint32_t material, const Vec3& velocity = Vec3(0, 0, 0));
+    Vec3 sphereCenter(int index, float time) const;
+    const Material& sphereMaterial(int index) const { return materials[sphereMaterials[index]]; }
+    SceneMemory memoryUsage() const;
+    // Rebuilds the intersection data from spheres and the light sampling tables
+    // from lights, call after editing the scene
+    void commitScene();
+    // Same, with a tree already built for spheres and shutter, e.g. from a scene cache
+    void commitScene(BVH&& prebuilt);
+    // Motion blur comes from Sphere::velocity over the shutter interval; timeDelta and
+    // effectValue no longer change the image and are only kept for existing callers.
     //FOR DOF
     void renderFrame(float timeDelta, float effectValue, bool useDOF = false, int samplesPerPixel = 1);
+    // Progressive rendering: adds samplesPerFrame samples per call to a running
+    // accumulation and shows the average. Starts over by itself when the camera,
+    // aperture, focus, plane, lights or committed scene change. Returns false
+    // without doing any work once maxSamples are in, so callers can idle.
+    bool renderProgressive(float timeDelta, float effectValue, bool useDOF, int samplesPerFrame, int maxSamples);
+    int getAccumulatedSamples() const { return accumulatedSamples; }
+    // Like renderFrame, but after a uniform first pass the rest of the budget goes to
+    // the pixels whose luminance estimate is still noisy. Returns the samples traced.
+    int64_t renderAdaptive(float timeDelta, float effectValue, bool useDOF, const AdaptiveSettings& settings);
+    // renderProgressive that survives camera moves: when only cameraPosition,
+    // focusPoint or upVector changed, the last image is reprojected into the new
+    // view through the primary hits of both, and pixels that saw the same surface
+    // start with it as up to settings.maxHistory samples. Disoccluded pixels start
+    // empty. Each new view gets a new frameIndex.
+    bool renderTemporal(float timeDelta, float effectValue, bool useDOF, int samplesPerFrame, int maxSamples,
+                        const TemporalSettings& settings = TemporalSettings());
+    // Samples per pixel of the current image, for heatmaps
+    const std::vector<int>& getSampleCounts() const { return pixelSamples; }
+    // Per pixel average of an AOV over the samples of the current image (see
+    // aovs), scalars in all three channels. False if it wasn't recorded.
+    bool getAov(Aov aov, std::vector<Vec3>& pixels) const { return aovBuffers.average(aov, pixels); }
+
+    // Adds samples to pixels [x0, x1) x [y0, y1) and updates their average, renderFrame
+    // hands these out to the thread pool
+    void renderTile(int x0, int y0, int x1, int y1, bool useDOF, int samplesPerPixel);
+    // Same as renderTile, but camera rays of a pixel block are traced as one packet
+    void renderTilePackets(int x0, int y0, int x1, int y1, bool useDOF, int samplesPerPixel, PacketStats& stats);
+
+    // renderFrame's tiles, numbered row by row over the tileSize grid
+    int tileCount() const;
+    void tileBounds(int tile, int& x0, int& y0, int& x1, int& y1) const;
+    // renderFrame restricted to tiles [firstTile, endTile), the rest of the image
+    // is left as it is. frameIndex is not advanced, so pieces of one frame
+    // rendered anywhere (see distributed.hpp) match a whole renderFrame.
+    void renderTiles(int firstTile, int endTile, float timeDelta, float effectValue, bool useDOF, int samplesPerPixel);
+
+    // Worker threads used by renderFrame, 0 = one per hardware thread
+    void setThreadCount(int count);
+    int getThreadCount() const { return pool ? pool->size() : threadCount; }
+
+    // Packet statistics of the last renderFrame with packets enabled
+    const PacketStats& getPacketStats() const { return packetStats; }
+    // Counters, timings and per-tile cost of the last renderFrame, renderProgressive
+    // pass, renderAdaptive or renderTiles, see collectStats
+    const RenderStats& getStats() const { return stats; }
 
     //For 1 ray / px use this
     // void renderFrame(float timeDelta, float effectValue);
@@ -35,15 +127,35 @@ public:
     // void renderFrame(float timeDelta, float effectValue, int samplesPerPixel);
 
 
-    Vec3 trace(const Ray& ray, float timeDelta) const;
-    Vec3 computeLighting(const Vec3& point, const Vec3& normal, const Vec3& viewDir, float timeDelta, const Sphere* hitSphere) const;
-    Vec3 jitterLight() const;
-    Ray jitteredRay(const Ray& ray, float effectValue) const;  //  function for motion blur
+    // All sampling goes through the per-sample Sampler, which keeps threads independent.
+    // Each decision reads its own dimension, see SampleDimension.
+    Ray cameraRay(int x, int y, bool useDOF, Sampler& sampler) const;
+    // primary, if given, receives what the ray saw first
+    Vec3 trace(const Ray& ray, Sampler& sampler, PrimaryHit* primary = nullptr) const;
+    // Second half of trace once the closest sphere (or -1) is known: plane test and lighting
+    Vec3 shade(const Ray& ray, int hitIndex, float closest, Sampler& sampler,
+               PrimaryHit* primary = nullptr) const;
+    // time is the shutter time of the ray that found point, shadow rays test the scene at that moment.
+    // primary, if given, receives the direct light and shadow visibility.
+    Vec3 computeLighting(const Vec3& point, const Vec3& normal, const Vec3& viewDir, float time, const Sphere* hitSphere, Sampler& sampler,
+                         PrimaryHit* primary = nullptr) const;
+    // Occlusion query for shadow rays (unit direction): true if a sphere other than
+    // skip or the ground plane lies strictly between the origin and maxDistance.
+    // With a light index the last occluder of that light on this thread is tried first.
+    bool occluded(const Ray& ray, float maxDistance, int lightIndex = -1, int skip = -1) const;
 
     //DOF helper
-    Ray jitterApertureRay(const Vec3& origin, const Vec3& focusPoint) const;
+    Ray jitterApertureRay(const Vec3& origin, const Vec3& focusPoint, Sampler& sampler) const;
 
-    const std::vector<Vec3>& getFramebuffer() const { return framebuffer; }
+    // The image decoded back to float RGB, whatever pixelFormat it is stored in
+    std::vector<Vec3> getFramebuffer() const;
+    // The image as stored: width * height pixels of bytesPerPixel(pixelFormat)
+    const std::vector<uint8_t>& getPixels() const { return framebuffer; }
+    // Every pixel a render pass updates is also stored to pixel y * width + x of
+    // pixels, in pixelFormat, e.g. a mapped GL buffer, so presenting needs no
+    // separate copy. Passes that sample the whole image (renderFrame,
+    // renderProgressive) fill it completely. nullptr turns it off.
+    void setPresentTarget(void* pixels) { presentTarget = static_cast<uint8_t*>(pixels); }
 
 public:
     bool intersectPlane(const Ray& ray, Vec3& hitPoint, Vec3& normal) const;  // function for plane intersection
@@ -58,12 +170,115 @@ public:
     Vec3 forward;         // Camera forward vector
     Vec3 right;           // Camera right vector
     Vec3 cameraUp;        // Adjusted up vector after basis calculation
+    // Scene geometry, split by how often it's read: the kernels only see center
+    // and radius, shading looks the material up, motion is absent if nothing moves.
+    // Edit through addSphere or keep the per-sphere vectors the same length.
     std::vector<Sphere> spheres;
+    std::vector<uint32_t> sphereMaterials;  // Per sphere, index into materials
+    std::vector<Material> materials;
+    std::vector<Vec3> sphereVelocities;     // Per sphere, or empty for a static scene
+    BVH bvh;              // Acceleration structure over spheres, see commitScene()
     // std::vector<Light> lights;
-    std::vector<Vec3> framebuffer;
+    std::vector<uint8_t> framebuffer;  // Resolved image in pixelFormat, see getPixels
     Vec3 planePoint;      // A point on the plane
     Vec3 planeNormal;     // Normal vector of the plane
     Vec3 planeColor;      // Color of the plane
+    int tileSize = 32;    // Tile edge in pixels for the parallel scheduler
+    int packetSize = 0;   // 4, 8 or 16 traces camera rays in packets, anything else single rays. Experimental, not faster yet
+    float shutter = 1.0f / 60.0f;  // Seconds the shutter stays open, camera rays get times in [0, shutter)
+    uint32_t seed = 0;        // Same seed and frame index give the same image
+    uint32_t frameIndex = 0;  // Advanced by every renderFrame call
+    SamplerType samplerType = SamplerType::Sobol;  // Sample point generator for every dimension
+    PixelFormat pixelFormat = PixelFormat::RGB32F;  // Storage of the framebuffer and present target
+    bool collectStats = true;     // Ray and test counters plus tile times, a few increments per ray
+    bool collectTimings = false;  // Also camera, trace and lighting times, several clock reads per sample
+    // Filter the image of renderFrame, renderProgressive and renderAdaptive with
+    // denoiseImage, guided by albedo, normal and depth of the primary hits.
+    // The accumulation itself stays unfiltered, so progressive passes go on as usual.
+    bool denoise = false;
+    DenoiseSettings denoiseSettings;
+    // AOVs every render records alongside the color, see getAov. Unrequested
+    // ones take no memory and with none the primary hit isn't recorded at all.
+    AovMask aovs = 0;
+    // With more lights than this, each shading point traces this many shadow
+    // rays to lights picked by lightSelection instead of one to every light, so
+    // its cost no longer grows with the light count. 0 = always every light.
+    int lightSamples = 4;
+    LightSelection lightSelection = LightSelection::Tree;
+    // Shadow rays per shading point to each area light without samples of its
+    // own, stratified over the light. Independent of the samples per pixel, so
+    // soft shadows can converge without paying for whole camera samples.
+    int shadowSamples = 1;
+
+private:
+    int threadCount = 0;
+    std::unique_ptr<ThreadPool> pool;  // Created lazily on first render
+    std::vector<PacketStats> workerPacketStats;
+    PacketStats packetStats;
+    std::vector<RenderCounters> workerCounters;
+    RenderStats stats;
+
+    // Renders sampleCount more samples per pixel on top of accumulation, in tiles
+    // [firstTile, endTile) or all of them
+    void renderSamples(bool useDOF, int sampleCount, int firstTile = 0, int endTile = -1);
+    // Without the camera, the key leaves out cameraPosition, focusPoint, upVector and frameIndex
+    uint64_t viewStateKey(bool useDOF, bool withCamera = true) const;
+    // Starts the stats of a new frame
+    void beginStats();
+    // Runs body(x0, y0, x1, y1, worker) for tiles [firstTile, endTile) on the pool,
+    // with the worker's counters active and tile times recorded if collectStats
+    template <typename Body>
+    void forEachTile(int firstTile, int endTile, Body body);
+    // Rebuilds lightTable and lightTree if lights changed since the last call
+    void prepareLights();
+    // Sphere count or shutter changed since the last commitScene
+    bool sceneOutdated() const { return bvh.size() != static_cast<int>(spheres.size()) || bvh.shutterTime() != shutter; }
+    float relativeError(int index) const;
+
+    // Traces count more samples of one pixel and folds them into the accumulation
+    void samplePixel(int x, int y, int count, bool useDOF);
+    void addSamples(int index, const Vec3& colorSum, float lumSqSum, int count);
+    // Filters the whole accumulation into framebuffer and presentTarget
+    void denoiseFrame();
+    // Primary hits of pixels [x0, x1) x [y0, y1) for renderTemporal
+    void recordHits(int x0, int y0, int x1, int y1);
+    // Adds the reprojected history to pixels [x0, x1) x [y0, y1)
+    void reprojectTile(int x0, int y0, int x1, int y1);
+    // Averages the accumulation of pixels [x0, x1) x [y0, y1) into framebuffer
+    // and presentTarget, once per tile after its samples are in. Blends in the
+    // history first on the first pass of a reprojected view, leaves the pixels
+    // to denoiseFrame while denoising.
+    void resolveTile(int x0, int y0, int x1, int y1);
+
+    std::vector<Vec3> accumulation;        // Running sum of all samples per pixel
+    std::vector<float> accumulationLumSq;  // Running sum of squared sample luminance, for variance
+    std::vector<int> pixelSamples;         // Samples in accumulation, per pixel
+    uint8_t* presentTarget = nullptr;      // Extra destination for finished pixels, see setPresentTarget
+    int accumulatedSamples = 0;            // Uniform samples per pixel, 0 = start over
+    uint64_t accumulationKey = 0;    // viewStateKey the accumulation belongs to
+    uint64_t sceneVersion = 0;       // Bumped by commitScene
+    std::vector<Light> preparedLights;     // lights the tables below were built for
+    AliasTable lightTable;                 // Lights by intensity
+    LightTree lightTree;                   // Lights by position and intensity
+    AovBuffers aovBuffers;                 // Requested AOVs plus the denoiser's guides, per pixel sums
+    bool recordingAovs = false;            // Current pass fills aovBuffers
+    bool denoising = false;                // Current call ends with denoiseFrame
+
+    // renderTemporal: primary hits of the current view and the previous view's image
+    struct ViewBasis { Vec3 position, forward, right, up; };
+    static constexpr int kSkyObject = -1, kPlaneObject = -2;
+    std::vector<Vec3> hitPositions;        // Pixel center's hit point, far along the ray for sky
+    std::vector<int> hitObjects;           // Sphere index seen at the pixel center, or kSkyObject / kPlaneObject
+    ViewBasis hitView;                     // Camera the hits were taken with
+    std::vector<Vec3> historySum;          // Previous view's accumulation, pixelSamples, hits and camera
+    std::vector<int> historySamples;
+    std::vector<Vec3> historyPositions;
+    std::vector<int> historyObjects;
+    ViewBasis historyView;
+    TemporalSettings temporalSettings;
+    uint64_t temporalKey = 0;              // viewStateKey without camera of the hits, 0 = none recorded
+    bool capturingHits = false;            // Current pass records primary hits
+    bool reprojecting = false;             // Current pass blends in the history
 
 };
 
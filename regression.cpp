@@ -0,0 +1,374 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "raytracer.hpp"
+#include "imageio.hpp"
+
+// Golden-image regression test, run by ctest. Renders the setupScene variants
+// below with fixed seeds and compares each against a converged reference in the
+// golden directory. A run fails when the image got noisier than the recorded
+// baseline, the render got slower by more than the time tolerance, or packet
+// tracing no longer matches single rays exactly.
+//
+// Render time is measured relative to a fixed calibration loop, so the baseline
+// roughly carries over between machines; after an intended change (or on a very
+// different CPU) record a new one with --update.
+
+using Clock = std::chrono::steady_clock;
+
+static volatile float sink;  // Keeps the calibration loop alive
+
+// Each case isolates one effect of the default scene, soft shadows are in all of them
+struct GoldenScene {
+    const char* name;
+    bool useDOF;
+    float shutter;
+};
+
+static const GoldenScene kScenes[] = {
+    {"dof", true, 0.0f},
+    {"motion", false, 1.0f / 60.0f},
+    {"shadows", false, 0.0f},
+};
+
+struct GoldenConfig {
+    std::string golden = "golden";
+    std::string outPrefix;     // Also write the test renders here, for a look
+    int width = 160, height = 120;
+    int spp = 16;              // Samples of the test render
+    int referenceSpp = 1024;   // Samples of the stored references
+    int repeats = 5;           // Timed renders per scene, the best one counts
+    float psnrTolerance = 0.5f;    // dB the PSNR may drop below the baseline
+    float flipTolerance = 0.1f;    // Relative increase of the FLIP-like error
+    float timeTolerance = 1.5f;    // Allowed slowdown factor, 0 = don't check time
+};
+
+// What one scene measured, also the format of a baseline entry
+struct GoldenResult {
+    double psnr = 0.0;  // dB against the reference, of the displayed image
+    double flip = 0.0;  // Mean FLIP-like error in [0, 1]
+    double cost = 0.0;  // Best render time divided by the calibration time
+    uint64_t hash = 0;  // Of the framebuffer, tells whether the image changed at all
+};
+
+static void printUsage(const char* program) {
+    std::cout << "Usage: " << program << " [options]\n"
+              << "  --golden DIR          references and baseline.txt (golden)\n"
+              << "  --update              record the current results as the new baseline\n"
+              << "  --update-references   also render new references, slow\n"
+              << "  --out PREFIX          also write the test renders as PREFIX<scene>.pfm\n"
+              << "  --psnr-tolerance DB   allowed PSNR drop (0.5)\n"
+              << "  --flip-tolerance F    allowed relative FLIP-like error increase (0.1)\n"
+              << "  --time-tolerance F    allowed slowdown factor, 0 = off (1.5)\n";
+}
+
+// Fixed scalar work unrelated to the tracer, best of three runs in ms
+static double calibrationMs() {
+    double best = std::numeric_limits<double>::infinity();
+    for (int run = 0; run < 3; ++run) {
+        auto start = Clock::now();
+        float x = 0.5f, sum = 0.0f;
+        for (int i = 0; i < 4000000; ++i) {
+            x = x * 0.999f + 0.5f / (1.0f + x);
+            sum += std::sqrt(x);
+        }
+        sink = sum;
+        best = std::min(best, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+    }
+    return best;
+}
+
+static uint64_t hashBytes(const std::vector<uint8_t>& bytes) {
+    uint64_t hash = 1469598103934665603ull;  // FNV-1a
+    for (uint8_t b : bytes) hash = (hash ^ b) * 1099511628211ull;
+    return hash;
+}
+
+// Renders one frame of the scene, frame 0 of seed, camera rays in packets of
+// packetSize if set. Returns the best time in ms.
+static double render(const GoldenScene& scene, int width, int height, int spp, uint32_t seed, int repeats,
+                     std::vector<Vec3>& image, uint64_t* hash, int packetSize = 0) {
+    RayTracer tracer(width, height, 0.13f, 2.0f);
+    tracer.setupScene();
+    tracer.packetSize = packetSize;
+    tracer.shutter = scene.shutter;
+    tracer.seed = seed;
+    tracer.setThreadCount(1);  // Timings of a single thread vary the least
+    tracer.collectStats = false;
+
+    double best = std::numeric_limits<double>::infinity();
+    for (int run = 0; run < repeats; ++run) {
+        tracer.frameIndex = 0;
+        auto start = Clock::now();
+        tracer.renderFrame(0.0f, 0.0f, scene.useDOF, spp);
+        best = std::min(best, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+    }
+    image = tracer.getFramebuffer();
+    if (hash) *hash = hashBytes(tracer.getPixels());
+    return best;
+}
+
+// As the viewer shows it: clamped and gamma corrected
+static float display(float value) {
+    return std::pow(std::min(std::max(value, 0.0f), 1.0f), 1.0f / 2.2f);
+}
+
+static double psnr(const std::vector<Vec3>& image, const std::vector<Vec3>& reference) {
+    double sum = 0.0;
+    for (size_t i = 0; i < image.size(); ++i) {
+        double dx = display(image[i].x) - display(reference[i].x);
+        double dy = display(image[i].y) - display(reference[i].y);
+        double dz = display(image[i].z) - display(reference[i].z);
+        sum += dx * dx + dy * dy + dz * dz;
+    }
+    double mse = sum / (3.0 * image.size());
+    return mse > 0.0 ? std::min(10.0 * std::log10(1.0 / mse), 100.0) : 100.0;
+}
+
+// Color part of FLIP: both images are taken to the linearized CIELAB space
+// YCxCz, blurred a little like the eye would at normal viewing distance, then
+// compared per pixel with the HyAB distance in L*a*b*. The distance is
+// compressed and normalized like FLIP does, the edge and point term is left out.
+struct Lab { float l, a, b; };
+
+static const float kWhite[3] = {0.950456f, 1.0f, 1.088754f};  // D65
+
+static void toYCxCz(const Vec3& rgb, float out[3]) {
+    float r = std::min(std::max(rgb.x, 0.0f), 1.0f);
+    float g = std::min(std::max(rgb.y, 0.0f), 1.0f);
+    float b = std::min(std::max(rgb.z, 0.0f), 1.0f);
+    float x = (0.4124564f * r + 0.3575761f * g + 0.1804375f * b) / kWhite[0];
+    float y = (0.2126729f * r + 0.7151522f * g + 0.0721750f * b) / kWhite[1];
+    float z = (0.0193339f * r + 0.1191920f * g + 0.9503041f * b) / kWhite[2];
+    out[0] = 116.0f * y - 16.0f;
+    out[1] = 500.0f * (x - y);
+    out[2] = 200.0f * (y - z);
+}
+
+static Lab ycxczToLab(const float c[3]) {
+    float y = (c[0] + 16.0f) / 116.0f;
+    float x = c[1] / 500.0f + y;
+    float z = y - c[2] / 200.0f;
+    auto f = [](float t) {
+        return t > 0.008856f ? std::cbrt(t) : 7.787f * t + 16.0f / 116.0f;
+    };
+    float fx = f(x), fy = f(y), fz = f(z);
+    return {116.0f * fy - 16.0f, 500.0f * (fx - fy), 200.0f * (fy - fz)};
+}
+
+static float hyab(const Lab& p, const Lab& q) {
+    float da = p.a - q.a, db = p.b - q.b;
+    return std::fabs(p.l - q.l) + std::sqrt(da * da + db * db);
+}
+
+static std::vector<Lab> filteredLab(const std::vector<Vec3>& image, int width, int height) {
+    static const float kernel[5] = {0.0545f, 0.2442f, 0.4026f, 0.2442f, 0.0545f};  // Gaussian, sigma 1 px
+
+    std::vector<float> channels(image.size() * 3), pass(image.size() * 3);
+    for (size_t i = 0; i < image.size(); ++i) toYCxCz(image[i], &channels[i * 3]);
+
+    // Separable blur, edges clamped
+    for (int dir = 0; dir < 2; ++dir) {
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                float sum[3] = {0.0f, 0.0f, 0.0f};
+                for (int k = -2; k <= 2; ++k) {
+                    int sx = dir == 0 ? std::min(std::max(x + k, 0), width - 1) : x;
+                    int sy = dir == 1 ? std::min(std::max(y + k, 0), height - 1) : y;
+                    const float* c = &channels[(static_cast<size_t>(sy) * width + sx) * 3];
+                    for (int j = 0; j < 3; ++j) sum[j] += kernel[k + 2] * c[j];
+                }
+                std::copy(sum, sum + 3, &pass[(static_cast<size_t>(y) * width + x) * 3]);
+            }
+        }
+        channels.swap(pass);
+    }
+
+    std::vector<Lab> lab(image.size());
+    for (size_t i = 0; i < image.size(); ++i) lab[i] = ycxczToLab(&channels[i * 3]);
+    return lab;
+}
+
+static double flipError(const std::vector<Vec3>& image, const std::vector<Vec3>& reference, int width, int height) {
+    std::vector<Lab> a = filteredLab(image, width, height), b = filteredLab(reference, width, height);
+
+    // Largest color difference FLIP expects, between pure green and pure blue
+    float green[3], blue[3];
+    toYCxCz(Vec3(0, 1, 0), green);
+    toYCxCz(Vec3(0, 0, 1), blue);
+    const float maxDistance = std::pow(hyab(ycxczToLab(green), ycxczToLab(blue)), 0.7f);
+    const float pc = 0.4f, pt = 0.95f;  // FLIP's compression of large differences
+
+    double sum = 0.0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        float d = std::pow(hyab(a[i], b[i]), 0.7f);
+        float e = d < pc * maxDistance ? d * pt / (pc * maxDistance)
+                                       : pt + (d - pc * maxDistance) / (maxDistance - pc * maxDistance) * (1.0f - pt);
+        sum += std::min(e, 1.0f);
+    }
+    return sum / a.size();
+}
+
+static std::string referencePath(const GoldenConfig& config, const GoldenScene& scene) {
+    return config.golden + "/" + scene.name + ".pfm";
+}
+
+static bool readBaseline(const std::string& path, std::map<std::string, GoldenResult>& baseline) {
+    std::ifstream file(path);
+    if (!file.is_open()) return false;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream in(line);
+        std::string name;
+        GoldenResult result;
+        in >> name >> result.psnr >> result.flip >> result.cost >> std::hex >> result.hash;
+        if (in) baseline[name] = result;
+    }
+    return true;
+}
+
+static bool writeBaseline(const std::string& path, const GoldenConfig& config,
+                          const std::map<std::string, GoldenResult>& baseline) {
+    std::ofstream file(path);
+    if (!file.is_open()) return false;
+    file << "# Written by ray_tracer_regression --update, " << config.width << "x" << config.height << " at "
+         << config.spp << " spp against " << config.referenceSpp << " spp references\n"
+         << "# scene  psnr_db  flip  cost (render ms / calibration ms)  framebuffer hash\n";
+    for (const GoldenScene& scene : kScenes) {
+        const GoldenResult& r = baseline.at(scene.name);
+        file << scene.name << " " << std::fixed << std::setprecision(3) << r.psnr << " " << std::setprecision(5)
+             << r.flip << " " << std::setprecision(3) << r.cost << " " << std::hex << std::setw(16)
+             << std::setfill('0') << r.hash << std::dec << std::setfill(' ') << "\n";
+    }
+    return file.good();
+}
+
+int main(int argc, char** argv) {
+    GoldenConfig config;
+    bool update = false, updateReferences = false;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--update") update = true;
+            else if (arg == "--update-references") update = updateReferences = true;
+            else if (i + 1 >= argc) { printUsage(argv[0]); return 1; }
+            else if (arg == "--golden") config.golden = argv[++i];
+            else if (arg == "--out") config.outPrefix = argv[++i];
+            else if (arg == "--psnr-tolerance") config.psnrTolerance = std::stof(argv[++i]);
+            else if (arg == "--flip-tolerance") config.flipTolerance = std::stof(argv[++i]);
+            else if (arg == "--time-tolerance") config.timeTolerance = std::stof(argv[++i]);
+            else { printUsage(argv[0]); return 1; }
+        }
+    } catch (const std::exception&) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    const std::string baselinePath = config.golden + "/baseline.txt";
+    std::map<std::string, GoldenResult> baseline;
+    if (!readBaseline(baselinePath, baseline) && !update) {
+        std::cerr << "Failed to read " << baselinePath << ", record one with --update" << std::endl;
+        return 1;
+    }
+
+    double calibration = calibrationMs();
+    std::cout << "calibration: " << calibration << " ms" << std::endl;
+
+    int failures = 0;
+    for (const GoldenScene& scene : kScenes) {
+        std::vector<Vec3> reference;
+        int refWidth = 0, refHeight = 0;
+        if (updateReferences) {
+            render(scene, config.width, config.height, config.referenceSpp, 1000, 1, reference, nullptr);
+            if (!writePFM(referencePath(config, scene), reference, config.width, config.height)) {
+                std::cerr << "Failed to write " << referencePath(config, scene) << std::endl;
+                return 1;
+            }
+        } else if (!readPFM(referencePath(config, scene), reference, refWidth, refHeight) ||
+                   refWidth != config.width || refHeight != config.height) {
+            std::cerr << "Failed to read a " << config.width << "x" << config.height << " reference from "
+                      << referencePath(config, scene) << std::endl;
+            return 1;
+        }
+
+        std::vector<Vec3> image;
+        GoldenResult result;
+        double ms = render(scene, config.width, config.height, config.spp, 1, config.repeats, image, &result.hash);
+        result.psnr = psnr(image, reference);
+        result.flip = flipError(image, reference, config.width, config.height);
+        result.cost = ms / calibration;
+
+        if (!config.outPrefix.empty()) {
+            std::string path = config.outPrefix + scene.name + ".pfm";
+            if (!writePFM(path, image, config.width, config.height)) std::cerr << "Failed to write " << path << std::endl;
+        }
+
+        std::cout << scene.name << ": psnr " << std::fixed << std::setprecision(2) << result.psnr << " dB, flip "
+                  << std::setprecision(4) << result.flip << ", " << std::setprecision(1) << ms << " ms = "
+                  << std::setprecision(2) << result.cost << "x calibration";
+        std::cout.unsetf(std::ios::floatfield);
+
+        auto known = baseline.find(scene.name);
+        if (update) {
+            baseline[scene.name] = result;
+            std::cout << std::endl;
+            continue;
+        }
+        if (known == baseline.end()) {
+            std::cout << "  FAIL: not in " << baselinePath << std::endl;
+            ++failures;
+            continue;
+        }
+
+        const GoldenResult& base = known->second;
+        std::vector<std::string> problems;
+        if (result.psnr < base.psnr - config.psnrTolerance) {
+            problems.push_back("psnr below " + std::to_string(base.psnr));
+        }
+        if (result.flip > base.flip * (1.0f + config.flipTolerance)) {
+            problems.push_back("flip above " + std::to_string(base.flip));
+        }
+        if (config.timeTolerance > 0.0f && result.cost > base.cost * config.timeTolerance) {
+            problems.push_back("slower than " + std::to_string(base.cost) + "x calibration");
+        }
+
+        // Packets have to trace exactly what single rays do
+        for (int packetSize : {4, 8, 16}) {
+            std::vector<Vec3> packetImage;
+            uint64_t packetHash = 0;
+            render(scene, config.width, config.height, config.spp, 1, 1, packetImage, &packetHash, packetSize);
+            if (packetHash != result.hash) problems.push_back("packets of " + std::to_string(packetSize) + " differ");
+        }
+
+        std::cout << (result.hash == base.hash ? ", image unchanged" : ", image changed");
+        if (problems.empty()) {
+            std::cout << "  ok" << std::endl;
+        } else {
+            std::cout << "  FAIL:";
+            for (const std::string& problem : problems) std::cout << " " << problem << ";";
+            std::cout << std::endl;
+            ++failures;
+        }
+    }
+
+    if (update) {
+        if (!writeBaseline(baselinePath, config, baseline)) {
+            std::cerr << "Failed to write " << baselinePath << std::endl;
+            return 1;
+        }
+        std::cout << "Wrote " << baselinePath << std::endl;
+        return 0;
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,52 @@
+#include "renderstats.hpp"
+#include <algorithm>
+#include <sstream>
+
+void RenderCounters::add(const RenderCounters& other) {
+    primaryRays += other.primaryRays;
+    shadowRays += other.shadowRays;
+    sphereTests += other.sphereTests;
+    planeTests += other.planeTests;
+    hits += other.hits;
+    misses += other.misses;
+    cameraNs += other.cameraNs;
+    traceNs += other.traceNs;
+    lightingNs += other.lightingNs;
+}
+
+std::string RenderStats::toJson() const {
+    double tileSum = 0.0;
+    for (float ms : tileMs) tileSum += ms;
+    double pixels = static_cast<double>(width) * height;
+
+    std::ostringstream out;
+    out << "{\"frame_ms\":" << frameMs << ",\"threads\":" << threads << ",\"width\":" << width
+        << ",\"height\":" << height << ",\"primary_rays\":" << counters.primaryRays
+        << ",\"shadow_rays\":" << counters.shadowRays << ",\"sphere_tests\":" << counters.sphereTests
+        << ",\"plane_tests\":" << counters.planeTests << ",\"hits\":" << counters.hits
+        << ",\"misses\":" << counters.misses
+        << ",\"sphere_tests_per_ray\":"
+        << (counters.primaryRays + counters.shadowRays
+                ? static_cast<double>(counters.sphereTests) / (counters.primaryRays + counters.shadowRays) : 0.0)
+        << ",\"camera_ms\":" << counters.cameraNs * 1e-6 << ",\"trace_ms\":" << counters.traceNs * 1e-6
+        << ",\"lighting_ms\":" << counters.lightingNs * 1e-6 << ",\"tile_size\":" << tileSize
+        << ",\"tiles\":" << tileMs.size() << ",\"tile_ms_mean\":" << (tileMs.empty() ? 0.0 : tileSum / tileMs.size())
+        << ",\"tile_ms_max\":" << maxTileMs()
+        << ",\"ns_per_pixel\":" << (pixels > 0 ? tileSum * 1e6 / pixels : 0.0) << "}";
+    return out.str();
+}
+
+std::vector<float> RenderStats::tileCostImage() const {
+    std::vector<float> image(static_cast<size_t>(width) * height, 0.0f);
+    if (tileSize <= 0 || tileMs.size() != static_cast<size_t>(tilesX) * tilesY) return image;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            image[static_cast<size_t>(y) * width + x] = tileMs[(y / tileSize) * tilesX + x / tileSize];
+        }
+    }
+    return image;
+}
+
+float RenderStats::maxTileMs() const {
+    return tileMs.empty() ? 0.0f : *std::max_element(tileMs.begin(), tileMs.end());
+}
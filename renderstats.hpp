@@ -0,0 +1,54 @@
+#ifndef RENDERSTATS_HPP
+#define RENDERSTATS_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Work done by one render thread. Each pool worker bumps its own copy without
+// synchronization and RayTracer sums them per frame, see RayTracer::getStats.
+struct alignas(64) RenderCounters {
+    uint64_t primaryRays = 0;
+    uint64_t shadowRays = 0;
+    uint64_t sphereTests = 0;  // Ray-sphere tests in BVH leaves, one per ray and sphere
+    uint64_t planeTests = 0;   // Ground plane tests of primary and shadow rays
+    uint64_t hits = 0;         // Primary rays that hit a sphere or the plane
+    uint64_t misses = 0;       // Primary rays that see the sky
+    // Thread time in nanoseconds, only with RayTracer::collectTimings
+    uint64_t cameraNs = 0;     // Camera ray generation
+    uint64_t traceNs = 0;      // Intersection and shading, lighting included
+    uint64_t lightingNs = 0;   // computeLighting, shadow rays included
+
+    void add(const RenderCounters& other);
+};
+
+// Counters of the calling thread while it renders a tile with stats on, nullptr otherwise
+inline RenderCounters*& threadCounters() {
+    static thread_local RenderCounters* counters = nullptr;
+    return counters;
+}
+
+inline uint64_t statsClockNs() {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Everything a frame's render passes did. Progressive passes count as frames,
+// renderAdaptive's rounds are added into one.
+struct RenderStats {
+    RenderCounters counters;  // All threads together
+    double frameMs = 0.0;     // Wall time of the passes
+    int threads = 0;
+    int width = 0, height = 0;
+    int tileSize = 0, tilesX = 0, tilesY = 0;
+    std::vector<float> tileMs;  // Time spent on each tile in ms, row by row
+
+    // One JSON object on one line, like the bench results
+    std::string toJson() const;
+    // Every pixel set to the time of its tile, for writeHeatmapPPM
+    std::vector<float> tileCostImage() const;
+    float maxTileMs() const;
+};
+
+#endif
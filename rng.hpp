@@ -0,0 +1,47 @@
+#ifndef RNG_HPP
+#define RNG_HPP
+
+#include <cstdint>
+
+// Counter-based random numbers for the sampling code.
+// Every value is a pure hash of (seed, frame, pixel, sample, dimension), so
+// there is no shared state between threads and the same seed reproduces the
+// same image bit for bit regardless of how tiles are scheduled.
+class SampleRNG {
+public:
+    SampleRNG(uint32_t seed, uint32_t frame, uint32_t pixel, uint32_t sample)
+        : key(makeKey(seed, frame, pixel, sample)), dimension(0) {}
+
+    // Uniform float in [0, 1), each call consumes one dimension
+    float next() { return at(++dimension); }
+
+    // Value of a given dimension without moving the counter, next() reads dim + 1
+    float at(uint32_t dim) const {
+        return (mix(key + 0x9E3779B97F4A7C15ull * dim) >> 40) * (1.0f / 16777216.0f);
+    }
+
+    // Jumps to a fixed dimension so later draws don't depend on earlier code paths
+    void skipTo(uint32_t dim) { dimension = dim; }
+    uint32_t getDimension() const { return dimension; }
+
+private:
+    // 64-bit finalizer from MurmurHash3, full avalanche on every input bit
+    static uint64_t mix(uint64_t x) {
+        x ^= x >> 33;
+        x *= 0xFF51AFD7ED558CCDull;
+        x ^= x >> 33;
+        x *= 0xC4CEB9FE1A85EC53ull;
+        x ^= x >> 33;
+        return x;
+    }
+
+    static uint64_t makeKey(uint32_t seed, uint32_t frame, uint32_t pixel, uint32_t sample) {
+        uint64_t k = mix((static_cast<uint64_t>(seed) << 32) | frame);
+        return mix(k ^ ((static_cast<uint64_t>(pixel) << 32) | sample));
+    }
+
+    uint64_t key;
+    uint32_t dimension;
+};
+
+#endif
@@ -0,0 +1,321 @@
+#include "sampler.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+const float kOneMinusEpsilon = 0x1.fffffep-1f;
+
+// lowbias32 integer hash
+uint32_t hash32(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7FEB352Du;
+    x ^= x >> 15;
+    x *= 0x846CA68Bu;
+    x ^= x >> 16;
+    return x;
+}
+
+uint32_t hashCombine(uint32_t key, uint32_t value) {
+    return hash32(key ^ (value * 0x9E3779B9u + 0x632BE5ABu));
+}
+
+float toFloat(uint32_t bits) {
+    return (bits >> 8) * (1.0f / 16777216.0f);
+}
+
+uint32_t reverseBits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Hash-based Owen scrambling (Burley 2020) of a bit-reversed value: a bit only
+// flips depending on the bits above it, which keeps the (0,m,2)-net structure
+// of the Sobol pairs. Working on reversed bits saves a reversal per call.
+uint32_t owenScrambleReversed(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6C50B47Cu;
+    x ^= x * 0xB82F1E52u;
+    x ^= x * 0xC7AFE638u;
+    x ^= x * 0x8D22F6E6u;
+    return reverseBits(x);
+}
+
+// Second Sobol dimension, bit-reversed, one table per index byte. Its generator
+// matrix is Pascal's triangle mod 2: direction v(i + 1) = v(i) ^ (v(i) >> 1).
+struct SobolTable {
+    uint32_t bytes[4][256];
+    SobolTable() {
+        uint32_t directions[32];
+        directions[0] = 1u << 31;
+        for (int i = 1; i < 32; ++i) directions[i] = directions[i - 1] ^ (directions[i - 1] >> 1);
+        for (int k = 0; k < 4; ++k) {
+            for (uint32_t b = 0; b < 256; ++b) {
+                uint32_t value = 0;
+                for (int bit = 0; bit < 8; ++bit) {
+                    if (b & (1u << bit)) value ^= directions[k * 8 + bit];
+                }
+                bytes[k][b] = reverseBits(value);
+            }
+        }
+    }
+};
+const SobolTable kSobolTable;
+
+// First two dimensions of the Sobol sequence, a (0,2)-sequence, as bit-reversed
+// 32-bit fractions. The first dimension reversed is the index itself.
+uint32_t sobolSecondReversed(uint32_t index) {
+    return kSobolTable.bytes[0][index & 0xFF] ^ kSobolTable.bytes[1][(index >> 8) & 0xFF] ^
+           kSobolTable.bytes[2][(index >> 16) & 0xFF] ^ kSobolTable.bytes[3][index >> 24];
+}
+
+// Random permutation of [0, length) indexed by i (Kensler 2013, cycle walking)
+uint32_t permute(uint32_t i, uint32_t length, uint32_t key) {
+    uint32_t w = length - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= key;
+        i *= 0xE170893Du;
+        i ^= key >> 16;
+        i ^= (i & w) >> 4;
+        i ^= key >> 8;
+        i *= 0x0929EB3Fu;
+        i ^= key >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | key >> 27;
+        i *= 0x6935FA69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74DCB303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9E501CC3u;
+        i ^= (i & w) >> 2;
+        i *= 0xC860A3DFu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= length);
+    return (i + key) % length;
+}
+
+const uint32_t kPrimes[] = {2,  3,  5,  7,  11, 13, 17, 19, 23, 29, 31, 37,  41,  43,  47,  53,
+                            59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131};
+const uint32_t kHaltonDimensions = sizeof(kPrimes) / sizeof(kPrimes[0]);
+
+float radicalInverse(uint32_t base, uint32_t i) {
+    const double invBase = 1.0 / base;
+    double result = 0.0, digitWeight = invBase;
+    while (i) {
+        result += (i % base) * digitWeight;
+        i /= base;
+        digitWeight *= invBase;
+    }
+    return static_cast<float>(result);
+}
+
+const int kMaskSize = 64;  // Blue noise mask edge, a power of two
+
+// Blue noise threshold mask by void-and-cluster (Ulichney 1993), built once
+std::vector<float> buildBlueNoiseMask() {
+    const int n = kMaskSize * kMaskSize;
+    const float sigma = 1.5f;
+
+    // Gaussian energy of one point, indexed by wrapped offset
+    std::vector<float> kernel(n);
+    for (int dy = 0; dy < kMaskSize; ++dy) {
+        for (int dx = 0; dx < kMaskSize; ++dx) {
+            int wx = std::min(dx, kMaskSize - dx), wy = std::min(dy, kMaskSize - dy);
+            kernel[dy * kMaskSize + dx] = std::exp(-(wx * wx + wy * wy) / (2.0f * sigma * sigma));
+        }
+    }
+
+    std::vector<float> energy(n, 0.0f);
+    std::vector<uint8_t> on(n, 0);
+    auto splat = [&](int p, float sign) {
+        int px = p % kMaskSize, py = p / kMaskSize;
+        for (int y = 0; y < kMaskSize; ++y) {
+            const float* row = &kernel[((y - py) & (kMaskSize - 1)) * kMaskSize];
+            for (int x = 0; x < kMaskSize; ++x) {
+                energy[y * kMaskSize + x] += sign * row[(x - px) & (kMaskSize - 1)];
+            }
+        }
+    };
+    auto tightestCluster = [&]() {
+        int best = -1;
+        for (int p = 0; p < n; ++p) {
+            if (on[p] && (best < 0 || energy[p] > energy[best])) best = p;
+        }
+        return best;
+    };
+    auto largestVoid = [&]() {
+        int best = -1;
+        for (int p = 0; p < n; ++p) {
+            if (!on[p] && (best < 0 || energy[p] < energy[best])) best = p;
+        }
+        return best;
+    };
+
+    // Random initial pattern, relaxed until the tightest cluster is also the largest void
+    const int initialCount = n / 10;
+    SampleRNG rng(0xB1E5u, 0, 0, 0);
+    for (int placed = 0; placed < initialCount;) {
+        int p = std::min(static_cast<int>(rng.next() * n), n - 1);
+        if (on[p]) continue;
+        on[p] = 1;
+        splat(p, 1.0f);
+        ++placed;
+    }
+    for (int iteration = 0; iteration < n; ++iteration) {
+        int cluster = tightestCluster();
+        on[cluster] = 0;
+        splat(cluster, -1.0f);
+        int gap = largestVoid();
+        on[gap] = 1;
+        splat(gap, 1.0f);
+        if (gap == cluster) break;
+    }
+    std::vector<uint8_t> initialOn = on;
+    std::vector<float> initialEnergy = energy;
+
+    // Ranks below the initial count come from taking clusters away, the rest
+    // from filling voids
+    std::vector<int> rank(n);
+    for (int r = initialCount - 1; r >= 0; --r) {
+        int cluster = tightestCluster();
+        on[cluster] = 0;
+        splat(cluster, -1.0f);
+        rank[cluster] = r;
+    }
+    on = initialOn;
+    energy = initialEnergy;
+    for (int r = initialCount; r < n; ++r) {
+        int gap = largestVoid();
+        on[gap] = 1;
+        splat(gap, 1.0f);
+        rank[gap] = r;
+    }
+
+    std::vector<float> mask(n);
+    for (int p = 0; p < n; ++p) mask[p] = (rank[p] + 0.5f) / n;
+    return mask;
+}
+
+const std::vector<float>& blueNoiseMask() {
+    static const std::vector<float> mask = buildBlueNoiseMask();
+    return mask;
+}
+
+}  // namespace
+
+Sampler::Sampler(SamplerType type, uint32_t seed, uint32_t frame, int x, int y, uint32_t pixel,
+                 uint32_t sample, uint32_t sampleCount)
+    : type(type), frameKey(hashCombine(hash32(seed), frame)), x(x), y(y), index(sample),
+      count(std::max(sampleCount, 1u)), rng(seed, frame, pixel, sample) {
+    pixelKey = hashCombine(frameKey, pixel);
+    reversedIndex = reverseBits(sample);
+}
+
+void Sampler::samplePair(uint32_t pair, float& u, float& v) const {
+    switch (type) {
+    case SamplerType::Stratified: stratified(pair, u, v); break;
+    case SamplerType::Halton: halton(pair, u, v); break;
+    case SamplerType::Sobol: sobol(pair, pixelKey, u, v); break;
+    case SamplerType::BlueNoise: blueNoise(pair, u, v); break;
+    default:
+        // Dimension d is the (d + 1)th SampleRNG::next() draw
+        u = rng.at(2 * pair + 1);
+        v = rng.at(2 * pair + 2);
+        return;
+    }
+    u = std::min(u, kOneMinusEpsilon);
+    v = std::min(v, kOneMinusEpsilon);
+}
+
+float Sampler::sample(uint32_t dim) const {
+    if (type == SamplerType::Independent) return rng.at(dim + 1);
+    float u, v;
+    samplePair(dim / 2, u, v);
+    return (dim & 1) ? v : u;
+}
+
+void Sampler::stratified(uint32_t pair, float& u, float& v) const {
+    // Strata are split over the batch, later indices start over with a new shuffle
+    uint32_t pass = index / count, i = index % count;
+    uint32_t key = hashCombine(hashCombine(pixelKey, pair), pass);
+    float jitterU = toFloat(hashCombine(key, 2 * i)), jitterV = toFloat(hashCombine(key, 2 * i + 1));
+
+    uint32_t side = static_cast<uint32_t>(std::sqrt(static_cast<float>(count)) + 0.5f);
+    if (side * side == count) {
+        // Jittered grid, both dimensions share the cell
+        uint32_t cell = permute(i, count, key);
+        u = (cell % side + jitterU) / side;
+        v = (cell / side + jitterV) / side;
+        return;
+    }
+    // Latin hypercube: each dimension stratified on its own
+    u = (permute(i, count, key) + jitterU) / count;
+    v = (permute(i, count, hash32(key)) + jitterV) / count;
+}
+
+void Sampler::halton(uint32_t pair, float& u, float& v) const {
+    if (2 * pair + 1 >= kHaltonDimensions) {
+        u = rng.at(2 * pair + 1);
+        v = rng.at(2 * pair + 2);
+        return;
+    }
+    // Cranley-Patterson rotation decorrelates neighbouring pixels
+    uint32_t shift = hashCombine(pixelKey, pair);
+    u = radicalInverse(kPrimes[2 * pair], index) + toFloat(shift);
+    v = radicalInverse(kPrimes[2 * pair + 1], index) + toFloat(hash32(shift));
+    u -= std::floor(u);
+    v -= std::floor(v);
+}
+
+void Sampler::sobol(uint32_t pair, uint32_t scrambleKey, float& u, float& v) const {
+    // Each pair shuffles the indices differently so pairs don't correlate
+    uint32_t pairKey = hashCombine(scrambleKey, pair);
+    uint32_t shuffled = owenScrambleReversed(reversedIndex, pairKey);
+    u = toFloat(owenScrambleReversed(shuffled, hash32(pairKey + 1)));
+    v = toFloat(owenScrambleReversed(sobolSecondReversed(shuffled), hash32(pairKey + 2)));
+}
+
+void Sampler::blueNoise(uint32_t pair, float& u, float& v) const {
+    // One Sobol sequence for all pixels, shifted per pixel by the mask. Each
+    // dimension reads the mask at its own offset.
+    sobol(pair, frameKey, u, v);
+    const std::vector<float>& mask = blueNoiseMask();
+    uint32_t offset = hashCombine(frameKey, pair);
+    u += mask[((y + (offset >> 6)) & (kMaskSize - 1)) * kMaskSize + ((x + offset) & (kMaskSize - 1))];
+    v += mask[((y + (offset >> 18)) & (kMaskSize - 1)) * kMaskSize + ((x + (offset >> 12)) & (kMaskSize - 1))];
+    u -= std::floor(u);
+    v -= std::floor(v);
+}
+
+const char* Sampler::name(SamplerType type) {
+    switch (type) {
+    case SamplerType::Stratified: return "stratified";
+    case SamplerType::Halton: return "halton";
+    case SamplerType::Sobol: return "sobol";
+    case SamplerType::BlueNoise: return "bluenoise";
+    default: return "independent";
+    }
+}
+
+bool Sampler::parse(const char* text, SamplerType& type) {
+    const SamplerType types[] = {SamplerType::Independent, SamplerType::Stratified, SamplerType::Halton,
+                                 SamplerType::Sobol, SamplerType::BlueNoise};
+    for (SamplerType candidate : types) {
+        if (std::strcmp(text, name(candidate)) == 0) {
+            type = candidate;
+            return true;
+        }
+    }
+    return false;
+}
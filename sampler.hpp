@@ -0,0 +1,78 @@
+#ifndef SAMPLER_HPP
+#define SAMPLER_HPP
+
+#include <cstdint>
+#include "rng.hpp"
+
+// Sample point generators for the renderer. All of them are stateless functions
+// of (seed, frame, pixel, sample index, dimension) like SampleRNG, so tiles can
+// run on any thread and progressive / adaptive passes continue a pixel's sequence
+// where the last pass stopped.
+enum class SamplerType {
+    Independent,  // Plain SampleRNG hash, one uniform number per dimension
+    Stratified,   // Jittered grid (square counts) or Latin hypercube per dimension pair
+    Halton,       // Halton sequence, Cranley-Patterson rotated per pixel
+    Sobol,        // Sobol (0,2) pairs with hash-based Owen scrambling per pixel
+    BlueNoise,    // Sobol pairs shared by all pixels, shifted by a blue noise mask
+};
+
+// Fixed dimension layout of one camera sample. Every decision reads the same
+// dimension whatever code ran before it, and 2D decisions start on even
+// dimensions so the pairwise generators keep their 2D stratification.
+enum SampleDimension : uint32_t {
+    kDimPixel = 0,      // 2D jitter inside the pixel
+    kDimLens = 2,       // 2D position on the aperture
+    kDimMotion = 4,     // 1D shutter time for motion blur
+    kDimLights = 8,     // 2D point on the first light, then its pick when sampling many lights
+    kDimsPerLight = 4,  // Stride between lights
+};
+
+class Sampler {
+public:
+    // sampleCount is the number of samples the caller takes in this batch, the
+    // stratified sampler splits its strata by it. Indices past it start a new set.
+    Sampler(SamplerType type, uint32_t seed, uint32_t frame, int x, int y, uint32_t pixel,
+            uint32_t sample, uint32_t sampleCount);
+
+    // Next dimension, in [0, 1)
+    float get1D() { return sample(dimension++); }
+    // Next two dimensions, as one 2D point
+    void get2D(float& u, float& v) {
+        if (dimension & 1) {
+            // Off the pair grid, fall back to two separate draws
+            u = sample(dimension);
+            v = sample(dimension + 1);
+        } else {
+            samplePair(dimension / 2, u, v);
+        }
+        dimension += 2;
+    }
+
+    void startDimension(uint32_t dim) { dimension = dim; }
+    uint32_t getDimension() const { return dimension; }
+
+    static const char* name(SamplerType type);
+    // Parses the names returned by name(), false if unknown
+    static bool parse(const char* text, SamplerType& type);
+
+private:
+    // Dimensions 2 * pair and 2 * pair + 1
+    void samplePair(uint32_t pair, float& u, float& v) const;
+    float sample(uint32_t dim) const;
+    void stratified(uint32_t pair, float& u, float& v) const;
+    void halton(uint32_t pair, float& u, float& v) const;
+    void sobol(uint32_t pair, uint32_t scrambleKey, float& u, float& v) const;
+    void blueNoise(uint32_t pair, float& u, float& v) const;
+
+    SamplerType type;
+    uint32_t pixelKey;   // Hash of seed, frame and pixel
+    uint32_t frameKey;   // Hash of seed and frame only, shared by all pixels
+    int x, y;
+    uint32_t index;      // Sample index within the pixel
+    uint32_t reversedIndex;
+    uint32_t count;      // Batch size for the stratified sampler
+    uint32_t dimension = 0;
+    SampleRNG rng;       // Independent sampler and fallback for high dimensions
+};
+
+#endif
@@ -0,0 +1,543 @@
+#include "scene.hpp"
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <type_traits>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char kMagic[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\n'};
+constexpr uint32_t kVersion = 3;
+constexpr uint64_t kAlignment = 64;  // Array offsets, so mapped arrays can be read in place
+
+// Spheres, material indices, velocities and BVH are stored exactly as the
+// tracer keeps them in memory, so they're copied over in bulk
+struct SceneHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sphereCount, materialCount, lightCount, nodeCount;
+    uint32_t moving;   // 1 if there is a velocity per sphere
+    float camera[9];   // Position, look-at target, up
+    float aperture, focus, shutter;
+    float plane[9];    // Point, normal, color. A zero normal means no plane.
+    uint32_t reserved;
+    uint64_t sphereOffset, materialIndexOffset, materialOffset, velocityOffset, lightOffset, nodeOffset, indexOffset;
+};
+
+struct SceneMaterial {
+    float color[3];
+    float reserved;
+};
+
+struct SceneLight {
+    float position[3];
+    float intensity;
+    uint32_t shape;
+    float radius;
+    int32_t samples;
+    float normal[3];
+    float edgeU[3];
+    float edgeV[3];
+};
+
+static_assert(sizeof(SceneHeader) == 176, "SceneHeader is the on-disk layout");
+static_assert(sizeof(SceneMaterial) == 16 && sizeof(SceneLight) == 64, "Records are the on-disk layout");
+static_assert(sizeof(BVHNode) == 32 && sizeof(Vec3) == 12, "Stored as in memory");
+static_assert(std::is_trivially_copyable<Sphere>::value && sizeof(Sphere) == 16, "Spheres are stored as in memory");
+
+// Text scenes give a color per sphere, spheres of the same color share a material
+struct ColorHash {
+    size_t operator()(const Vec3& c) const {
+        uint32_t bits[3];
+        std::memcpy(bits, &c, sizeof(bits));
+        return bits[0] * 73856093u ^ bits[1] * 19349663u ^ bits[2] * 83492791u;
+    }
+};
+struct ColorEqual {
+    bool operator()(const Vec3& a, const Vec3& b) const { return a.x == b.x && a.y == b.y && a.z == b.z; }
+};
+
+void put(float* out, const Vec3& v) {
+    out[0] = v.x;
+    out[1] = v.y;
+    out[2] = v.z;
+}
+
+Vec3 get(const float* in) {
+    return Vec3(in[0], in[1], in[2]);
+}
+
+uint64_t alignUp(uint64_t offset) {
+    return (offset + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+// Read-only mapping of a whole file, unmapped when it goes out of scope
+class MappedFile {
+public:
+    ~MappedFile() {
+        if (data) munmap(data, size);
+    }
+
+    bool open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+            ::close(fd);
+            return false;
+        }
+        size = static_cast<size_t>(info.st_size);
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);  // The mapping keeps the file alive
+        if (mapped == MAP_FAILED) return false;
+        data = mapped;
+        madvise(data, size, MADV_SEQUENTIAL);
+        return true;
+    }
+
+    const unsigned char* bytes() const { return static_cast<const unsigned char*>(data); }
+    size_t length() const { return size; }
+
+private:
+    void* data = nullptr;
+    size_t size = 0;
+};
+
+bool modifiedTime(const std::string& path, struct timespec& time) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) return false;
+    time = info.st_mtim;
+    return true;
+}
+
+// Parses exactly count floats from text, false if there are fewer or more.
+// parsed gets the number found, -1 if something else is in the way.
+bool parseFloats(const char* text, float* out, int count, int& parsed) {
+    parsed = 0;
+    const char* p = text;
+    while (true) {
+        while (*p == ' ' || *p == '\t' || *p == '\r') ++p;
+        if (*p == '\0' || *p == '#') break;
+        char* end;
+        float value = std::strtof(p, &end);
+        if (end == p) {
+            parsed = -1;  // Not a number, never a valid count
+            return false;
+        }
+        if (parsed < count) out[parsed] = value;
+        ++parsed;
+        p = end;
+    }
+    return parsed == count;
+}
+
+// Checks what a text or binary scene can get wrong about an area light
+bool validLight(const Light& light) {
+    if (light.samples < 0) return false;
+    switch (light.shape) {
+        case LightShape::Point: return true;
+        case LightShape::Sphere: return light.radius > 0.0f;
+        case LightShape::Disk: return light.radius > 0.0f && std::fabs(light.normal.length() - 1.0f) < 1e-3f;
+        case LightShape::Quad: {
+            // Sampled as a spherical rectangle, so the edges have to be perpendicular
+            float u = light.edgeU.length(), v = light.edgeV.length();
+            return u > 0.0f && v > 0.0f && std::fabs(light.edgeU.dot(light.edgeV)) <= 1e-4f * u * v;
+        }
+    }
+    return false;
+}
+
+}  // namespace
+
+bool loadSceneText(const std::string& path, RayTracer& tracer) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open scene " << path << std::endl;
+        return false;
+    }
+    std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (!text.empty() && text.back() != '\n') text.push_back('\n');
+
+    std::vector<Sphere> spheres;
+    std::vector<uint32_t> sphereMaterials;
+    std::vector<Material> materials;
+    std::vector<Vec3> velocities;  // Stays empty until some sphere moves
+    std::unordered_map<Vec3, uint32_t, ColorHash, ColorEqual> materialByColor;
+    std::vector<Light> lights;
+    Vec3 planePoint, planeNormal, planeColor;
+    Vec3 cameraPosition = tracer.cameraPosition, focusPoint = tracer.focusPoint, upVector = tracer.upVector;
+    float aperture = tracer.apertureSize, focus = tracer.focusDistance, shutter = tracer.shutter;
+
+    int lineNumber = 0;
+    size_t start = 0;
+    while (start < text.size()) {
+        // Terminate the line in place, the number parsing stops at the '\0'
+        size_t end = text.find('\n', start);
+        text[end] = '\0';
+        const char* line = text.c_str() + start;
+        start = end + 1;
+        ++lineNumber;
+
+        while (*line == ' ' || *line == '\t') ++line;
+        const char* keywordEnd = line;
+        while (*keywordEnd && *keywordEnd != ' ' && *keywordEnd != '\t' && *keywordEnd != '\r' && *keywordEnd != '#') {
+            ++keywordEnd;
+        }
+        std::string keyword(line, keywordEnd);
+        if (keyword.empty()) continue;  // Blank or comment
+
+        float v[10];
+        int n = 0;
+        bool ok;
+        if (keyword == "sphere") {
+            ok = (parseFloats(keywordEnd, v, 10, n) || n == 7) && v[3] > 0.0f;
+            if (ok) {
+                auto found = materialByColor.emplace(get(v + 4), static_cast<uint32_t>(materials.size()));
+                if (found.second) materials.emplace_back(get(v + 4));
+                Vec3 velocity = n == 10 ? get(v + 7) : Vec3(0, 0, 0);
+                bool moves = velocity.x != 0.0f || velocity.y != 0.0f || velocity.z != 0.0f;
+                if (moves && velocities.empty()) velocities.assign(spheres.size(), Vec3());
+                spheres.emplace_back(get(v), v[3]);
+                sphereMaterials.push_back(found.first->second);
+                if (!velocities.empty()) velocities.push_back(velocity);
+            }
+        } else if (keyword == "light") {
+            // A point light, or a shape name, its numbers and an optional sample count
+            const char* shapeStart = keywordEnd;
+            while (*shapeStart == ' ' || *shapeStart == '\t') ++shapeStart;
+            const char* shapeEnd = shapeStart;
+            while (*shapeEnd >= 'a' && *shapeEnd <= 'z') ++shapeEnd;
+            std::string shape(shapeStart, shapeEnd);
+            if (shape.empty()) {
+                ok = parseFloats(keywordEnd, v, 4, n);
+                if (ok) lights.emplace_back(get(v), v[3]);
+            } else {
+                int count = shape == "sphere" ? 5 : (shape == "disk" ? 8 : (shape == "quad" ? 10 : 0));
+                ok = count > 0 && (parseFloats(shapeEnd, v, count + 1, n) || n == count);
+                if (ok) {
+                    int samples = n > count ? static_cast<int>(v[count]) : 0;
+                    Light light = shape == "sphere" ? sphereLight(get(v), v[3], v[4], samples)
+                                : shape == "disk"   ? diskLight(get(v), get(v + 3), v[6], v[7], samples)
+                                                    : quadLight(get(v), get(v + 3), get(v + 6), v[9], samples);
+                    ok = validLight(light) && (n == count || v[count] >= 1.0f);
+                    if (ok) lights.push_back(light);
+                }
+            }
+        } else if (keyword == "plane") {
+            ok = parseFloats(keywordEnd, v, 9, n);
+            if (ok) {
+                planePoint = get(v);
+                planeNormal = get(v + 3).normalize();
+                planeColor = get(v + 6);
+            }
+        } else if (keyword == "camera") {
+            ok = parseFloats(keywordEnd, v, 9, n);
+            if (ok) {
+                cameraPosition = get(v);
+                focusPoint = get(v + 3);
+                upVector = get(v + 6);
+            }
+        } else if (keyword == "lens") {
+            ok = parseFloats(keywordEnd, v, 2, n);
+            if (ok) {
+                aperture = v[0];
+                focus = v[1];
+            }
+        } else if (keyword == "shutter") {
+            ok = parseFloats(keywordEnd, v, 1, n) && v[0] >= 0.0f;
+            if (ok) shutter = v[0];
+        } else {
+            std::cerr << path << ":" << lineNumber << ": unknown statement '" << keyword << "'" << std::endl;
+            return false;
+        }
+        if (!ok) {
+            std::cerr << path << ":" << lineNumber << ": bad values for " << keyword << std::endl;
+            return false;
+        }
+    }
+
+    tracer.spheres.swap(spheres);
+    tracer.sphereMaterials.swap(sphereMaterials);
+    tracer.materials.swap(materials);
+    tracer.sphereVelocities.swap(velocities);
+    tracer.lights.swap(lights);
+    tracer.planePoint = planePoint;
+    tracer.planeNormal = planeNormal;
+    tracer.planeColor = planeColor;
+    tracer.cameraPosition = cameraPosition;
+    tracer.focusPoint = focusPoint;
+    tracer.upVector = upVector;
+    tracer.apertureSize = aperture;
+    tracer.focusDistance = focus;
+    tracer.shutter = shutter;
+    tracer.updateCameraBasis();
+    tracer.commitScene();
+    return true;
+}
+
+bool loadSceneBinary(const std::string& path, RayTracer& tracer) {
+    MappedFile file;
+    if (!file.open(path)) {
+        std::cerr << "Failed to map scene " << path << std::endl;
+        return false;
+    }
+
+    SceneHeader header;
+    if (file.length() < sizeof(header)) {
+        std::cerr << path << ": too short for a scene file" << std::endl;
+        return false;
+    }
+    std::memcpy(&header, file.bytes(), sizeof(header));
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion) {
+        std::cerr << path << ": not a version " << kVersion << " binary scene" << std::endl;
+        return false;
+    }
+
+    // Every array has to lie inside the file, counts are 32 bit so nothing overflows
+    auto fits = [&](uint64_t offset, uint64_t count, uint64_t size) {
+        return offset % kAlignment == 0 && offset <= file.length() && count * size <= file.length() - offset;
+    };
+    if (!fits(header.sphereOffset, header.sphereCount, sizeof(Sphere)) ||
+        !fits(header.materialIndexOffset, header.sphereCount, sizeof(uint32_t)) ||
+        !fits(header.materialOffset, header.materialCount, sizeof(SceneMaterial)) ||
+        !fits(header.velocityOffset, header.moving ? header.sphereCount : 0, sizeof(Vec3)) ||
+        !fits(header.lightOffset, header.lightCount, sizeof(SceneLight)) ||
+        !fits(header.nodeOffset, header.nodeCount, sizeof(BVHNode)) ||
+        !fits(header.indexOffset, header.sphereCount, sizeof(int32_t))) {
+        std::cerr << path << ": truncated or corrupt scene" << std::endl;
+        return false;
+    }
+
+    const Sphere* sphereData = reinterpret_cast<const Sphere*>(file.bytes() + header.sphereOffset);
+    std::vector<Sphere> spheres(sphereData, sphereData + header.sphereCount);
+    const uint32_t* indexData = reinterpret_cast<const uint32_t*>(file.bytes() + header.materialIndexOffset);
+    std::vector<uint32_t> sphereMaterials(indexData, indexData + header.sphereCount);
+    for (uint32_t index : sphereMaterials) {
+        if (index >= header.materialCount) {
+            std::cerr << path << ": material index out of range" << std::endl;
+            return false;
+        }
+    }
+    const SceneMaterial* materialData = reinterpret_cast<const SceneMaterial*>(file.bytes() + header.materialOffset);
+    std::vector<Material> materials;
+    materials.reserve(header.materialCount);
+    for (uint32_t i = 0; i < header.materialCount; ++i) materials.emplace_back(get(materialData[i].color));
+    std::vector<Vec3> velocities;
+    if (header.moving) {
+        const Vec3* velocityData = reinterpret_cast<const Vec3*>(file.bytes() + header.velocityOffset);
+        velocities.assign(velocityData, velocityData + header.sphereCount);
+    }
+
+    BVH bvh;
+    const BVHNode* nodes = reinterpret_cast<const BVHNode*>(file.bytes() + header.nodeOffset);
+    const int* primIndex = reinterpret_cast<const int*>(file.bytes() + header.indexOffset);
+    if (!bvh.restore(spheres, velocities, header.shutter, nodes, static_cast<int>(header.nodeCount), primIndex)) {
+        std::cerr << path << ": corrupt BVH" << std::endl;
+        return false;
+    }
+
+    const SceneLight* lightData = reinterpret_cast<const SceneLight*>(file.bytes() + header.lightOffset);
+    std::vector<Light> lights;
+    for (uint32_t i = 0; i < header.lightCount; ++i) {
+        const SceneLight& record = lightData[i];
+        Light light(get(record.position), record.intensity);
+        light.shape = static_cast<LightShape>(record.shape);
+        light.radius = record.radius;
+        light.samples = record.samples;
+        light.normal = get(record.normal);
+        light.edgeU = get(record.edgeU);
+        light.edgeV = get(record.edgeV);
+        if (record.shape > static_cast<uint32_t>(LightShape::Quad) || !validLight(light)) {
+            std::cerr << path << ": bad light " << i << std::endl;
+            return false;
+        }
+        lights.push_back(light);
+    }
+    tracer.lights.swap(lights);
+    tracer.spheres.swap(spheres);
+    tracer.sphereMaterials.swap(sphereMaterials);
+    tracer.materials.swap(materials);
+    tracer.sphereVelocities.swap(velocities);
+    tracer.cameraPosition = get(header.camera);
+    tracer.focusPoint = get(header.camera + 3);
+    tracer.upVector = get(header.camera + 6);
+    tracer.apertureSize = header.aperture;
+    tracer.focusDistance = header.focus;
+    tracer.shutter = header.shutter;
+    tracer.planePoint = get(header.plane);
+    tracer.planeNormal = get(header.plane + 3);
+    tracer.planeColor = get(header.plane + 6);
+    tracer.updateCameraBasis();
+    tracer.commitScene(std::move(bvh));
+    return true;
+}
+
+bool loadScene(const std::string& path, RayTracer& tracer, bool useCache) {
+    std::ifstream probe(path, std::ios::binary);
+    if (!probe.is_open()) {
+        std::cerr << "Failed to open scene " << path << std::endl;
+        return false;
+    }
+    char magic[sizeof(kMagic)] = {};
+    probe.read(magic, sizeof(magic));
+    probe.close();
+    if (std::memcmp(magic, kMagic, sizeof(kMagic)) == 0) return loadSceneBinary(path, tracer);
+
+    std::string cachePath = path + ".bin";
+    struct timespec textTime, cacheTime;
+    if (useCache && modifiedTime(path, textTime) && modifiedTime(cachePath, cacheTime)) {
+        bool fresh = cacheTime.tv_sec > textTime.tv_sec ||
+                     (cacheTime.tv_sec == textTime.tv_sec && cacheTime.tv_nsec >= textTime.tv_nsec);
+        if (fresh && loadSceneBinary(cachePath, tracer)) return true;
+    }
+
+    if (!loadSceneText(path, tracer)) return false;
+    // A missing cache only costs startup time, so failing to write it isn't an error
+    if (useCache && !saveSceneBinary(cachePath, tracer)) {
+        std::cerr << "Could not write scene cache " << cachePath << std::endl;
+    }
+    return true;
+}
+
+bool saveSceneText(const std::string& path, const RayTracer& tracer) {
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open " << path << " for writing" << std::endl;
+        return false;
+    }
+    auto vec = [](const Vec3& v) {
+        std::ostringstream out;
+        out << std::setprecision(9) << v.x << " " << v.y << " " << v.z;
+        return out.str();
+    };
+    file << std::setprecision(9);
+    file << "camera " << vec(tracer.cameraPosition) << "  " << vec(tracer.focusPoint) << "  " << vec(tracer.upVector) << "\n";
+    file << "lens " << tracer.apertureSize << " " << tracer.focusDistance << "\n";
+    file << "shutter " << tracer.shutter << "\n";
+    if (tracer.planeNormal.length() > 0.0f) {
+        file << "plane " << vec(tracer.planePoint) << "  " << vec(tracer.planeNormal) << "  " << vec(tracer.planeColor) << "\n";
+    }
+    for (const Light& light : tracer.lights) {
+        switch (light.shape) {
+            case LightShape::Point: file << "light " << vec(light.position); break;
+            case LightShape::Sphere: file << "light sphere " << vec(light.position) << "  " << light.radius; break;
+            case LightShape::Disk:
+                file << "light disk " << vec(light.position) << "  " << vec(light.normal) << "  " << light.radius;
+                break;
+            case LightShape::Quad:
+                file << "light quad " << vec(light.position) << "  " << vec(light.edgeU) << "  " << vec(light.edgeV);
+                break;
+        }
+        file << "  " << light.intensity;
+        if (light.shape != LightShape::Point && light.samples > 0) file << "  " << light.samples;
+        file << "\n";
+    }
+    for (size_t i = 0; i < tracer.spheres.size(); ++i) {
+        const Sphere& sphere = tracer.spheres[i];
+        file << "sphere " << vec(sphere.center) << "  " << sphere.radius << "  "
+             << vec(tracer.sphereMaterial(static_cast<int>(i)).color);
+        if (!tracer.sphereVelocities.empty() && tracer.sphereVelocities[i].length() > 0.0f) {
+            file << "  " << vec(tracer.sphereVelocities[i]);
+        }
+        file << "\n";
+    }
+    if (!file.good()) {
+        std::cerr << "Failed to write " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool saveSceneBinary(const std::string& path, const RayTracer& tracer) {
+    // The saved tree has to match the spheres it's loaded with
+    const BVH& bvh = tracer.bvh;
+    if (bvh.size() != static_cast<int>(tracer.spheres.size()) || bvh.shutterTime() != tracer.shutter ||
+        tracer.sphereMaterials.size() != tracer.spheres.size()) {
+        std::cerr << "Scene not committed, nothing to save to " << path << std::endl;
+        return false;
+    }
+
+    SceneHeader header = {};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.sphereCount = static_cast<uint32_t>(tracer.spheres.size());
+    header.materialCount = static_cast<uint32_t>(tracer.materials.size());
+    header.moving = tracer.sphereVelocities.empty() ? 0 : 1;
+    header.lightCount = static_cast<uint32_t>(tracer.lights.size());
+    header.nodeCount = static_cast<uint32_t>(bvh.nodeCount());
+    put(header.camera, tracer.cameraPosition);
+    put(header.camera + 3, tracer.focusPoint);
+    put(header.camera + 6, tracer.upVector);
+    header.aperture = tracer.apertureSize;
+    header.focus = tracer.focusDistance;
+    header.shutter = tracer.shutter;
+    put(header.plane, tracer.planePoint);
+    put(header.plane + 3, tracer.planeNormal);
+    put(header.plane + 6, tracer.planeColor);
+    header.sphereOffset = alignUp(sizeof(header));
+    header.materialIndexOffset = alignUp(header.sphereOffset + header.sphereCount * sizeof(Sphere));
+    header.materialOffset = alignUp(header.materialIndexOffset + header.sphereCount * sizeof(uint32_t));
+    header.velocityOffset = alignUp(header.materialOffset + header.materialCount * sizeof(SceneMaterial));
+    header.lightOffset = alignUp(header.velocityOffset + tracer.sphereVelocities.size() * sizeof(Vec3));
+    header.nodeOffset = alignUp(header.lightOffset + header.lightCount * sizeof(SceneLight));
+    header.indexOffset = alignUp(header.nodeOffset + header.nodeCount * sizeof(BVHNode));
+
+    std::vector<SceneMaterial> materials(header.materialCount);
+    for (size_t i = 0; i < materials.size(); ++i) {
+        put(materials[i].color, tracer.materials[i].color);
+        materials[i].reserved = 0.0f;
+    }
+    std::vector<SceneLight> lights(header.lightCount);
+    for (size_t i = 0; i < lights.size(); ++i) {
+        const Light& light = tracer.lights[i];
+        put(lights[i].position, light.position);
+        lights[i].intensity = light.intensity;
+        lights[i].shape = static_cast<uint32_t>(light.shape);
+        lights[i].radius = light.radius;
+        lights[i].samples = light.samples;
+        put(lights[i].normal, light.normal);
+        put(lights[i].edgeU, light.edgeU);
+        put(lights[i].edgeV, light.edgeV);
+    }
+
+    // Write to a temporary name first, so a reader never maps a half-written cache
+    std::string tempPath = path + ".tmp";
+    std::ofstream file(tempPath, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open " << tempPath << " for writing" << std::endl;
+        return false;
+    }
+    uint64_t written = 0;
+    auto write = [&](uint64_t offset, const void* data, uint64_t size) {
+        static const char zeros[kAlignment] = {};
+        file.write(zeros, static_cast<std::streamsize>(offset - written));
+        file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+        written = offset + size;
+    };
+    write(0, &header, sizeof(header));
+    write(header.sphereOffset, tracer.spheres.data(), tracer.spheres.size() * sizeof(Sphere));
+    write(header.materialIndexOffset, tracer.sphereMaterials.data(), tracer.sphereMaterials.size() * sizeof(uint32_t));
+    write(header.materialOffset, materials.data(), materials.size() * sizeof(SceneMaterial));
+    write(header.velocityOffset, tracer.sphereVelocities.data(), tracer.sphereVelocities.size() * sizeof(Vec3));
+    write(header.lightOffset, lights.data(), lights.size() * sizeof(SceneLight));
+    write(header.nodeOffset, bvh.getNodes().data(), bvh.getNodes().size() * sizeof(BVHNode));
+    write(header.indexOffset, bvh.getPrimIndex().data(), bvh.getPrimIndex().size() * sizeof(int32_t));
+    file.close();
+    if (!file || std::rename(tempPath.c_str(), path.c_str()) != 0) {
+        std::cerr << "Failed to write " << path << std::endl;
+        std::remove(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,40 @@
+#ifndef SCENE_HPP
+#define SCENE_HPP
+
+#include <string>
+#include "raytracer.hpp"
+
+// Scene files for the tracer: spheres, lights, ground plane, camera, lens and
+// shutter. Loading replaces the spheres and lights, turns the plane off unless
+// the file has one, and commits the scene. Camera, lens and shutter keep the
+// tracer's values when a text file doesn't set them.
+//
+// Text form, one statement per line, # starts a comment:
+//   camera  px py pz  tx ty tz  ux uy uz   position, look-at target, up
+//   lens    aperture focusDistance
+//   shutter seconds
+//   plane   px py pz  nx ny nz  r g b      point, normal, color
+//   light   px py pz  intensity
+//   light   sphere  cx cy cz  radius  intensity  [samples]
+//   light   disk    cx cy cz  nx ny nz  radius  intensity  [samples]       lights the side n points to
+//   light   quad    cx cy cz  ux uy uz  vx vy vz  intensity  [samples]    perpendicular edges, lights the u x v side
+//   sphere  cx cy cz  radius  r g b  [vx vy vz]
+//
+// Binary form: a fixed header followed by the sphere, light and BVH arrays,
+// little-endian floats as in memory. It is memory-mapped and copied into the
+// tracer in bulk, and the saved BVH is reused, so nothing is parsed or rebuilt.
+// All functions print what went wrong to std::cerr and return false on errors.
+
+// Text or binary, told apart by the binary magic. For a text file the binary
+// cache path + ".bin" is used when it's at least as new as the text, otherwise
+// the text is parsed and the cache (re)written if useCache is set.
+bool loadScene(const std::string& path, RayTracer& tracer, bool useCache = true);
+
+bool loadSceneText(const std::string& path, RayTracer& tracer);
+bool loadSceneBinary(const std::string& path, RayTracer& tracer);
+
+// Writes the tracer's committed scene. The binary form includes its BVH.
+bool saveSceneText(const std::string& path, const RayTracer& tracer);
+bool saveSceneBinary(const std::string& path, const RayTracer& tracer);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef SIMD_HPP
+#define SIMD_HPP
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define RAYTRACER_SIMD 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define RAYTRACER_SIMD 1
+#else
+#define RAYTRACER_SIMD 0
+#endif
+
+// Thin wrappers so the kernels are written once for AVX and SSE.
+// Masks are full-width floats like the compare instructions produce.
+// Lane indices are carried as floats, exact up to 2^24.
+namespace simd {
+
+#if defined(__AVX__)
+constexpr int kWidth = 8;
+using vfloat = __m256;
+inline vfloat vset1(float x) { return _mm256_set1_ps(x); }
+inline vfloat vload(const float* p) { return _mm256_loadu_ps(p); }
+inline void vstore(float* p, vfloat a) { _mm256_storeu_ps(p, a); }
+inline vfloat vadd(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+inline vfloat vsub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+inline vfloat vmul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+inline vfloat vdiv(vfloat a, vfloat b) { return _mm256_div_ps(a, b); }
+inline vfloat vsqrt(vfloat a) { return _mm256_sqrt_ps(a); }
+inline vfloat vmin(vfloat a, vfloat b) { return _mm256_min_ps(a, b); }
+inline vfloat vmax(vfloat a, vfloat b) { return _mm256_max_ps(a, b); }
+inline vfloat vlt(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+inline vfloat vle(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+inline vfloat vge(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+inline vfloat vneq(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_OQ); }
+inline vfloat vand(vfloat a, vfloat b) { return _mm256_and_ps(a, b); }
+inline vfloat vor(vfloat a, vfloat b) { return _mm256_or_ps(a, b); }
+inline vfloat vselect(vfloat mask, vfloat a, vfloat b) { return _mm256_blendv_ps(b, a, mask); }
+inline int vmovemask(vfloat a) { return _mm256_movemask_ps(a); }
+inline vfloat vlanes() { return _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7); }
+#elif defined(__SSE2__)
+constexpr int kWidth = 4;
+using vfloat = __m128;
+inline vfloat vset1(float x) { return _mm_set1_ps(x); }
+inline vfloat vload(const float* p) { return _mm_loadu_ps(p); }
+inline void vstore(float* p, vfloat a) { _mm_storeu_ps(p, a); }
+inline vfloat vadd(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+inline vfloat vsub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+inline vfloat vmul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+inline vfloat vdiv(vfloat a, vfloat b) { return _mm_div_ps(a, b); }
+inline vfloat vsqrt(vfloat a) { return _mm_sqrt_ps(a); }
+inline vfloat vmin(vfloat a, vfloat b) { return _mm_min_ps(a, b); }
+inline vfloat vmax(vfloat a, vfloat b) { return _mm_max_ps(a, b); }
+inline vfloat vlt(vfloat a, vfloat b) { return _mm_cmplt_ps(a, b); }
+inline vfloat vle(vfloat a, vfloat b) { return _mm_cmple_ps(a, b); }
+inline vfloat vge(vfloat a, vfloat b) { return _mm_cmpge_ps(a, b); }
+inline vfloat vneq(vfloat a, vfloat b) { return _mm_cmpneq_ps(a, b); }
+inline vfloat vand(vfloat a, vfloat b) { return _mm_and_ps(a, b); }
+inline vfloat vor(vfloat a, vfloat b) { return _mm_or_ps(a, b); }
+inline vfloat vselect(vfloat mask, vfloat a, vfloat b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+inline int vmovemask(vfloat a) { return _mm_movemask_ps(a); }
+inline vfloat vlanes() { return _mm_setr_ps(0, 1, 2, 3); }
+#else
+constexpr int kWidth = 1;
+#endif
+
+}
+
+#endif
@@ -0,0 +1,260 @@
+#include "spheresoa.hpp"
+#include "simd.hpp"
+
+using namespace simd;
+
+
+int SphereSoA::simdWidth() {
+    return kWidth;
+}
+
+void SphereSoA::build(const std::vector<Sphere>& spheres, const std::vector<Vec3>& velocities) {
+    count = static_cast<int>(spheres.size());
+    size_t padded = (spheres.size() / kWidth + 2) * kWidth;
+
+    // Padding spheres have a negative radius squared, the discriminant is never >= 0
+    cx.assign(padded, 0.0f);
+    cy.assign(padded, 0.0f);
+    cz.assign(padded, 0.0f);
+    r2.assign(padded, -1.0f);
+    moving = false;
+    for (int i = 0; i < count; ++i) {
+        cx[i] = spheres[i].center.x;
+        cy[i] = spheres[i].center.y;
+        cz[i] = spheres[i].center.z;
+        r2[i] = spheres[i].radius * spheres[i].radius;
+    }
+    for (const Vec3& v : velocities) moving = moving || v.x != 0.0f || v.y != 0.0f || v.z != 0.0f;
+
+    vx.clear();
+    vy.clear();
+    vz.clear();
+    if (!moving) return;
+    vx.assign(padded, 0.0f);
+    vy.assign(padded, 0.0f);
+    vz.assign(padded, 0.0f);
+    for (int i = 0; i < count; ++i) {
+        vx[i] = velocities[i].x;
+        vy[i] = velocities[i].y;
+        vz[i] = velocities[i].z;
+    }
+}
+
+size_t SphereSoA::memoryBytes() const {
+    size_t floats = cx.capacity() + cy.capacity() + cz.capacity() + r2.capacity() +
+                    vx.capacity() + vy.capacity() + vz.capacity();
+    return floats * sizeof(float);
+}
+
+// Center of sphere i at the given shutter time
+inline Vec3 SphereSoA::center(int i, float time) const {
+    if (!moving) return Vec3(cx[i], cy[i], cz[i]);
+    return Vec3(cx[i] + vx[i] * time, cy[i] + vy[i] * time, cz[i] + vz[i] * time);
+}
+
+// Same root selection as Sphere::intersect, with the factor 2 folded out of b:
+// t = (-b -+ sqrt(b^2 - a*c)) / a for b = oc.d
+#if RAYTRACER_SIMD
+
+int SphereSoA::intersectClosest(const Ray& ray, int begin, int end, float& tClosest) const {
+    const float a = ray.direction.dot(ray.direction);
+    const vfloat va = vset1(a), invA = vset1(1.0f / a), zero = vset1(0.0f);
+    const vfloat ox = vset1(ray.origin.x), oy = vset1(ray.origin.y), oz = vset1(ray.origin.z);
+    const vfloat dx = vset1(ray.direction.x), dy = vset1(ray.direction.y), dz = vset1(ray.direction.z);
+    const vfloat lanes = vlanes(), vend = vset1(static_cast<float>(end)), time = vset1(ray.time);
+
+    vfloat best = vset1(tClosest);
+    vfloat bestIndex = vset1(-1.0f);
+    for (int i = begin; i < end; i += kWidth) {
+        vfloat ccx = vload(&cx[i]), ccy = vload(&cy[i]), ccz = vload(&cz[i]);
+        if (moving) {
+            ccx = vadd(ccx, vmul(vload(&vx[i]), time));
+            ccy = vadd(ccy, vmul(vload(&vy[i]), time));
+            ccz = vadd(ccz, vmul(vload(&vz[i]), time));
+        }
+        vfloat ocx = vsub(ox, ccx);
+        vfloat ocy = vsub(oy, ccy);
+        vfloat ocz = vsub(oz, ccz);
+        vfloat b = vadd(vadd(vmul(ocx, dx), vmul(ocy, dy)), vmul(ocz, dz));
+        vfloat c = vsub(vadd(vadd(vmul(ocx, ocx), vmul(ocy, ocy)), vmul(ocz, ocz)), vload(&r2[i]));
+        vfloat disc = vsub(vmul(b, b), vmul(va, c));
+        vfloat hitDisc = vge(disc, zero);
+        if (!vmovemask(hitDisc)) continue;  // Most blocks miss entirely, skip the sqrt
+
+        vfloat s = vsqrt(vmax(disc, zero));
+        vfloat t1 = vmul(vsub(vsub(zero, b), s), invA);
+        vfloat t2 = vmul(vadd(vsub(zero, b), s), invA);
+        vfloat t = vselect(vlt(zero, t1), t1, t2);
+
+        vfloat index = vadd(vset1(static_cast<float>(i)), lanes);
+        vfloat hit = vand(vand(hitDisc, vlt(zero, t)), vand(vlt(t, best), vlt(index, vend)));
+        best = vselect(hit, t, best);
+        bestIndex = vselect(hit, index, bestIndex);
+    }
+
+    // Horizontal reduction, lowest index wins ties like the scalar loop
+    float lanesT[kWidth], lanesIndex[kWidth];
+    vstore(lanesT, best);
+    vstore(lanesIndex, bestIndex);
+    int hitIndex = -1;
+    for (int l = 0; l < kWidth; ++l) {
+        if (lanesIndex[l] < 0) continue;
+        int index = static_cast<int>(lanesIndex[l]);
+        if (lanesT[l] < tClosest || (lanesT[l] == tClosest && index < hitIndex)) {
+            tClosest = lanesT[l];
+            hitIndex = index;
+        }
+    }
+    return hitIndex;
+}
+
+int SphereSoA::intersectAny(const Ray& ray, int begin, int end, float tMax, int skip) const {
+    const float a = ray.direction.dot(ray.direction);
+    const vfloat va = vset1(a), zero = vset1(0.0f);
+    const vfloat ox = vset1(ray.origin.x), oy = vset1(ray.origin.y), oz = vset1(ray.origin.z);
+    const vfloat dx = vset1(ray.direction.x), dy = vset1(ray.direction.y), dz = vset1(ray.direction.z);
+    const vfloat lanes = vlanes(), vend = vset1(static_cast<float>(end)), time = vset1(ray.time);
+    const vfloat vskip = vset1(static_cast<float>(skip)), scaledMax = vset1(tMax * a);
+
+    for (int i = begin; i < end; i += kWidth) {
+        vfloat ccx = vload(&cx[i]), ccy = vload(&cy[i]), ccz = vload(&cz[i]);
+        if (moving) {
+            ccx = vadd(ccx, vmul(vload(&vx[i]), time));
+            ccy = vadd(ccy, vmul(vload(&vy[i]), time));
+            ccz = vadd(ccz, vmul(vload(&vz[i]), time));
+        }
+        vfloat ocx = vsub(ox, ccx);
+        vfloat ocy = vsub(oy, ccy);
+        vfloat ocz = vsub(oz, ccz);
+        vfloat b = vadd(vadd(vmul(ocx, dx), vmul(ocy, dy)), vmul(ocz, dz));
+        vfloat c = vsub(vadd(vadd(vmul(ocx, ocx), vmul(ocy, ocy)), vmul(ocz, ocz)), vload(&r2[i]));
+        vfloat disc = vsub(vmul(b, b), vmul(va, c));
+        vfloat hitDisc = vge(disc, zero);
+        if (!vmovemask(hitDisc)) continue;  // Most blocks miss entirely, skip the sqrt
+
+        // Roots scaled by a are -b -+ s. Same root choice as intersectClosest, but
+        // only compared against (0, tMax * a) instead of computing t
+        vfloat s = vsqrt(vmax(disc, zero));
+        vfloat near = vsub(vsub(zero, b), s), far = vsub(s, b);
+        vfloat nearHit = vand(vlt(zero, near), vlt(near, scaledMax));
+        vfloat farHit = vand(vle(near, zero), vand(vlt(zero, far), vlt(far, scaledMax)));
+
+        vfloat index = vadd(vset1(static_cast<float>(i)), lanes);
+        vfloat hit = vand(vand(hitDisc, vor(nearHit, farHit)), vand(vlt(index, vend), vneq(index, vskip)));
+        int mask = vmovemask(hit);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return -1;
+}
+
+// One sphere at a time against all rays of the packet, unless so few rays are
+// active that going ray by ray over the spheres needs fewer kernel iterations
+void SphereSoA::intersectPacket(RayPacket& packet, int begin, int end, uint32_t activeMask) const {
+    int activeChunks = 0;
+    for (int first = 0; first < packet.size; first += kWidth) {
+        if ((activeMask >> first) & ((1u << kWidth) - 1)) ++activeChunks;
+    }
+    int perRay = __builtin_popcount(activeMask) * ((end - begin + kWidth - 1) / kWidth);
+    if (perRay < (end - begin) * activeChunks) {
+        for (int r = 0; r < packet.size; ++r) {
+            if (!(activeMask & (1u << r))) continue;
+            int h = intersectClosest(packet.ray(r), begin, end, packet.tClosest[r]);
+            if (h >= 0) packet.hit[r] = h;
+        }
+        return;
+    }
+
+    const vfloat zero = vset1(0.0f);
+    alignas(32) float lanesT[kWidth];
+    for (int i = begin; i < end; ++i) {
+        const vfloat scx = vset1(cx[i]), scy = vset1(cy[i]), scz = vset1(cz[i]), sr2 = vset1(r2[i]);
+        const bool sphereMoves = moving && (vx[i] != 0.0f || vy[i] != 0.0f || vz[i] != 0.0f);
+        for (int first = 0; first < packet.size; first += kWidth) {
+            uint32_t chunkMask = (activeMask >> first) & ((1u << kWidth) - 1);
+            if (!chunkMask) continue;
+
+            // Rays of a packet carry different times, so a moving center differs per lane
+            vfloat ccx = scx, ccy = scy, ccz = scz;
+            if (sphereMoves) {
+                vfloat time = vload(&packet.time[first]);
+                ccx = vadd(ccx, vmul(vset1(vx[i]), time));
+                ccy = vadd(ccy, vmul(vset1(vy[i]), time));
+                ccz = vadd(ccz, vmul(vset1(vz[i]), time));
+            }
+            vfloat ocx = vsub(vload(&packet.ox[first]), ccx);
+            vfloat ocy = vsub(vload(&packet.oy[first]), ccy);
+            vfloat ocz = vsub(vload(&packet.oz[first]), ccz);
+            vfloat b = vadd(vadd(vmul(ocx, vload(&packet.dx[first])), vmul(ocy, vload(&packet.dy[first]))),
+                            vmul(ocz, vload(&packet.dz[first])));
+            vfloat c = vsub(vadd(vadd(vmul(ocx, ocx), vmul(ocy, ocy)), vmul(ocz, ocz)), sr2);
+            vfloat a = vload(&packet.dirDot[first]);
+            vfloat disc = vsub(vmul(b, b), vmul(a, c));
+            vfloat hitDisc = vge(disc, zero);
+            if (!(vmovemask(hitDisc) & chunkMask)) continue;
+
+            vfloat s = vsqrt(vmax(disc, zero));
+            // Multiply by 1/a like intersectClosest, so packets hit bit for bit where single rays do
+            vfloat invA = vload(&packet.invDirDot[first]);
+            vfloat t1 = vmul(vsub(vsub(zero, b), s), invA);
+            vfloat t2 = vmul(vadd(vsub(zero, b), s), invA);
+            vfloat t = vselect(vlt(zero, t1), t1, t2);
+            vfloat hit = vand(hitDisc, vand(vlt(zero, t), vlt(t, vload(&packet.tClosest[first]))));
+
+            uint32_t hitMask = static_cast<uint32_t>(vmovemask(hit)) & chunkMask;
+            if (!hitMask) continue;
+            vstore(lanesT, t);
+            for (int l = 0; l < kWidth; ++l) {
+                if (hitMask & (1u << l)) {
+                    packet.tClosest[first + l] = lanesT[l];
+                    packet.hit[first + l] = i;
+                }
+            }
+        }
+    }
+}
+
+#else
+
+int SphereSoA::intersectClosest(const Ray& ray, int begin, int end, float& tClosest) const {
+    const float a = ray.direction.dot(ray.direction);
+    int hitIndex = -1;
+    for (int i = begin; i < end; ++i) {
+        Vec3 oc = ray.origin - center(i, ray.time);
+        float b = oc.dot(ray.direction);
+        float disc = b * b - a * (oc.dot(oc) - r2[i]);
+        if (disc < 0) continue;
+        float s = std::sqrt(disc);
+        float t = (-b - s) / a;
+        if (t <= 0) t = (-b + s) / a;
+        if (t > 0 && t < tClosest) {
+            tClosest = t;
+            hitIndex = i;
+        }
+    }
+    return hitIndex;
+}
+
+int SphereSoA::intersectAny(const Ray& ray, int begin, int end, float tMax, int skip) const {
+    const float a = ray.direction.dot(ray.direction);
+    for (int i = begin; i < end; ++i) {
+        if (i == skip) continue;
+        Vec3 oc = ray.origin - center(i, ray.time);
+        float b = oc.dot(ray.direction);
+        float disc = b * b - a * (oc.dot(oc) - r2[i]);
+        if (disc < 0) continue;
+        float s = std::sqrt(disc);
+        float near = -b - s, far = s - b;
+        if (near > 0 ? near < tMax * a : (far > 0 && far < tMax * a)) return i;
+    }
+    return -1;
+}
+
+void SphereSoA::intersectPacket(RayPacket& packet, int begin, int end, uint32_t activeMask) const {
+    for (int r = 0; r < packet.size; ++r) {
+        if (!(activeMask & (1u << r))) continue;
+        int h = intersectClosest(packet.ray(r), begin, end, packet.tClosest[r]);
+        if (h >= 0) packet.hit[r] = h;
+    }
+}
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef SPHERESOA_HPP
+#define SPHERESOA_HPP
+
+#include <vector>
+#include "utilities.hpp"
+#include "raypacket.hpp"
+
+// Structure-of-arrays copy of the sphere geometry (center, velocity and radius
+// squared) for the SIMD intersection kernels. Built from RayTracer::spheres by
+// commitScene(), indices match the spheres vector. Every query places the
+// spheres at the ray's time; scenes without motion skip the velocity math.
+class SphereSoA {
+public:
+    // Lanes tested per instruction: 8 with AVX, 4 with SSE, 1 otherwise
+    static int simdWidth();
+
+    // velocities is per sphere, or empty when nothing moves
+    void build(const std::vector<Sphere>& spheres, const std::vector<Vec3>& velocities = std::vector<Vec3>());
+    int size() const { return count; }
+    size_t memoryBytes() const;
+    bool hasMotion() const { return moving; }
+
+    // Nearest sphere in [begin, end) with 0 < t < tClosest. Returns its index and
+    // lowers tClosest, or returns -1 and leaves tClosest alone.
+    int intersectClosest(const Ray& ray, int begin, int end, float& tClosest) const;
+    int intersectClosest(const Ray& ray, float& tClosest) const { return intersectClosest(ray, 0, count, tClosest); }
+
+    // Some sphere in [begin, end) other than `skip` hit with 0 < t < tMax, or -1.
+    // Stops at the first block with a hit and never computes the distance.
+    int intersectAny(const Ray& ray, int begin, int end, float tMax, int skip = -1) const;
+    int intersectAny(const Ray& ray, float tMax, int skip = -1) const { return intersectAny(ray, 0, count, tMax, skip); }
+
+    // Packet version of intersectClosest for the rays in activeMask. Updates
+    // tClosest and hit (as an index into this SoA) of the rays that get closer.
+    void intersectPacket(RayPacket& packet, int begin, int end, uint32_t activeMask) const;
+
+private:
+    using FloatArray = std::vector<float, AlignedAllocator<float>>;
+
+    Vec3 center(int i, float time) const;
+
+    int count = 0;
+    bool moving = false;  // Some velocity is non-zero
+    // Padded past count with spheres that can never be hit, so the kernels
+    // can always load a full vector
+    FloatArray cx, cy, cz, r2;
+    FloatArray vx, vy, vz;  // Empty unless moving
+};
+
+#endif
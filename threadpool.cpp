@@ -0,0 +1,110 @@
+#include "threadpool.hpp"
+
+ThreadPool::ThreadPool(int threadCount) {
+    if (threadCount <= 0) {
+        threadCount = static_cast<int>(std::thread::hardware_concurrency());
+        if (threadCount <= 0) threadCount = 1;
+    }
+
+    for (int i = 0; i < threadCount; ++i) {
+        queues.emplace_back(new WorkQueue());
+    }
+    // Worker 0 is whoever calls parallelFor
+    for (int i = 1; i < threadCount; ++i) {
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int, int)>& fn) {
+    if (count <= 0) return;
+
+    int participants = size();
+    if (participants == 1) {
+        for (int i = 0; i < count; ++i) fn(i, 0);
+        return;
+    }
+
+    // Contiguous blocks keep neighbouring tiles on one worker until someone steals
+    for (int q = 0; q < participants; ++q) {
+        int begin = static_cast<int>(static_cast<int64_t>(count) * q / participants);
+        int end = static_cast<int>(static_cast<int64_t>(count) * (q + 1) / participants);
+        std::lock_guard<std::mutex> lock(queues[q]->mutex);
+        for (int i = begin; i < end; ++i) queues[q]->items.push_back(i);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        task = &fn;
+        busyWorkers = static_cast<int>(workers.size());
+        ++generation;
+    }
+    wake.notify_all();
+
+    runQueues(0, fn);
+
+    // Workers may still be finishing stolen items, fn must outlive them
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return busyWorkers == 0; });
+    task = nullptr;
+}
+
+void ThreadPool::workerLoop(int worker) {
+    uint64_t seen = 0;
+    while (true) {
+        const std::function<void(int, int)>* current;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            current = task;
+        }
+
+        runQueues(worker, *current);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--busyWorkers == 0) done.notify_all();
+    }
+}
+
+void ThreadPool::runQueues(int worker, const std::function<void(int, int)>& fn) {
+    int item;
+    while (popLocal(worker, item) || steal(worker, item)) {
+        fn(item, worker);
+    }
+}
+
+bool ThreadPool::popLocal(int worker, int& item) {
+    WorkQueue& queue = *queues[worker];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.items.empty()) return false;
+    item = queue.items.front();
+    queue.items.pop_front();
+    return true;
+}
+
+bool ThreadPool::steal(int worker, int& item) {
+    // Thieves take from the far end so the owner keeps its coherent run of tiles
+    int participants = size();
+    for (int offset = 1; offset < participants; ++offset) {
+        WorkQueue& victim = *queues[(worker + offset) % participants];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.items.empty()) {
+            item = victim.items.back();
+            victim.items.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,54 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent pool of worker threads with per-worker work-stealing queues.
+// The calling thread takes part in every parallelFor, so a pool of size 1
+// runs everything inline without spawning any threads.
+class ThreadPool {
+public:
+    // threadCount <= 0 picks std::thread::hardware_concurrency()
+    explicit ThreadPool(int threadCount = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return static_cast<int>(queues.size()); }
+
+    // Runs task(index, worker) for every index in [0, count) and blocks until all are done.
+    // Indices are dealt out in contiguous blocks, idle workers steal from the others.
+    void parallelFor(int count, const std::function<void(int, int)>& task);
+
+private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<int> items;
+    };
+
+    void workerLoop(int worker);
+    void runQueues(int worker, const std::function<void(int, int)>& task);
+    bool popLocal(int worker, int& item);
+    bool steal(int worker, int& item);
+
+    std::vector<std::unique_ptr<WorkQueue>> queues;  // One per participant, caller is 0
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(int, int)>* task = nullptr;
+    uint64_t generation = 0;
+    int busyWorkers = 0;
+    bool stopping = false;
+};
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef TRIPLEBUFFER_HPP
+#define TRIPLEBUFFER_HPP
+
+#include <atomic>
+#include <cstdint>
+
+// Lock-free hand-off of whole frames from one producer thread to one consumer
+// thread. Only slot indices 0..2 move around, the caller owns the three slots.
+// The producer always has a slot to write, the consumer always has the newest
+// published one to read, and neither ever waits for the other; frames the
+// consumer doesn't pick up in time are simply overwritten.
+class TripleBuffer {
+public:
+    // Producer side: slot to fill next
+    int writeIndex() const { return back; }
+    // Producer side: hands the written slot over and gets a free one back
+    void publish() {
+        uint8_t previous = middle.exchange(static_cast<uint8_t>(back | kFresh), std::memory_order_acq_rel);
+        back = previous & kIndexMask;
+    }
+
+    // Consumer side: true if a frame was published since the last acquire()
+    bool hasNewFrame() const { return (middle.load(std::memory_order_acquire) & kFresh) != 0; }
+    // Consumer side: switches readIndex() to the newest frame, false if there is none.
+    // The slot read before is handed back to the producer.
+    bool acquire() {
+        if (!hasNewFrame()) return false;
+        front = middle.exchange(front, std::memory_order_acq_rel) & kIndexMask;
+        return true;
+    }
+    int readIndex() const { return front; }
+
+private:
+    static constexpr uint8_t kIndexMask = 3;
+    static constexpr uint8_t kFresh = 4;
+
+    std::atomic<uint8_t> middle{1};  // Slot between the two sides, plus the fresh flag
+    uint8_t back = 0;                // Only touched by the producer
+    uint8_t front = 2;               // Only touched by the consumer
+};
+
+#endif
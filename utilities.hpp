@@ -2,6 +2,9 @@
 #define UTILITIES_HPP
 
 #include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
 
 struct Vec3 {
     float x, y, z;
@@ -65,22 +68,55 @@ struct Vec3 {
     }
 };
 
+// Rec. 709 luminance of a linear color
+inline float luminance(const Vec3& c) {
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+
+// Allocator for SIMD-friendly arrays, e.g. std::vector<float, AlignedAllocator<float>>
+template <typename T, size_t Alignment = 32>
+struct AlignedAllocator {
+    using value_type = T;
+    template <typename U> struct rebind { using other = AlignedAllocator<U, Alignment>; };
+
+    AlignedAllocator() = default;
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(size_t n) {
+        // aligned_alloc wants the size to be a multiple of the alignment
+        size_t bytes = (n * sizeof(T) + Alignment - 1) / Alignment * Alignment;
+        if (bytes == 0) bytes = Alignment;
+        void* p = std::aligned_alloc(Alignment, bytes);
+        if (!p) throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+    void deallocate(T* p, size_t) { std::free(p); }
+
+    bool operator==(const AlignedAllocator&) const { return true; }
+    bool operator!=(const AlignedAllocator&) const { return false; }
+};
+
 
 struct Ray {
     Vec3 origin;
     Vec3 direction;
+    float time;  // Seconds after the shutter opened, moving geometry is placed at this time
 
-    Ray(const Vec3& origin, const Vec3& direction)
-        : origin(origin), direction(direction) {}
+    Ray(const Vec3& origin, const Vec3& direction, float time = 0.0f)
+        : origin(origin), direction(direction), time(time) {}
 };
 
+// Intersection data of a sphere, 16 bytes so four fit in a cache line. Color
+// and motion live next to it in RayTracer (sphereMaterials, sphereVelocities).
 class Sphere {
 public:
-    Vec3 center, color, velocity;
+    Vec3 center;
     float radius;
 
-    Sphere(Vec3 c, float r, Vec3 col, Vec3 v = Vec3(0, 0, 0))
-        : center(c), radius(r), color(col), velocity(v) {}
+    Sphere() : radius(0.0f) {}
+    Sphere(Vec3 c, float r) : center(c), radius(r) {}
+    // Against the sphere at center, motion is the tracer's business
     float intersect(const Ray& ray) const {
         Vec3 oc = ray.origin - center;
         float a = ray.direction.dot(ray.direction);
@@ -96,15 +132,68 @@ public:
         return (t1 > 0) ? t1 : ((t2 > 0) ? t2 : -1.0f);
     }
 };
+static_assert(sizeof(Sphere) == 16, "Sphere is the hot intersection data, keep it at 16 bytes");
 
+// Shading data shared by any number of spheres
+struct Material {
+    Vec3 color;
+
+    Material(const Vec3& color) : color(color) {}
+};
+
+enum class LightShape { Point, Sphere, Disk, Quad };
+
+// A point light shines with intensity * cos on everything it sees, at any
+// distance. An area light gives the same from its center seen head-on, spread
+// over the directions it covers: a disk or quad seen at an angle covers less
+// and gives less, and disks and quads only light the side they face.
 struct Light {
-    Vec3 position;
+    Vec3 position;  // Center for area lights
     float intensity;
+    LightShape shape = LightShape::Point;
+    float radius = 0.0f;  // Sphere and disk
+    Vec3 normal;          // Disk, unit, points to the side it lights
+    Vec3 edgeU, edgeV;    // Quad, perpendicular edges; it lights the side edgeU x edgeV points to
+    int samples = 0;      // Shadow rays per shading point, 0 = RayTracer::shadowSamples
 
     Light(const Vec3& position, float intensity)
         : position(position), intensity(intensity) {}
+
+    bool operator==(const Light& other) const {
+        auto same = [](const Vec3& a, const Vec3& b) { return a.x == b.x && a.y == b.y && a.z == b.z; };
+        return same(position, other.position) && intensity == other.intensity && shape == other.shape &&
+               radius == other.radius && same(normal, other.normal) && same(edgeU, other.edgeU) &&
+               same(edgeV, other.edgeV) && samples == other.samples;
+    }
+    bool operator!=(const Light& other) const { return !(*this == other); }
 };
 
+inline Light sphereLight(const Vec3& center, float radius, float intensity, int samples = 0) {
+    Light light(center, intensity);
+    light.shape = LightShape::Sphere;
+    light.radius = radius;
+    light.samples = samples;
+    return light;
+}
+
+inline Light diskLight(const Vec3& center, const Vec3& normal, float radius, float intensity, int samples = 0) {
+    Light light(center, intensity);
+    light.shape = LightShape::Disk;
+    light.normal = normal.normalize();
+    light.radius = radius;
+    light.samples = samples;
+    return light;
+}
+
+inline Light quadLight(const Vec3& center, const Vec3& edgeU, const Vec3& edgeV, float intensity, int samples = 0) {
+    Light light(center, intensity);
+    light.shape = LightShape::Quad;
+    light.edgeU = edgeU;
+    light.edgeV = edgeV;
+    light.samples = samples;
+    return light;
+}
+
 
 // Camera class
 class Camera {